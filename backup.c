@@ -0,0 +1,1880 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+
+/*
+ * A backup job describes one version to be taken of a file.  It is
+ * queued by ->release and carried out later by a worker thread, so the
+ * closing process never waits for the data copy.  With coalesce_ms= it
+ * only runs once that window has passed since the close that queued it,
+ * and the closes in between are folded into it.
+ */
+struct bkpfs_backup_job {
+	struct delayed_work work;
+	struct list_head list;		/* on sbi->backup_jobs until it runs */
+	struct inode *inode;		/* upper inode (ihold'ed) */
+	struct path lower_path;		/* pinned lower path of the file */
+	loff_t size;			/* snapshot point: i_size at close */
+	const struct cred *cred;	/* closing task's, or the store's */
+	struct bkpfs_extent_map extents; /* ranges changed since last one */
+};
+
+/*
+ * A delta version only holds the byte ranges that changed since its
+ * parent version; everything else is read from the parent.  The backup
+ * file has the full logical size of the version (holes elsewhere) and
+ * carries this header in an xattr.  Versions without it are full copies.
+ */
+#define BKPFS_DELTA_XATTR	"user.bkpfs.delta"
+
+struct bkpfs_delta_extent {
+	__le64 start;
+	__le64 end;		/* exclusive */
+};
+
+struct bkpfs_delta_disk {
+	__le32 parent;		/* version the unchanged bytes come from */
+	__le32 depth;		/* deltas between this one and a full copy */
+	__le32 nr_extents;
+	__le32 reserved;
+	struct bkpfs_delta_extent extents[];
+};
+
+/*
+ * A copy-on-write version (policy "cow") is the other way round: it is
+ * started empty when a file is first written after an open, and is given
+ * the old contents of each range just before the range is overwritten.
+ * Everything else is unchanged since it started, so it is read from its
+ * parent, which is the next live version, or the main file itself
+ * (parent 0) while it is the newest one.  Its header has the layout of a
+ * delta's, depth counting the copy-on-write versions before it.
+ */
+#define BKPFS_COW_XATTR		"user.bkpfs.cow"
+
+/* bounce buffer size used to rebuild data from a chain of deltas */
+#define BKPFS_FOLD_CHUNK	(64 * 1024)
+
+/* copy [pos, pos + len) of @in to the same offset in @out, holes too */
+static int __bkpfs_copy_range(struct file *in, struct file *out,
+			      loff_t pos, loff_t len)
+{
+	loff_t end = pos + len;
+	ssize_t copied;
+
+	while (pos < end) {
+		copied = vfs_copy_file_range(in, pos, out, pos,
+					     min_t(loff_t, end - pos,
+						   MAX_RW_COUNT), 0);
+		if (copied < 0)
+			return copied;
+		if (copied == 0)
+			return -EIO;
+		pos += copied;
+	}
+	return 0;
+}
+
+/*
+ * Copy the data in [pos, pos + len) of @in to the same offset in @out,
+ * skipping the holes of @in, so sparse files stay sparse.  Where @in has
+ * holes, @out must already read as zeros: a new file, or a range that
+ * was never written.  If the lower file system can't find holes, all of
+ * the range is copied.
+ */
+int bkpfs_copy_range(struct file *in, struct file *out,
+		     loff_t pos, loff_t len)
+{
+	loff_t end = pos + len, data, hole;
+	int err;
+
+	while (pos < end) {
+		data = vfs_llseek(in, pos, SEEK_DATA);
+		/* only a hole is left */
+		if (data == -ENXIO)
+			break;
+		if (data < 0)
+			return __bkpfs_copy_range(in, out, pos, end - pos);
+		if (data >= end)
+			break;
+		hole = vfs_llseek(in, data, SEEK_HOLE);
+		if (hole <= data || hole > end)
+			hole = end;
+		err = __bkpfs_copy_range(in, out, data, hole - data);
+		if (err)
+			return err;
+		pos = hole;
+	}
+	return 0;
+}
+
+/**
+ * bkpfs_copy_data - copy @len bytes from the start of @in into @out
+ * @sb: bkpfs super block (tells whether the lower fs can reflink)
+ * @in: lower file opened for reading
+ * @out: empty lower file opened for writing
+ * @len: number of bytes to copy
+ *
+ * If the lower file system supports ->remap_file_range, the data is
+ * cloned, which costs O(extents) instead of O(bytes).  Otherwise, or if
+ * the clone is refused, the data extents of @in are copied with
+ * vfs_copy_file_range and its holes are left holes.  That may copy less
+ * than asked for (splice is capped at MAX_RW_COUNT), so keep going until
+ * all of it is copied.
+ */
+int bkpfs_copy_data(struct super_block *sb, struct file *in,
+		    struct file *out, loff_t len)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	loff_t pos = 0, cloned;
+	int err;
+
+	if (len && READ_ONCE(sbi->reflink)) {
+		cloned = vfs_clone_file_range(in, 0, out, 0, len, 0);
+		if (cloned == len)
+			return 0;
+		/* lower fs turned out not to clone after all: stop trying */
+		if (cloned == -EOPNOTSUPP)
+			WRITE_ONCE(sbi->reflink, false);
+		else if (cloned >= 0)
+			pos = cloned;
+		else if (cloned != -EXDEV && cloned != -EINVAL)
+			return cloned;
+	}
+
+	err = bkpfs_copy_range(in, out, pos, len - pos);
+	/* a hole at the end isn't copied */
+	if (!err && i_size_read(file_inode(out)) < len)
+		err = vfs_truncate(&out->f_path, len);
+	return err;
+}
+
+/**
+ * bkpfs_probe_reflink - can the lower file system clone file ranges?
+ * @sb: bkpfs super block
+ * @lower_root: lower directory we are mounted on
+ *
+ * ->remap_file_range lives in the file operations of regular files, so
+ * look at those of an unnamed temporary file in the lower directory.  If
+ * the lower fs cannot make one, assume reflink works and let the first
+ * refused clone in bkpfs_copy_data turn it off.
+ */
+void bkpfs_probe_reflink(struct super_block *sb, struct path *lower_root)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct dentry *tmp;
+	const struct file_operations *fop;
+
+	sbi->reflink = true;
+	tmp = vfs_tmpfile(lower_root->dentry, S_IFREG | 0600, O_RDWR);
+	if (IS_ERR(tmp))
+		return;
+	fop = d_inode(tmp)->i_fop;
+	sbi->reflink = fop && fop->remap_file_range;
+	dput(tmp);
+}
+
+/**
+ * bkpfs_store_subdir - find a directory of the version store
+ * @parent: directory of the store it is in
+ * @name: its name
+ * @create: make it if it doesn't exist yet
+ * @dir: filled with its path (caller must path_put it)
+ *
+ * Shard directories of the store are created on demand.
+ */
+int bkpfs_store_subdir(struct path *parent, const char *name, bool create,
+		       struct path *dir)
+{
+	struct dentry *store = parent->dentry, *dentry;
+	int len = strlen(name), err = 0;
+
+	dentry = lookup_one_len_unlocked(name, store, len);
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
+	if (d_is_negative(dentry) && create) {
+		dput(dentry);
+		inode_lock_nested(d_inode(store), I_MUTEX_PARENT);
+		dentry = lookup_one_len(name, store, len);
+		if (!IS_ERR(dentry) && d_is_negative(dentry)) {
+			err = vfs_mkdir(d_inode(store), dentry, 0700);
+			if (!err && d_is_negative(dentry))
+				err = -ENOENT;
+		}
+		inode_unlock(d_inode(store));
+		if (IS_ERR(dentry))
+			return PTR_ERR(dentry);
+	}
+	if (!err && !d_is_dir(dentry))
+		err = d_is_negative(dentry) ? -ENOENT : -ENOTDIR;
+	if (err) {
+		dput(dentry);
+		return err;
+	}
+	dir->dentry = dentry;
+	dir->mnt = mntget(parent->mnt);
+	return 0;
+}
+
+/*
+ * Where the backup file of a version lives.  By default that is
+ * ".backup.NAME.N" next to the main file.  With backupdir= it is
+ * "INO.GEN.N" in the store, in one of 256 shard directories picked by
+ * the lower inode number, so user directories don't grow with history
+ * and the versions follow the file across renames.  Fills @dir (caller
+ * must path_put it) and @name (NAME_MAX + 1 bytes).
+ */
+static int bkpfs_version_dir(struct super_block *sb, struct path *lower_path,
+			     int version, bool create, struct path *dir,
+			     char *name)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct inode *lower_inode = d_inode(lower_path->dentry);
+	char shard[4];
+
+	if (version < 1)
+		return -ENOENT;
+	if (!sbi->backup_dir.dentry) {
+		if (snprintf(name, NAME_MAX + 1, BKPFS_BACKUP_PREFIX "%s.%d",
+			     lower_path->dentry->d_name.name, version) > NAME_MAX)
+			return -ENAMETOOLONG;
+		dir->dentry = dget_parent(lower_path->dentry);
+		dir->mnt = mntget(lower_path->mnt);
+		return 0;
+	}
+	snprintf(name, NAME_MAX + 1, "%lx.%x.%d", lower_inode->i_ino,
+		 lower_inode->i_generation, version);
+	snprintf(shard, sizeof(shard), "%02lx", lower_inode->i_ino & 0xff);
+	return bkpfs_store_subdir(&sbi->backup_dir, shard, create, dir);
+}
+
+/**
+ * bkpfs_version_lookup - find the lower backup file of a version
+ * @sb: bkpfs super block
+ * @lower_path: lower path of the main file
+ * @version: version number
+ * @bkp_path: filled with the backup file's path (caller must path_put)
+ */
+int bkpfs_version_lookup(struct super_block *sb, struct path *lower_path,
+			 int version, struct path *bkp_path)
+{
+	char name[NAME_MAX + 1];
+	struct path dir;
+	int err;
+
+	err = bkpfs_version_dir(sb, lower_path, version, false, &dir, name);
+	if (err)
+		return err;
+	err = vfs_path_lookup(dir.dentry, dir.mnt, name, 0, bkp_path);
+	path_put(&dir);
+	return err;
+}
+
+/**
+ * bkpfs_version_create - create the empty lower backup file of a version
+ * @sb: bkpfs super block
+ * @lower_path: lower path of the main file
+ * @version: version number
+ * @bkp_path: filled with the backup file's path (caller must path_put)
+ *
+ * A file left over under that name by a version that is no longer in
+ * the index is replaced.
+ */
+int bkpfs_version_create(struct super_block *sb, struct path *lower_path,
+			 int version, struct path *bkp_path)
+{
+	char name[NAME_MAX + 1];
+	struct dentry *dentry;
+	struct inode *dir_inode;
+	struct path dir;
+	int err;
+
+	err = bkpfs_version_dir(sb, lower_path, version, true, &dir, name);
+	if (err)
+		return err;
+	dir_inode = d_inode(dir.dentry);
+
+	inode_lock_nested(dir_inode, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, dir.dentry, strlen(name));
+	if (!IS_ERR(dentry) && d_is_positive(dentry)) {
+		err = vfs_unlink(dir_inode, dentry, NULL);
+		dput(dentry);
+		dentry = err ? ERR_PTR(err) :
+			       lookup_one_len(name, dir.dentry, strlen(name));
+	}
+	if (IS_ERR(dentry)) {
+		err = PTR_ERR(dentry);
+	} else {
+		err = vfs_create(dir_inode, dentry, S_IFREG | 0644, true);
+		if (err) {
+			dput(dentry);
+		} else {
+			bkp_path->dentry = dentry;
+			bkp_path->mnt = mntget(dir.mnt);
+		}
+	}
+	inode_unlock(dir_inode);
+	/* a sibling of the main file: readdir has to filter it out */
+	if (!err && !BKPFS_SB(sb)->backup_dir.dentry)
+		bkpfs_note_backup(sb, dir_inode);
+	path_put(&dir);
+	return err;
+}
+
+static struct file *bkpfs_version_open(struct super_block *sb,
+				       struct path *lower_path, int version,
+				       int flags)
+{
+	struct path bkp_path;
+	struct file *file;
+	int err;
+
+	err = bkpfs_version_lookup(sb, lower_path, version, &bkp_path);
+	if (err)
+		return ERR_PTR(err);
+	file = dentry_open(&bkp_path, flags, current_cred());
+	path_put(&bkp_path);
+	return file;
+}
+
+/**
+ * bkpfs_version_manifest - open the manifest of a dedup version
+ * @sb: bkpfs super block
+ * @lower_path: lower path of the main file
+ * @version: version number
+ * @m: filled with the manifest header
+ *
+ * Returns the open backup file, NULL if the version isn't deduplicated,
+ * or an ERR_PTR.
+ */
+struct file *bkpfs_version_manifest(struct super_block *sb,
+				    struct path *lower_path, int version,
+				    struct bkpfs_manifest *m)
+{
+	struct file *file;
+	int ret;
+
+	file = bkpfs_version_open(sb, lower_path, version, O_RDONLY);
+	if (IS_ERR(file))
+		return file;
+	ret = bkpfs_dedup_get(file->f_path.dentry, m);
+	if (ret <= 0) {
+		fput(file);
+		return ERR_PTR(ret);
+	}
+	return file;
+}
+
+/*
+ * Returns the header @name of a backup file, NULL if it has none, or an
+ * ERR_PTR.  The caller kfree's the header.
+ */
+static struct bkpfs_delta_disk *bkpfs_get_header(struct dentry *bkp_dentry,
+						 const char *name)
+{
+	struct bkpfs_delta_disk *delta;
+	ssize_t size;
+
+	size = vfs_getxattr(bkp_dentry, name, NULL, 0);
+	if (size == -ENODATA || size == -EOPNOTSUPP)
+		return NULL;
+	if (size < 0)
+		return ERR_PTR(size);
+	if (size < sizeof(struct bkpfs_delta_disk))
+		return ERR_PTR(-EUCLEAN);
+
+	delta = kmalloc(size, GFP_KERNEL);
+	if (!delta)
+		return ERR_PTR(-ENOMEM);
+	if (vfs_getxattr(bkp_dentry, name, delta, size) != size ||
+	    size != sizeof(struct bkpfs_delta_disk) +
+		    le32_to_cpu(delta->nr_extents) *
+		    sizeof(struct bkpfs_delta_extent)) {
+		kfree(delta);
+		return ERR_PTR(-EUCLEAN);
+	}
+	return delta;
+}
+
+/* the delta header of a backup file, NULL if it isn't a delta */
+static struct bkpfs_delta_disk *bkpfs_get_delta(struct dentry *bkp_dentry)
+{
+	return bkpfs_get_header(bkp_dentry, BKPFS_DELTA_XATTR);
+}
+
+/* the header of a copy-on-write version, NULL for any other */
+static struct bkpfs_delta_disk *bkpfs_get_cow(struct dentry *bkp_dentry)
+{
+	return bkpfs_get_header(bkp_dentry, BKPFS_COW_XATTR);
+}
+
+/**
+ * bkpfs_read_cow - read the header of a copy-on-write version
+ * @bkp_dentry: lower dentry of the backup file
+ * @parent: set to the version the rest is read from, 0 for the main file
+ * @depth: set to the number of copy-on-write versions before it
+ * @saved: empty map, filled with the ranges the backup file holds, or NULL
+ *
+ * Returns 1 for a copy-on-write version, 0 for any other, or -errno.
+ */
+int bkpfs_read_cow(struct dentry *bkp_dentry, int *parent, int *depth,
+		   struct bkpfs_extent_map *saved)
+{
+	struct bkpfs_delta_disk *cow;
+	int err = 0;
+	u32 i;
+
+	cow = bkpfs_get_cow(bkp_dentry);
+	if (IS_ERR_OR_NULL(cow))
+		return PTR_ERR_OR_ZERO(cow);
+	*parent = le32_to_cpu(cow->parent);
+	*depth = le32_to_cpu(cow->depth);
+	for (i = 0; saved && !err && i < le32_to_cpu(cow->nr_extents); i++)
+		err = bkpfs_extent_map_add(saved,
+					   le64_to_cpu(cow->extents[i].start),
+					   le64_to_cpu(cow->extents[i].end) - 1);
+	kfree(cow);
+	return err ?: 1;
+}
+
+/**
+ * bkpfs_write_cow - write the header of a copy-on-write version
+ * @bkp_dentry: lower dentry of the backup file
+ * @parent: version the rest is read from, 0 for the main file
+ * @depth: number of copy-on-write versions before it
+ * @saved: ranges the backup file holds
+ * @size: size of the version, where @saved is cut off
+ */
+int bkpfs_write_cow(struct dentry *bkp_dentry, int parent, int depth,
+		    struct bkpfs_extent_map *saved, loff_t size)
+{
+	struct bkpfs_delta_disk *cow;
+	loff_t pos = 0, start, end;
+	u32 nr = 0;
+	int err;
+
+	/* an "all" map has no nodes but is one range */
+	cow = kzalloc(sizeof(struct bkpfs_delta_disk) +
+		      (saved->nr + 1) * sizeof(struct bkpfs_delta_extent),
+		      GFP_KERNEL);
+	if (!cow)
+		return -ENOMEM;
+	while (pos < size && bkpfs_extent_map_next(saved, pos, &start, &end) &&
+	       start < size) {
+		end = min(end, size);
+		cow->extents[nr].start = cpu_to_le64(start);
+		cow->extents[nr].end = cpu_to_le64(end);
+		nr++;
+		pos = end;
+	}
+	cow->parent = cpu_to_le32(parent);
+	cow->depth = cpu_to_le32(depth);
+	cow->nr_extents = cpu_to_le32(nr);
+	err = vfs_setxattr(bkp_dentry, BKPFS_COW_XATTR, cow,
+			   sizeof(struct bkpfs_delta_disk) +
+			   nr * sizeof(struct bkpfs_delta_extent), 0);
+	kfree(cow);
+	return err;
+}
+
+/* the size of the version held by backup file @file */
+static int bkpfs_version_size(struct file *file, loff_t *size)
+{
+	struct bkpfs_manifest m;
+	struct bkpfs_compressed c;
+	int ret;
+
+	ret = bkpfs_dedup_get(file->f_path.dentry, &m);
+	if (ret > 0) {
+		*size = m.size;
+		return 0;
+	}
+	if (!ret)
+		ret = bkpfs_compress_get(file->f_path.dentry, &c);
+	if (ret > 0) {
+		*size = c.size;
+		return 0;
+	}
+	if (!ret)
+		*size = i_size_read(file_inode(file));
+	return ret;
+}
+
+/*
+ * Read @len bytes at @pos of @file into @to, which has room for at least
+ * that much; what lies beyond EOF is zero-filled.
+ */
+ssize_t bkpfs_read_full(struct file *file, struct iov_iter *to, size_t len,
+			loff_t pos)
+{
+	size_t rest = iov_iter_count(to) - len, done = 0;
+	ssize_t ret = 0;
+
+	iov_iter_truncate(to, len);
+	while (done < len) {
+		ret = vfs_iter_read(file, to, &pos, 0);
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	iov_iter_reexpand(to, iov_iter_count(to) + rest);
+	if (ret < 0)
+		return ret;
+	if (iov_iter_zero(len - done, to) != len - done)
+		return -EFAULT;
+	return len;
+}
+
+/* what the newest copy-on-write version doesn't hold is in the main file */
+static ssize_t bkpfs_read_main(struct path *lower_path, struct iov_iter *to,
+			       size_t len, loff_t pos)
+{
+	struct file *file;
+	ssize_t ret;
+
+	file = dentry_open(lower_path, O_RDONLY, current_cred());
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	ret = bkpfs_read_full(file, to, len, pos);
+	fput(file);
+	return ret;
+}
+
+static ssize_t __bkpfs_read_version(struct super_block *sb,
+				    struct path *lower_path, int version,
+				    struct iov_iter *to, loff_t pos,
+				    int depth)
+{
+	struct bkpfs_delta_disk *delta;
+	struct bkpfs_manifest m;
+	struct bkpfs_compressed c;
+	struct file *file;
+	loff_t size, cur, start = 0, end = 0, next;
+	ssize_t ret;
+	size_t len, done = 0, n;
+	u32 i = 0;
+	int dedup, compressed = 0;
+
+	if (depth > BKPFS_MAX_DELTA_CHAIN)
+		return -ELOOP;
+
+	file = bkpfs_version_open(sb, lower_path, version, O_RDONLY);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	dedup = bkpfs_dedup_get(file->f_path.dentry, &m);
+	if (!dedup)
+		compressed = bkpfs_compress_get(file->f_path.dentry, &c);
+	if (dedup < 0 || compressed < 0) {
+		ret = min(dedup, compressed);
+		goto out;
+	}
+	if (dedup)
+		size = m.size;
+	else if (compressed)
+		size = c.size;
+	else
+		size = i_size_read(file_inode(file));
+	if (pos >= size) {
+		ret = 0;
+		goto out;
+	}
+	len = min_t(loff_t, iov_iter_count(to), size - pos);
+	if (dedup) {
+		ret = bkpfs_dedup_read(sb, file, &m, to, len, pos);
+		goto out;
+	}
+	if (compressed) {
+		ret = bkpfs_compress_read(sb, file, &c, to, len, pos);
+		goto out;
+	}
+
+	delta = bkpfs_get_delta(file->f_path.dentry);
+	if (!delta)
+		delta = bkpfs_get_cow(file->f_path.dentry);
+	if (IS_ERR(delta)) {
+		ret = PTR_ERR(delta);
+		goto out;
+	}
+	if (!delta) {
+		ret = bkpfs_read_full(file, to, len, pos);
+		goto out;
+	}
+
+	/* changed ranges come from this version, the rest from its parent */
+	while (done < len) {
+		cur = pos + done;
+		next = pos + len;
+		for (; i < le32_to_cpu(delta->nr_extents); i++) {
+			start = le64_to_cpu(delta->extents[i].start);
+			end = le64_to_cpu(delta->extents[i].end);
+			if (end > cur)
+				break;
+		}
+		if (i < le32_to_cpu(delta->nr_extents) && start <= cur) {
+			n = min(end, next) - cur;
+			ret = bkpfs_read_full(file, to, n, cur);
+		} else {
+			size_t rest;
+
+			if (i < le32_to_cpu(delta->nr_extents))
+				next = min(start, next);
+			n = next - cur;
+			rest = iov_iter_count(to) - n;
+			iov_iter_truncate(to, n);
+			if (le32_to_cpu(delta->parent))
+				ret = __bkpfs_read_version(sb, lower_path,
+						le32_to_cpu(delta->parent),
+						to, cur, depth + 1);
+			else
+				ret = bkpfs_read_main(lower_path, to, n, cur);
+			iov_iter_reexpand(to, iov_iter_count(to) + rest);
+			/* past the parent's EOF the file was extended */
+			if (ret >= 0 && ret < n &&
+			    iov_iter_zero(n - ret, to) != n - ret)
+				ret = -EFAULT;
+		}
+		if (ret < 0)
+			break;
+		done += n;
+	}
+	if (done == len)
+		ret = len;
+	kfree(delta);
+out:
+	fput(file);
+	return ret;
+}
+
+static ssize_t bkpfs_read_version_buf(struct super_block *sb,
+				      struct path *lower_path, int version,
+				      char *buf, size_t len, loff_t pos)
+{
+	struct kvec kvec = { .iov_base = buf, .iov_len = len };
+	struct iov_iter to;
+
+	iov_iter_kvec(&to, READ, &kvec, 1, len);
+	return __bkpfs_read_version(sb, lower_path, version, &to, pos, 0);
+}
+
+/**
+ * bkpfs_read_version - read part of a backup version
+ * @sb: bkpfs super block
+ * @lower_path: lower path of the main file
+ * @version: version number
+ * @to: destination, user or kernel memory
+ * @pos: offset in the version, updated by the bytes read
+ *
+ * Full versions are read directly; delta and copy-on-write versions are
+ * reassembled from their own ranges and their parents', and dedup and
+ * compressed versions from the chunks or blocks covering the range.
+ * Reads stop short only at the end of the version.  Returns the number
+ * of bytes read, 0 at EOF, or a negative errno.
+ */
+ssize_t bkpfs_read_version(struct super_block *sb, struct path *lower_path,
+			   int version, struct iov_iter *to, loff_t *pos)
+{
+	ssize_t ret;
+
+	ret = __bkpfs_read_version(sb, lower_path, version, to, *pos, 0);
+	if (ret > 0)
+		*pos += ret;
+	return ret;
+}
+
+/**
+ * bkpfs_version_direct - tell whether a backup file holds its version as is
+ * @bkp_dentry: lower dentry of the backup file
+ * @size: set to the size of the version
+ *
+ * Returns 1 for a full version, whose backup file can be read like any
+ * file, 0 for one bkpfs_read_version has to reassemble, or -errno.
+ */
+int bkpfs_version_direct(struct dentry *bkp_dentry, loff_t *size)
+{
+	struct bkpfs_delta_disk *delta;
+	struct bkpfs_manifest m;
+	struct bkpfs_compressed c;
+	int ret;
+
+	ret = bkpfs_dedup_get(bkp_dentry, &m);
+	if (ret > 0)
+		*size = m.size;
+	if (!ret) {
+		ret = bkpfs_compress_get(bkp_dentry, &c);
+		if (ret > 0)
+			*size = c.size;
+	}
+	if (ret)
+		return ret < 0 ? ret : 0;
+
+	*size = i_size_read(d_inode(bkp_dentry));
+	delta = bkpfs_get_delta(bkp_dentry);
+	if (!delta)
+		delta = bkpfs_get_cow(bkp_dentry);
+	if (IS_ERR(delta))
+		return PTR_ERR(delta);
+	kfree(delta);
+	return !delta;
+}
+
+/* write @version to @out by reading it, leaving holes where it is zero */
+static int bkpfs_copy_version(struct super_block *sb, struct path *lower_path,
+			      int version, loff_t size, struct file *out)
+{
+	loff_t pos, wpos;
+	size_t len;
+	ssize_t ret;
+	char *buf;
+	int err = 0;
+
+	buf = kmalloc(BKPFS_FOLD_CHUNK, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	for (pos = 0; !err && pos < size; pos += len) {
+		len = min_t(loff_t, size - pos, BKPFS_FOLD_CHUNK);
+		ret = bkpfs_read_version_buf(sb, lower_path, version, buf,
+					     len, pos);
+		if (ret < 0) {
+			err = ret;
+			break;
+		}
+		if (ret < len)
+			memset(buf + ret, 0, len - ret);
+		if (!memchr_inv(buf, 0, len))
+			continue;
+		wpos = pos;
+		ret = kernel_write(out, buf, len, &wpos);
+		if (ret < 0)
+			err = ret;
+		else if (ret != len)
+			err = -EIO;
+	}
+	kfree(buf);
+	if (!err)
+		err = vfs_truncate(&out->f_path, size);
+	return err;
+}
+
+/**
+ * bkpfs_restore_version - write the full contents of a version to @out
+ * @sb: bkpfs super block
+ * @lower_path: lower path of the main file
+ * @version: version number
+ * @out: empty lower file opened for writing
+ *
+ * Copies the full version at the root of the delta chain and then
+ * replays each delta on top of it, oldest first.  A copy-on-write version
+ * depends on newer ones, so it is simply read and written out.
+ */
+int bkpfs_restore_version(struct super_block *sb, struct path *lower_path,
+			  int version, struct file *out)
+{
+	struct file *chain[BKPFS_MAX_DELTA_CHAIN + 1];
+	struct bkpfs_delta_disk *deltas[BKPFS_MAX_DELTA_CHAIN + 1];
+	struct bkpfs_delta_disk *delta;
+	struct bkpfs_manifest m;
+	struct bkpfs_compressed c;
+	struct file *file;
+	loff_t size, start, end;
+	int depth = 0, err = 0, i;
+	u32 j;
+
+	file = bkpfs_version_open(sb, lower_path, version, O_RDONLY);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	delta = bkpfs_get_cow(file->f_path.dentry);
+	size = i_size_read(file_inode(file));
+	fput(file);
+	if (IS_ERR(delta))
+		return PTR_ERR(delta);
+	if (delta) {
+		kfree(delta);
+		return bkpfs_copy_version(sb, lower_path, version, size, out);
+	}
+
+	/* walk up to the full copy this version is based on */
+	for (;;) {
+		if (depth > BKPFS_MAX_DELTA_CHAIN) {
+			err = -ELOOP;
+			goto out;
+		}
+		file = bkpfs_version_open(sb, lower_path, version, O_RDONLY);
+		if (IS_ERR(file)) {
+			err = PTR_ERR(file);
+			goto out;
+		}
+		delta = bkpfs_get_delta(file->f_path.dentry);
+		if (IS_ERR(delta)) {
+			fput(file);
+			err = PTR_ERR(delta);
+			goto out;
+		}
+		chain[depth] = file;
+		deltas[depth++] = delta;
+		if (!delta)
+			break;
+		version = le32_to_cpu(delta->parent);
+	}
+
+	file = chain[depth - 1];
+	err = bkpfs_dedup_get(file->f_path.dentry, &m);
+	if (err > 0) {
+		err = bkpfs_dedup_restore(sb, file, &m, out);
+	} else if (!err) {
+		err = bkpfs_compress_get(file->f_path.dentry, &c);
+		if (err > 0)
+			err = bkpfs_compress_restore(sb, file, &c, out);
+		else if (!err)
+			err = bkpfs_copy_data(sb, file, out,
+					      i_size_read(file_inode(file)));
+	}
+	for (i = depth - 2; !err && i >= 0; i--) {
+		size = i_size_read(file_inode(chain[i]));
+		err = vfs_truncate(&out->f_path, size);
+		for (j = 0; !err && j < le32_to_cpu(deltas[i]->nr_extents);
+		     j++) {
+			start = le64_to_cpu(deltas[i]->extents[j].start);
+			end = min_t(loff_t, size,
+				    le64_to_cpu(deltas[i]->extents[j].end));
+			if (start < end)
+				/* a hole here has to overwrite the data below */
+				err = __bkpfs_copy_range(chain[i], out, start,
+							 end - start);
+		}
+	}
+out:
+	while (depth--) {
+		kfree(deltas[depth]);
+		fput(chain[depth]);
+	}
+	return err;
+}
+
+/**
+ * bkpfs_clone_version - replace the contents of @out by a version in place
+ * @sb: bkpfs super block
+ * @lower_path: lower path of the main file
+ * @version: version number
+ * @out: lower main file opened for writing
+ *
+ * Clones the whole version over @out in a single ->remap_file_range
+ * call, which the lower fs does atomically, so readers see either the
+ * old or the new contents.  A delta version is made a full copy first.
+ * Returns -EOPNOTSUPP if that isn't possible: the lower fs can't
+ * reflink, the version is deduplicated or compressed, or @out is longer
+ * than the version (a clone can't shrink a file).  The caller holds the main
+ * inode's backup_mutex.
+ */
+int bkpfs_clone_version(struct super_block *sb, struct path *lower_path,
+			int version, struct file *out)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct bkpfs_manifest m;
+	struct bkpfs_compressed c;
+	struct file *file;
+	loff_t size, cloned;
+	int err;
+
+	if (!READ_ONCE(sbi->reflink))
+		return -EOPNOTSUPP;
+	file = bkpfs_version_open(sb, lower_path, version, O_RDONLY);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	size = i_size_read(file_inode(file));
+	/* the data of a dedup version is spread over its chunks */
+	err = bkpfs_dedup_get(file->f_path.dentry, &m);
+	if (!err)
+		err = bkpfs_compress_get(file->f_path.dentry, &c);
+	fput(file);
+	if (err)
+		return err < 0 ? err : -EOPNOTSUPP;
+	if (!size || size < i_size_read(file_inode(out)))
+		return -EOPNOTSUPP;
+
+	err = bkpfs_materialize_version(sb, lower_path, version);
+	if (err)
+		return err;
+	file = bkpfs_version_open(sb, lower_path, version, O_RDONLY);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	cloned = vfs_clone_file_range(file, 0, out, 0, size, 0);
+	fput(file);
+	if (cloned == size)
+		return 0;
+	if (cloned >= 0)
+		return -EIO;
+	if (cloned == -EOPNOTSUPP)
+		WRITE_ONCE(sbi->reflink, false);
+	if (cloned == -EOPNOTSUPP || cloned == -EXDEV || cloned == -EINVAL)
+		return -EOPNOTSUPP;
+	return cloned;
+}
+
+/* does block [off, off + len) of @want differ from what @have holds? */
+static bool bkpfs_block_differs(const char *want, const char *have,
+				size_t have_len, size_t off, size_t len)
+{
+	size_t n = off < have_len ? min(len, have_len - off) : 0;
+
+	if (n && memcmp(want + off, have + off, n))
+		return true;
+	/* beyond @have's end, zeros come for free when the size is set */
+	return memchr_inv(want + off + n, 0, len - n) != NULL;
+}
+
+/**
+ * bkpfs_patch_version - make @out equal to a version by rewriting blocks
+ * @sb: bkpfs super block
+ * @lower_path: lower path of the main file
+ * @version: version number
+ * @out: lower main file opened for reading and writing
+ *
+ * Compares @out with the version a page at a time and writes only the
+ * runs of pages that differ, then sets the size.  Both files are read,
+ * but a mostly unchanged file is patched instead of rewritten.  Readers
+ * can see a mix of old and restored pages while this runs.
+ */
+int bkpfs_patch_version(struct super_block *sb, struct path *lower_path,
+			int version, struct file *out)
+{
+	struct kvec kvec;
+	struct iov_iter iter;
+	struct file *file;
+	char *want, *have = NULL;
+	loff_t size, out_size, pos, wpos;
+	size_t len, have_len, off, start, blk;
+	ssize_t ret;
+	int err = 0;
+
+	file = bkpfs_version_open(sb, lower_path, version, O_RDONLY);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	err = bkpfs_version_size(file, &size);
+	fput(file);
+	if (err)
+		return err;
+
+	/* drop the tail first, so it isn't compared */
+	out_size = i_size_read(file_inode(out));
+	if (out_size > size) {
+		err = vfs_truncate(&out->f_path, size);
+		if (err)
+			return err;
+		out_size = size;
+	}
+
+	want = kmalloc(BKPFS_FOLD_CHUNK, GFP_KERNEL);
+	if (want)
+		have = kmalloc(BKPFS_FOLD_CHUNK, GFP_KERNEL);
+	if (!have) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (pos = 0; !err && pos < size; pos += len) {
+		len = min_t(loff_t, size - pos, BKPFS_FOLD_CHUNK);
+		ret = bkpfs_read_version_buf(sb, lower_path, version, want,
+					     len, pos);
+		if (ret < 0) {
+			err = ret;
+			break;
+		}
+		if (ret < len)
+			memset(want + ret, 0, len - ret);
+
+		have_len = 0;
+		if (pos < out_size)
+			have_len = min_t(loff_t, len, out_size - pos);
+		if (have_len) {
+			kvec.iov_base = have;
+			kvec.iov_len = have_len;
+			iov_iter_kvec(&iter, READ, &kvec, 1, have_len);
+			ret = bkpfs_read_full(out, &iter, have_len, pos);
+			if (ret < 0) {
+				err = ret;
+				break;
+			}
+		}
+
+		/* write each run of differing pages with one call */
+		for (off = 0; !err && off < len; ) {
+			blk = min_t(size_t, len - off, PAGE_SIZE);
+			if (!bkpfs_block_differs(want, have, have_len, off,
+						 blk)) {
+				off += blk;
+				continue;
+			}
+			start = off;
+			do {
+				off += blk;
+				blk = min_t(size_t, len - off, PAGE_SIZE);
+			} while (off < len &&
+				 bkpfs_block_differs(want, have, have_len,
+						     off, blk));
+			wpos = pos + start;
+			ret = kernel_write(out, want + start, off - start,
+					   &wpos);
+			if (ret < 0)
+				err = ret;
+			else if (ret != off - start)
+				err = -EIO;
+		}
+	}
+	/* a tail of zeros was not written: extending the file makes it */
+	if (!err && i_size_read(file_inode(out)) < size)
+		err = vfs_truncate(&out->f_path, size);
+out:
+	kfree(have);
+	kfree(want);
+	return err;
+}
+
+/*
+ * Store @map's ranges of @in (up to @size) as a delta of version @parent.
+ * @out is the new, empty backup file.
+ */
+static int bkpfs_write_delta(struct file *in, struct file *out,
+			     struct bkpfs_extent_map *map, loff_t size,
+			     int parent, int depth)
+{
+	struct bkpfs_delta_disk *delta;
+	loff_t pos = 0, start, end;
+	size_t len;
+	u32 nr = 0;
+	int err;
+
+	len = sizeof(struct bkpfs_delta_disk) +
+		map->nr * sizeof(struct bkpfs_delta_extent);
+	delta = kzalloc(len, GFP_KERNEL);
+	if (!delta)
+		return -ENOMEM;
+
+	while (pos < size && bkpfs_extent_map_next(map, pos, &start, &end)) {
+		if (start >= size)
+			break;
+		end = min(end, size);
+		err = bkpfs_copy_range(in, out, start, end - start);
+		if (err)
+			goto out;
+		delta->extents[nr].start = cpu_to_le64(start);
+		delta->extents[nr].end = cpu_to_le64(end);
+		nr++;
+		pos = end;
+	}
+	delta->parent = cpu_to_le32(parent);
+	delta->depth = cpu_to_le32(depth);
+	delta->nr_extents = cpu_to_le32(nr);
+
+	/* the version has the full logical size; unchanged ranges are holes */
+	err = vfs_truncate(&out->f_path, size);
+	if (err)
+		goto out;
+	err = vfs_setxattr(out->f_path.dentry, BKPFS_DELTA_XATTR, delta,
+			   sizeof(struct bkpfs_delta_disk) +
+			   nr * sizeof(struct bkpfs_delta_extent), 0);
+out:
+	kfree(delta);
+	return err;
+}
+
+/*
+ * Write every gap between the ranges @hdr says @child holds, as read from
+ * version @from, into @child.
+ */
+static int bkpfs_fill_gaps(struct super_block *sb, struct path *lower_path,
+			   struct file *child,
+			   const struct bkpfs_delta_disk *hdr, int from)
+{
+	loff_t size, pos = 0, gap_end, start, end;
+	ssize_t ret;
+	char *buf;
+	int err = 0;
+	u32 j = 0;
+
+	buf = kmalloc(BKPFS_FOLD_CHUNK, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	size = i_size_read(file_inode(child));
+	while (!err && pos < size) {
+		gap_end = size;
+		if (j < le32_to_cpu(hdr->nr_extents)) {
+			start = le64_to_cpu(hdr->extents[j].start);
+			end = le64_to_cpu(hdr->extents[j].end);
+			if (start <= pos) {
+				pos = max(pos, end);
+				j++;
+				continue;
+			}
+			gap_end = min(start, size);
+		}
+		while (pos < gap_end) {
+			ret = bkpfs_read_version_buf(sb, lower_path, from,
+						     buf,
+						     min_t(loff_t,
+							   gap_end - pos,
+							   BKPFS_FOLD_CHUNK),
+						     pos);
+			if (ret <= 0) {
+				/* beyond the parent's EOF: holes are zeros */
+				err = ret;
+				pos = gap_end;
+				break;
+			}
+			/* the gap is a hole in @child: leave zeros as one */
+			if (!memchr_inv(buf, 0, ret)) {
+				pos += ret;
+				continue;
+			}
+			ret = kernel_write(child, buf, ret, &pos);
+			if (ret < 0)
+				err = ret;
+			if (err)
+				break;
+		}
+	}
+	kfree(buf);
+	return err;
+}
+
+/**
+ * bkpfs_fold_version - make the successor of a version self-contained
+ * @sb: bkpfs super block
+ * @lower_path: lower path of the main file
+ * @version: version about to be deleted
+ * @next: the next live version after @version (0 if none)
+ *
+ * If the next version is a delta on top of @version, the ranges it takes
+ * from @version are copied into it, so it becomes a full copy and
+ * @version can go away.
+ */
+int bkpfs_fold_version(struct super_block *sb, struct path *lower_path,
+		       int version, int next)
+{
+	struct bkpfs_delta_disk *delta = NULL;
+	struct file *child;
+	int err = 0;
+
+	if (!next)
+		return 0;
+	child = bkpfs_version_open(sb, lower_path, next, O_RDWR);
+	if (IS_ERR(child))
+		return 0;
+
+	delta = bkpfs_get_delta(child->f_path.dentry);
+	if (IS_ERR_OR_NULL(delta) ||
+	    le32_to_cpu(delta->parent) != version) {
+		err = PTR_ERR_OR_ZERO(delta);
+		delta = NULL;
+		goto out;
+	}
+
+	/* fill every gap between the child's own ranges from @version */
+	err = bkpfs_fill_gaps(sb, lower_path, child, delta, version);
+	if (!err)
+		err = vfs_removexattr(child->f_path.dentry, BKPFS_DELTA_XATTR);
+out:
+	kfree(delta);
+	fput(child);
+	return err;
+}
+
+/**
+ * bkpfs_fill_cow - make a copy-on-write version a plain full copy
+ * @sb: bkpfs super block
+ * @lower_path: lower path of the main file
+ * @version: version number
+ *
+ * Reads the ranges the version doesn't hold through its parents (or
+ * from the main file), writes them into its backup file and drops its
+ * header.  Other versions are left alone.  The caller holds the main
+ * inode's backup_mutex.
+ */
+int bkpfs_fill_cow(struct super_block *sb, struct path *lower_path,
+		   int version)
+{
+	struct bkpfs_delta_disk *cow;
+	struct file *file;
+	int err;
+
+	file = bkpfs_version_open(sb, lower_path, version, O_RDWR);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	cow = bkpfs_get_cow(file->f_path.dentry);
+	err = PTR_ERR_OR_ZERO(cow);
+	if (!IS_ERR_OR_NULL(cow)) {
+		err = bkpfs_fill_gaps(sb, lower_path, file, cow, version);
+		if (!err)
+			err = vfs_removexattr(file->f_path.dentry,
+					      BKPFS_COW_XATTR);
+		kfree(cow);
+	}
+	fput(file);
+	return err;
+}
+
+/**
+ * bkpfs_fold_cow - keep the copy-on-write version before a version whole
+ * @sb: bkpfs super block
+ * @lower_path: lower path of the main file
+ * @version: version about to be deleted
+ * @prev: the live version before it (0 if none)
+ *
+ * If @prev is a copy-on-write version reading from @version, and
+ * @version is one too, @prev takes over what @version holds of the ranges
+ * it reads from it, and then reads on from @version's parent.  Otherwise
+ * @prev is made a full copy.
+ */
+int bkpfs_fold_cow(struct super_block *sb, struct path *lower_path,
+		   int version, int prev)
+{
+	struct bkpfs_extent_map saved;
+	struct bkpfs_delta_disk *cow = NULL;
+	struct file *child, *file = NULL;
+	loff_t size, pos, start, end, gap, gap_end;
+	int parent, depth, err;
+	u32 i;
+
+	if (!prev)
+		return 0;
+	child = bkpfs_version_open(sb, lower_path, prev, O_WRONLY);
+	if (IS_ERR(child))
+		return 0;
+	bkpfs_extent_map_init(&saved);
+	err = bkpfs_read_cow(child->f_path.dentry, &parent, &depth, &saved);
+	if (err <= 0 || parent != version)
+		goto out;
+
+	file = bkpfs_version_open(sb, lower_path, version, O_RDONLY);
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		file = NULL;
+		goto out;
+	}
+	cow = bkpfs_get_cow(file->f_path.dentry);
+	if (IS_ERR(cow)) {
+		err = PTR_ERR(cow);
+		cow = NULL;
+		goto out;
+	}
+	/* the union of both fits in one header, if this doesn't overflow */
+	if (!cow || saved.nr + le32_to_cpu(cow->nr_extents) >=
+		    BKPFS_MAX_DIRTY_EXTENTS) {
+		err = bkpfs_fill_cow(sb, lower_path, prev);
+		goto out;
+	}
+
+	size = i_size_read(file_inode(child));
+	err = 0;
+	for (i = 0; !err && i < le32_to_cpu(cow->nr_extents); i++) {
+		start = le64_to_cpu(cow->extents[i].start);
+		end = min_t(loff_t, le64_to_cpu(cow->extents[i].end), size);
+		for (pos = start; !err &&
+		     bkpfs_extent_map_gap(&saved, pos, end, &gap, &gap_end);
+		     pos = gap_end) {
+			err = bkpfs_copy_range(file, child, gap, gap_end - gap);
+			if (!err)
+				err = bkpfs_extent_map_add(&saved, gap,
+							   gap_end - 1);
+		}
+	}
+	if (!err)
+		err = bkpfs_write_cow(child->f_path.dentry,
+				      le32_to_cpu(cow->parent), depth, &saved,
+				      size);
+out:
+	bkpfs_extent_map_clear(&saved);
+	kfree(cow);
+	if (file)
+		fput(file);
+	fput(child);
+	return err < 0 ? err : 0;
+}
+
+/**
+ * bkpfs_install_tmpfile - atomically put an unnamed file in place of another
+ * @dir: lower directory of @victim
+ * @tmp: lower O_TMPFILE file to install
+ * @victim: lower file to replace
+ *
+ * Rename can't take an unnamed file, so @tmp is linked under a hidden
+ * name first.  Fails with -ESTALE if @victim was moved or removed.
+ */
+int bkpfs_install_tmpfile(struct dentry *dir, struct dentry *tmp,
+			  struct dentry *victim)
+{
+	struct dentry *link;
+	char name[48];
+	int len, err;
+
+	len = snprintf(name, sizeof(name), BKPFS_BACKUP_PREFIX "tmp.%lu",
+		       d_inode(tmp)->i_ino);
+	lock_rename(dir, dir);
+	if (victim->d_parent != dir || d_unlinked(victim)) {
+		err = -ESTALE;
+		goto out;
+	}
+	link = lookup_one_len(name, dir, len);
+	if (IS_ERR(link)) {
+		err = PTR_ERR(link);
+		goto out;
+	}
+	/* left behind by a crash */
+	if (d_is_positive(link)) {
+		err = vfs_unlink(d_inode(dir), link, NULL);
+		dput(link);
+		if (err)
+			goto out;
+		link = lookup_one_len(name, dir, len);
+		if (IS_ERR(link)) {
+			err = PTR_ERR(link);
+			goto out;
+		}
+	}
+	err = vfs_link(tmp, d_inode(dir), link, NULL);
+	if (!err) {
+		err = vfs_rename(d_inode(dir), link, d_inode(dir), victim,
+				 NULL, 0);
+		if (err)
+			vfs_unlink(d_inode(dir), link, NULL);
+	}
+	dput(link);
+out:
+	unlock_rename(dir, dir);
+	return err;
+}
+
+/*
+ * Replace a dedup or compressed version by a plain copy of its data,
+ * built aside and renamed over it.  A dedup version's chunk references
+ * are dropped once it is gone.
+ */
+static int bkpfs_expand_version(struct super_block *sb,
+				struct path *lower_path, int version)
+{
+	char name[NAME_MAX + 1];
+	struct bkpfs_manifest m;
+	struct bkpfs_compressed c;
+	struct file *bkp, *out;
+	struct path dir, tmp_path;
+	int dedup, compressed = 0, err;
+
+	bkp = bkpfs_version_open(sb, lower_path, version, O_RDONLY);
+	if (IS_ERR(bkp))
+		return PTR_ERR(bkp);
+	dedup = bkpfs_dedup_get(bkp->f_path.dentry, &m);
+	if (!dedup)
+		compressed = bkpfs_compress_get(bkp->f_path.dentry, &c);
+	err = min(dedup, compressed);
+	if (err < 0 || (!dedup && !compressed))
+		goto out;
+	err = bkpfs_version_dir(sb, lower_path, version, false, &dir, name);
+	if (err)
+		goto out;
+
+	tmp_path.mnt = dir.mnt;
+	tmp_path.dentry = vfs_tmpfile(dir.dentry, S_IFREG | 0644, O_RDWR);
+	if (IS_ERR(tmp_path.dentry)) {
+		err = PTR_ERR(tmp_path.dentry);
+		goto out_dir;
+	}
+	out = dentry_open(&tmp_path, O_WRONLY, current_cred());
+	if (IS_ERR(out)) {
+		err = PTR_ERR(out);
+	} else {
+		if (dedup)
+			err = bkpfs_dedup_restore(sb, bkp, &m, out);
+		else
+			err = bkpfs_compress_restore(sb, bkp, &c, out);
+		fput(out);
+	}
+	if (!err)
+		err = bkpfs_install_tmpfile(dir.dentry, tmp_path.dentry,
+					    bkp->f_path.dentry);
+	dput(tmp_path.dentry);
+	/* the chunks can only be leaked from here on */
+	if (!err && dedup)
+		bkpfs_dedup_release(sb, bkp, &m);
+out_dir:
+	path_put(&dir);
+out:
+	fput(bkp);
+	return err;
+}
+
+/**
+ * bkpfs_materialize_version - make a version a plain full copy
+ * @sb: bkpfs super block
+ * @lower_path: lower path of the main file
+ * @version: version number
+ *
+ * Fills the ranges a delta or copy-on-write version takes from its
+ * parents into its own backup file, and replaces the chunk list of a
+ * dedup version or the blocks of a compressed one by its data, so the
+ * backup file can be read directly.  Full versions are left alone.  The
+ * caller holds the main inode's backup_mutex.
+ */
+int bkpfs_materialize_version(struct super_block *sb,
+			      struct path *lower_path, int version)
+{
+	struct bkpfs_delta_disk *delta;
+	struct path bkp_path;
+	int err, parent;
+
+	err = bkpfs_expand_version(sb, lower_path, version);
+	if (!err)
+		err = bkpfs_fill_cow(sb, lower_path, version);
+	if (err)
+		return err;
+	err = bkpfs_version_lookup(sb, lower_path, version, &bkp_path);
+	if (err)
+		return err;
+	delta = bkpfs_get_delta(bkp_path.dentry);
+	path_put(&bkp_path);
+	if (IS_ERR_OR_NULL(delta))
+		return PTR_ERR_OR_ZERO(delta);
+	parent = le32_to_cpu(delta->parent);
+	kfree(delta);
+	return bkpfs_fold_version(sb, lower_path, parent, version);
+}
+
+static void bkpfs_backup_job_free(struct bkpfs_backup_job *job)
+{
+	bkpfs_extent_map_clear(&job->extents);
+	path_put(&job->lower_path);
+	put_cred(job->cred);
+	iput(job->inode);
+	kfree(job);
+}
+
+/*
+ * Returns the version a new delta of this job can be based on, and its
+ * depth in *@depth, or 0 if the job has to store a full copy.
+ */
+static int bkpfs_delta_parent(struct bkpfs_backup_job *job, int *depth)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(job->inode->i_sb);
+	struct dentry *lower_dentry = job->lower_path.dentry;
+	struct bkpfs_delta_disk *delta;
+	struct bkpfs_vindex *vi;
+	struct bkpfs_meta meta;
+	struct path bkp_path;
+	int cur, parent, cow_depth;
+
+	/*
+	 * Clones are as cheap as deltas and need no reassembly; dedup and
+	 * compressed versions store whole files their own way.
+	 */
+	if (READ_ONCE(sbi->reflink) || sbi->dedup ||
+	    READ_ONCE(sbi->compress) || job->extents.all)
+		return 0;
+	if (bkpfs_extent_map_bytes(&job->extents, job->size) * 2 > job->size)
+		return 0;
+
+	if (bkpfs_get_meta(job->inode, lower_dentry, &meta) ||
+	    meta.num_version < 1)
+		return 0;
+	cur = meta.cur_version;
+	vi = &BKPFS_I(job->inode)->vindex;
+	if (!vi->nr || vi->ver[vi->nr - 1].flags & BKPFS_VER_NO_BASE)
+		return 0;
+
+	if (bkpfs_version_lookup(job->inode->i_sb, &job->lower_path, cur,
+				 &bkp_path))
+		return 0;
+	/* a copy-on-write version reads its gaps from the next one */
+	if (bkpfs_read_cow(bkp_path.dentry, &parent, &cow_depth, NULL)) {
+		path_put(&bkp_path);
+		return 0;
+	}
+	delta = bkpfs_get_delta(bkp_path.dentry);
+	path_put(&bkp_path);
+	if (IS_ERR(delta))
+		return 0;
+	*depth = delta ? le32_to_cpu(delta->depth) + 1 : 1;
+	kfree(delta);
+	if (*depth > BKPFS_MAX_DELTA_CHAIN)
+		return 0;
+	return cur;
+}
+
+/* does [@start, @end) of @file hold the same bytes as @version? */
+static int bkpfs_range_matches(struct super_block *sb,
+			       struct path *lower_path, int version,
+			       struct file *file, loff_t start, loff_t end,
+			       char *want, char *have)
+{
+	struct kvec kvec;
+	struct iov_iter iter;
+	size_t len;
+	ssize_t ret;
+
+	for (; start < end; start += len) {
+		len = min_t(loff_t, end - start, BKPFS_FOLD_CHUNK);
+		ret = bkpfs_read_version_buf(sb, lower_path, version, want,
+					     len, start);
+		if (ret < 0)
+			return ret;
+		if (ret < len)
+			return 0;
+		kvec.iov_base = have;
+		kvec.iov_len = len;
+		iov_iter_kvec(&iter, READ, &kvec, 1, len);
+		ret = bkpfs_read_full(file, &iter, len, start);
+		if (ret < 0)
+			return ret;
+		if (memcmp(want, have, len))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Does the file still hold what its newest version does?  Only the
+ * ranges written since that version are compared with it, so a clone or
+ * a delta doesn't read the rest of the file.  All of it is compared only
+ * when those ranges aren't known (after a restore, a delete of the
+ * newest version, a failed backup, or too many ranges), and the compare
+ * stops at the first difference.  An error reading either side counts as
+ * a change.
+ */
+static bool bkpfs_unchanged(struct bkpfs_backup_job *job,
+			    struct file *lower_file)
+{
+	struct super_block *sb = job->inode->i_sb;
+	struct bkpfs_vindex *vi = &BKPFS_I(job->inode)->vindex;
+	struct bkpfs_meta meta;
+	struct bkpfs_vslot *newest;
+	struct file *file;
+	loff_t size, pos, start, end;
+	bool whole;
+	char *buf;
+	int ret;
+
+	if (bkpfs_get_meta(job->inode, job->lower_path.dentry, &meta) ||
+	    !vi->nr)
+		return false;
+	newest = &vi->ver[vi->nr - 1];
+	file = bkpfs_version_open(sb, &job->lower_path, newest->version,
+				  O_RDONLY);
+	if (IS_ERR(file))
+		return false;
+	ret = bkpfs_version_size(file, &size);
+	fput(file);
+	if (ret || size != job->size)
+		return false;
+
+	buf = kvmalloc(2 * BKPFS_FOLD_CHUNK, GFP_KERNEL);
+	if (!buf)
+		return false;
+	whole = job->extents.all || newest->flags & BKPFS_VER_NO_BASE;
+	ret = 1;
+	for (pos = 0; ret > 0 && pos < size; pos = end) {
+		if (whole) {
+			start = pos;
+			end = size;
+		} else if (!bkpfs_extent_map_next(&job->extents, pos,
+						  &start, &end) ||
+			   start >= size) {
+			break;
+		}
+		end = min(end, size);
+		ret = bkpfs_range_matches(sb, &job->lower_path,
+					  newest->version, lower_file,
+					  start, end, buf,
+					  buf + BKPFS_FOLD_CHUNK);
+	}
+	kvfree(buf);
+	return ret > 0;
+}
+
+static void bkpfs_backup_work(struct work_struct *work)
+{
+	struct bkpfs_backup_job *job =
+		container_of(to_delayed_work(work), struct bkpfs_backup_job,
+			     work);
+	struct bkpfs_inode_info *info = BKPFS_I(job->inode);
+	struct bkpfs_sb_info *sbi = BKPFS_SB(job->inode->i_sb);
+	struct file *lower_file, *backup_file;
+	const struct cred *old_cred;
+	struct kstat stat;
+	int err, parent, version, depth = 0;
+	int compress = READ_ONCE(sbi->compress);
+	loff_t need, new_bytes = 0;
+	bool have_csum = false;
+	u32 csum;
+
+	/*
+	 * From here on, later closes queue a new job instead of merging into
+	 * this one.  That job can only get the mutex after we drop it, so
+	 * versions of one file are always taken in order.
+	 */
+	spin_lock(&sbi->backup_lock);
+	list_del_init(&job->list);
+	spin_unlock(&sbi->backup_lock);
+	mutex_lock(&info->backup_mutex);
+	spin_lock(&info->extent_lock);
+	if (info->backup_job == job)
+		info->backup_job = NULL;
+	spin_unlock(&info->extent_lock);
+
+	old_cred = override_creds(job->cred);
+
+	/* nothing to keep versions of if the file was deleted meanwhile */
+	if (d_unlinked(job->lower_path.dentry)) {
+		err = 0;
+		goto out;
+	}
+
+	lower_file = dentry_open(&job->lower_path, O_RDONLY, current_cred());
+	if (IS_ERR(lower_file)) {
+		err = PTR_ERR(lower_file);
+		goto out;
+	}
+
+	/* rewriting the same bytes doesn't make a new version */
+	if (bkpfs_unchanged(job, lower_file)) {
+		fput(lower_file);
+		goto out;
+	}
+
+	parent = bkpfs_delta_parent(job, &depth);
+	need = parent ? bkpfs_extent_map_bytes(&job->extents, job->size) :
+			job->size;
+	backup_file = bkpfs_backup(job->inode, &job->lower_path, need,
+				   &version);
+	if (IS_ERR(backup_file)) {
+		err = PTR_ERR(backup_file);
+	} else {
+		/* retention may just have retired the parent */
+		if (parent && !bkpfs_vindex_live(&info->vindex, parent))
+			parent = 0;
+		/* the stores that read the data checksum it on the way */
+		if (sbi->dedup) {
+			err = bkpfs_dedup_store(job->inode->i_sb, lower_file,
+						job->size, backup_file,
+						&new_bytes, &csum);
+			have_csum = true;
+		} else if (compress) {
+			err = bkpfs_compress_store(job->inode->i_sb,
+						   lower_file, job->size,
+						   backup_file, compress,
+						   &csum);
+			have_csum = true;
+		} else if (parent) {
+			err = bkpfs_write_delta(lower_file, backup_file,
+						&job->extents, job->size,
+						parent, depth);
+		} else {
+			err = bkpfs_copy_data(job->inode->i_sb, lower_file,
+					      backup_file, job->size);
+		}
+		if (!err && have_csum)
+			bkpfs_set_version_csum(job->inode, version, csum);
+		/* writes stop feeding a copy-on-write version before it */
+		bkpfs_cow_seal(job->inode, &job->lower_path, version, !err);
+		/*
+		 * Accounted against the maxbytes= limit.  A dedup version
+		 * is charged for the chunks it was the first to store.
+		 */
+		if (!err && !vfs_getattr(&backup_file->f_path, &stat,
+					 STATX_BLOCKS, AT_STATX_SYNC_AS_STAT))
+			bkpfs_set_version_bytes(job->inode, version,
+						((loff_t)stat.blocks << 9) +
+						new_bytes);
+		fput(backup_file);
+	}
+	fput(lower_file);
+	if (!err)
+		err = __bkpfs_sync_meta(job->inode, job->lower_path.dentry);
+out:
+	if (err) {
+		printk(KERN_ERR "bkpfs: backup of inode %lu failed %d\n",
+		       job->inode->i_ino, err);
+		/* try again at the next close, with a full copy */
+		bkpfs_mark_all(job->inode);
+		bkpfs_mark_dirty(job->inode);
+	}
+	revert_creds(old_cred);
+	mutex_unlock(&info->backup_mutex);
+
+	atomic_dec(&info->backup_pending);
+	atomic_dec(&sbi->backup_pending);
+	wake_up_all(&sbi->backup_wait);
+	bkpfs_backup_job_free(job);
+}
+
+/*
+ * Run a job now rather than at the end of its coalesce_ms= window.  The
+ * caller makes sure the job isn't freed meanwhile, by holding the lock
+ * it is published under.
+ */
+static void bkpfs_expedite_job(struct bkpfs_sb_info *sbi,
+			       struct bkpfs_backup_job *job)
+{
+	/* fails if it is already running, which is just as good */
+	if (cancel_delayed_work(&job->work))
+		queue_delayed_work(sbi->backup_wq, &job->work, 0);
+}
+
+/* run every job still waiting out its window */
+static void bkpfs_expedite_backups(struct bkpfs_sb_info *sbi)
+{
+	struct bkpfs_backup_job *job;
+
+	spin_lock(&sbi->backup_lock);
+	list_for_each_entry(job, &sbi->backup_jobs, list)
+		bkpfs_expedite_job(sbi, job);
+	spin_unlock(&sbi->backup_lock);
+}
+
+/* if a job of @info is still waiting to run, let it cover this close too */
+static bool bkpfs_merge_backup(struct bkpfs_inode_info *info, loff_t size)
+{
+	lockdep_assert_held(&info->extent_lock);
+
+	if (!info->backup_job)
+		return false;
+	info->backup_job->size = size;
+	bkpfs_extent_map_splice(&info->backup_job->extents, &info->extents);
+	return true;
+}
+
+/**
+ * bkpfs_queue_backup - schedule a new version of a file
+ * @file: the upper file being released
+ *
+ * Pins the lower path, records the current size as the snapshot point
+ * and takes over the ranges modified since the last version.  If a job
+ * for this inode is still waiting to run, it is updated instead; with
+ * coalesce_ms= that is the case for every close within the window after
+ * the one that queued it.  If BKPFS_BACKUP_QUEUE_DEPTH jobs are already
+ * pending on this super block, the waiting ones are started and the
+ * caller is throttled until a worker catches up.
+ */
+int bkpfs_queue_backup(struct file *file)
+{
+	struct inode *inode = file_inode(file);
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	struct bkpfs_backup_job *job;
+	loff_t size = i_size_read(file_inode(bkpfs_lower_file(file)));
+	bool merged;
+
+	spin_lock(&info->extent_lock);
+	merged = bkpfs_merge_backup(info, size);
+	spin_unlock(&info->extent_lock);
+	if (merged)
+		return 0;
+
+	job = kzalloc(sizeof(struct bkpfs_backup_job), GFP_KERNEL);
+	if (!job)
+		return -ENOMEM;
+	INIT_DELAYED_WORK(&job->work, bkpfs_backup_work);
+	INIT_LIST_HEAD(&job->list);
+	ihold(inode);
+	job->inode = inode;
+	pathcpy(&job->lower_path, &bkpfs_lower_file(file)->f_path);
+	path_get(&job->lower_path);
+	job->size = size;
+	/* the store belongs to whoever mounted, not to the file's users */
+	if (sbi->backup_dir.dentry)
+		job->cred = get_cred(sbi->creator_cred);
+	else
+		job->cred = get_current_cred();
+	bkpfs_extent_map_init(&job->extents);
+
+	/*
+	 * The job is counted before it is published, and queued as it is
+	 * published, so waiting for the backups of the inode or of the
+	 * super block never misses it.  A throttled close waits here,
+	 * before anything is published.
+	 */
+	if (!atomic_add_unless(&sbi->backup_pending, 1,
+			       BKPFS_BACKUP_QUEUE_DEPTH)) {
+		bkpfs_expedite_backups(sbi);
+		wait_event(sbi->backup_wait,
+			   atomic_add_unless(&sbi->backup_pending, 1,
+					     BKPFS_BACKUP_QUEUE_DEPTH));
+	}
+	spin_lock(&info->extent_lock);
+	/* another close queued one while we were throttled */
+	if (bkpfs_merge_backup(info, size)) {
+		spin_unlock(&info->extent_lock);
+		atomic_dec(&sbi->backup_pending);
+		wake_up_all(&sbi->backup_wait);
+		bkpfs_backup_job_free(job);
+		return 0;
+	}
+	bkpfs_extent_map_splice(&job->extents, &info->extents);
+	atomic_inc(&info->backup_pending);
+	info->backup_job = job;
+	spin_lock(&sbi->backup_lock);
+	list_add_tail(&job->list, &sbi->backup_jobs);
+	queue_delayed_work(sbi->backup_wq, &job->work,
+			   msecs_to_jiffies(READ_ONCE(sbi->coalesce_ms)));
+	spin_unlock(&sbi->backup_lock);
+	spin_unlock(&info->extent_lock);
+	return 0;
+}
+
+/* wait until all queued backups of @inode have been written */
+void bkpfs_wait_backups(struct inode *inode)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+
+	spin_lock(&info->extent_lock);
+	if (info->backup_job)
+		bkpfs_expedite_job(sbi, info->backup_job);
+	spin_unlock(&info->extent_lock);
+	wait_event(sbi->backup_wait, !atomic_read(&info->backup_pending));
+}
+
+/* wait until every queued backup on @sb has been written */
+void bkpfs_flush_backups(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (sbi && sbi->backup_wq) {
+		bkpfs_expedite_backups(sbi);
+		flush_workqueue(sbi->backup_wq);
+	}
+}
+
+int bkpfs_init_backup_queue(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	init_waitqueue_head(&sbi->backup_wait);
+	atomic_set(&sbi->backup_pending, 0);
+	spin_lock_init(&sbi->backup_lock);
+	INIT_LIST_HEAD(&sbi->backup_jobs);
+	sbi->backup_wq = alloc_workqueue("bkpfs_backup",
+					 WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!sbi->backup_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+/* drains any pending backups before tearing the queue down */
+void bkpfs_destroy_backup_queue(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (sbi->backup_wq) {
+		/* destroy_workqueue doesn't wait for timers */
+		bkpfs_flush_backups(sb);
+		destroy_workqueue(sbi->backup_wq);
+		sbi->backup_wq = NULL;
+	}
+}
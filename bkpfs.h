@@ -27,6 +27,17 @@
 #include <linux/sched.h>
 #include <linux/xattr.h>
 #include <linux/exportfs.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/cred.h>
+#include <linux/rbtree.h>
+#include <linux/uio.h>
+#include <linux/falloc.h>
+#include <linux/blkdev.h>
+#include <linux/crc32c.h>
+#include <linux/crypto.h>
+#include <crypto/hash.h>
+#include <crypto/sha.h>
 
 /* the file system name */
 #define BKPFS_NAME "bkpfs"
@@ -34,6 +45,69 @@
 /* bkpfs root inode number */
 #define BKPFS_ROOT_INO     1
 
+/* backup files kept next to their main file are named PREFIX.NAME.N */
+#define BKPFS_BACKUP_PREFIX	".backup."
+#define BKPFS_BACKUP_PREFIX_LEN	(sizeof(BKPFS_BACKUP_PREFIX) - 1)
+
+/* name of the virtual directory exposing the versions of a directory */
+#define BKPFS_VERSIONS_NAME	".versions"
+
+/* xattr of a main file holding its packed version metadata */
+#define BKPFS_META_XATTR	"trusted.bkpfs"
+
+/* number of versions kept of each file */
+#define BKPFS_DEFAULT_MAX_VERSIONS	4
+
+/* max backups queued per super block before ->release is throttled */
+#define BKPFS_BACKUP_QUEUE_DEPTH	64
+
+/* when versions are taken: policy=, or a file's BKPFS_POLICY_XATTR */
+enum {
+	BKPFS_POLICY_MOUNT,		/* a file's own: none, use the mount's */
+	BKPFS_POLICY_CLOSE,
+	BKPFS_POLICY_WRITES,
+	BKPFS_POLICY_BYTES,
+	BKPFS_POLICY_INTERVAL,
+	BKPFS_POLICY_OPEN,
+	BKPFS_POLICY_COW,
+	BKPFS_POLICY_NR
+};
+
+struct bkpfs_policy {
+	int kind;			/* BKPFS_POLICY_* */
+	unsigned long long arg;		/* N, B or S */
+};
+
+#define BKPFS_POLICY_XATTR		"user.bkpfs.policy"
+/* longest policy string, e.g. "interval:1000000" */
+#define BKPFS_POLICY_MAX		32
+
+/* cow_version of a file with no copy-on-write version being fed */
+#define BKPFS_COW_NONE			(-1)
+
+/* longest coalesce_ms= window: versions shouldn't wait for hours */
+#define BKPFS_MAX_COALESCE_MS		(10 * 60 * 1000)
+
+/* more modified ranges than this and the whole file is backed up */
+#define BKPFS_MAX_DIRTY_EXTENTS		128
+
+/* max number of delta versions stacked on top of a full copy */
+#define BKPFS_MAX_DELTA_CHAIN		8
+
+/* dedup: chunks are named by their SHA-256 */
+#define BKPFS_CHUNK_HASH_SIZE		SHA256_DIGEST_SIZE
+
+/* dedup: chunk reference counts are serialized by this many locks */
+#define BKPFS_CHUNK_LOCKS		16
+
+/* compress=: algorithms versions can be compressed with */
+enum {
+	BKPFS_COMP_NONE, BKPFS_COMP_LZ4, BKPFS_COMP_ZSTD, BKPFS_COMP_NR
+};
+
+/* compress=: idle transforms kept per algorithm */
+#define BKPFS_COMP_POOL			8
+
 /* useful for tracking code reachability */
 #define UDBG printk(KERN_DEFAULT "DBG:%s:%s:%d\n", __FILE__, __func__, __LINE__)
 
@@ -62,28 +136,309 @@ extern struct inode *bkpfs_iget(struct super_block *sb,
 				 struct inode *lower_inode);
 extern int bkpfs_interpose(struct dentry *dentry, struct super_block *sb,
 			    struct path *lower_path);
+extern struct inode *bkpfs_ilookup(struct super_block *sb,
+				   struct inode *lower_inode);
+extern void bkpfs_note_backup(struct super_block *sb, struct inode *lower_dir);
+extern struct file *bkpfs_backup(struct inode *inode,
+				  struct path *lower_path, loff_t need,
+				  int *version);
+extern int bkpfs_parse_options(char *options, unsigned int *max_versions,
+			       loff_t *max_bytes, char **backup_dir,
+			       bool *dedup, int *compress,
+			       unsigned int *coalesce_ms,
+			       struct bkpfs_policy *policy, bool remount);
+
+/* asynchronous backup engine (backup.c) */
+extern int bkpfs_copy_data(struct super_block *sb, struct file *in,
+			   struct file *out, loff_t len);
+extern void bkpfs_probe_reflink(struct super_block *sb,
+				struct path *lower_root);
+extern int bkpfs_queue_backup(struct file *file);
+extern void bkpfs_wait_backups(struct inode *inode);
+extern void bkpfs_flush_backups(struct super_block *sb);
+extern int bkpfs_init_backup_queue(struct super_block *sb);
+extern void bkpfs_destroy_backup_queue(struct super_block *sb);
+extern int bkpfs_store_subdir(struct path *parent, const char *name,
+			      bool create, struct path *dir);
+extern ssize_t bkpfs_read_full(struct file *file, struct iov_iter *to,
+			       size_t len, loff_t pos);
+extern int bkpfs_version_lookup(struct super_block *sb,
+				struct path *lower_path, int version,
+				struct path *bkp_path);
+extern int bkpfs_version_create(struct super_block *sb,
+				struct path *lower_path, int version,
+				struct path *bkp_path);
+extern ssize_t bkpfs_read_version(struct super_block *sb,
+				  struct path *lower_path, int version,
+				  struct iov_iter *to, loff_t *pos);
+extern int bkpfs_version_direct(struct dentry *bkp_dentry, loff_t *size);
+extern int bkpfs_restore_version(struct super_block *sb,
+				 struct path *lower_path, int version,
+				 struct file *out);
+extern int bkpfs_clone_version(struct super_block *sb, struct path *lower_path,
+			       int version, struct file *out);
+extern int bkpfs_patch_version(struct super_block *sb, struct path *lower_path,
+			       int version, struct file *out);
+extern int bkpfs_fold_version(struct super_block *sb, struct path *lower_path,
+			      int version, int next);
+extern int bkpfs_install_tmpfile(struct dentry *dir, struct dentry *tmp,
+				 struct dentry *victim);
+extern int bkpfs_materialize_version(struct super_block *sb,
+				     struct path *lower_path, int version);
+extern int bkpfs_copy_range(struct file *in, struct file *out,
+			    loff_t pos, loff_t len);
+
+/* copy-on-write version headers (backup.c) */
+struct bkpfs_extent_map;
+
+extern int bkpfs_read_cow(struct dentry *bkp_dentry, int *parent,
+			  int *depth, struct bkpfs_extent_map *saved);
+extern int bkpfs_write_cow(struct dentry *bkp_dentry, int parent, int depth,
+			   struct bkpfs_extent_map *saved, loff_t size);
+extern int bkpfs_fill_cow(struct super_block *sb, struct path *lower_path,
+			  int version);
+extern int bkpfs_fold_cow(struct super_block *sb, struct path *lower_path,
+			  int version, int prev);
+
+/* chunk store of the dedup mount option (dedup.c) */
+struct bkpfs_manifest {
+	loff_t size;			/* of the version */
+	u32 nr_chunks;
+};
+
+extern struct file *bkpfs_version_manifest(struct super_block *sb,
+					  struct path *lower_path, int version,
+					  struct bkpfs_manifest *m);
+extern void bkpfs_init_dedup(void);
+extern int bkpfs_dedup_mount(struct super_block *sb);
+extern void bkpfs_dedup_unmount(struct super_block *sb);
+extern int bkpfs_dedup_get(struct dentry *bkp_dentry,
+			   struct bkpfs_manifest *m);
+extern int bkpfs_dedup_store(struct super_block *sb, struct file *in,
+			     loff_t size, struct file *out, loff_t *new_bytes,
+			     u32 *csum);
+extern ssize_t bkpfs_dedup_read(struct super_block *sb, struct file *manifest,
+				const struct bkpfs_manifest *m,
+				struct iov_iter *to, size_t len, loff_t pos);
+extern int bkpfs_dedup_restore(struct super_block *sb, struct file *manifest,
+			       const struct bkpfs_manifest *m,
+			       struct file *out);
+extern int bkpfs_dedup_release(struct super_block *sb, struct file *manifest,
+			       const struct bkpfs_manifest *m);
+
+/* compress= mount option (compress.c) */
+struct bkpfs_compressed {
+	loff_t size;			/* of the version */
+	u32 block_size;
+	int alg;			/* BKPFS_COMP_* */
+};
+
+extern const char *const bkpfs_comp_names[BKPFS_COMP_NR];
+extern int bkpfs_compress_check(struct super_block *sb, int alg);
+extern int bkpfs_compress_mount(struct super_block *sb);
+extern void bkpfs_compress_unmount(struct super_block *sb);
+extern int bkpfs_compress_get(struct dentry *bkp_dentry,
+			      struct bkpfs_compressed *c);
+extern int bkpfs_compress_store(struct super_block *sb, struct file *in,
+				loff_t size, struct file *out, int alg,
+				u32 *csum);
+extern ssize_t bkpfs_compress_read(struct super_block *sb, struct file *file,
+				   const struct bkpfs_compressed *c,
+				   struct iov_iter *to, size_t len,
+				   loff_t pos);
+extern int bkpfs_compress_restore(struct super_block *sb, struct file *file,
+				  const struct bkpfs_compressed *c,
+				  struct file *out);
+
+/* backup trigger policies (policy.c) */
+extern int bkpfs_parse_policy(const char *str, struct bkpfs_policy *p);
+extern int bkpfs_format_policy(const struct bkpfs_policy *p, char *buf,
+			       size_t size);
+extern void bkpfs_policy_changed(struct inode *inode);
+extern int bkpfs_take_version(struct file *file);
+extern int bkpfs_policy_pre_write(struct file *file, loff_t pos,
+				  loff_t len);
+extern int bkpfs_policy_mmap(struct file *file);
+extern int bkpfs_policy_pre_fault(struct file *file, loff_t pos,
+				  loff_t len);
+extern void bkpfs_policy_written(struct file *file, size_t bytes);
+extern bool bkpfs_policy_release(struct file *file);
+
+/* copy-on-write versions (cow.c) */
+extern void bkpfs_cow_forget(struct inode *inode);
+extern int bkpfs_cow_save(struct inode *inode, struct path *lower_path,
+			  loff_t pos, loff_t len);
+extern int bkpfs_cow_complete(struct inode *inode, struct path *lower_path);
+extern void bkpfs_cow_seal(struct inode *inode, struct path *lower_path,
+			   int version, bool ok);
+extern int bkpfs_cow_start(struct file *file);
+
+/* virtual .versions directories (vdir.c) */
+extern struct dentry *bkpfs_versions_lookup(struct inode *dir,
+					    struct dentry *dentry);
+
+/* version counters of a main file (version.c) */
+struct bkpfs_meta {
+	int min_version;		/* oldest existing version */
+	int max_version;		/* number of versions to keep */
+	int cur_version;		/* newest version */
+	int num_version;		/* number of existing versions */
+};
+
+/* live versions of a main file, ascending (version.c) */
+struct bkpfs_vslot {
+	int version;
+	unsigned int flags;		/* BKPFS_VER_* */
+	loff_t bytes;			/* space taken by its backup file */
+	u32 csum;			/* crc32c of its data */
+};
+
+/* restored or newer version deleted: the file isn't this one plus writes */
+#define BKPFS_VER_NO_BASE	0x1
+/* csum is set (only by stores that read the data, dedup and compress) */
+#define BKPFS_VER_CSUM		0x2
+
+struct bkpfs_vindex {
+	struct bkpfs_vslot *ver;
+	unsigned int nr;		/* number of live versions */
+	unsigned int size;		/* allocated entries */
+	loff_t bytes;			/* sum of ver[].bytes */
+};
+
+extern void bkpfs_init_meta(struct bkpfs_meta *meta);
+extern void bkpfs_meta_from_vindex(struct bkpfs_meta *meta,
+				   const struct bkpfs_vindex *vi);
+extern unsigned int bkpfs_vindex_find(const struct bkpfs_vindex *vi,
+				      int version);
+extern int bkpfs_vindex_next(const struct bkpfs_vindex *vi, int version);
+extern int bkpfs_vindex_prev(const struct bkpfs_vindex *vi, int version);
+extern bool bkpfs_vindex_live(const struct bkpfs_vindex *vi, int version);
+extern int bkpfs_vindex_add(struct bkpfs_vindex *vi, int version);
+extern void bkpfs_vindex_del(struct bkpfs_vindex *vi, int version);
+extern void bkpfs_vindex_set_bytes(struct bkpfs_vindex *vi, int version,
+				   loff_t bytes);
+extern void bkpfs_vindex_free(struct bkpfs_vindex *vi);
+extern int bkpfs_read_meta(struct dentry *lower_dentry,
+			   struct bkpfs_meta *meta, struct bkpfs_vindex *vi);
+extern int bkpfs_write_meta(struct dentry *lower_dentry,
+			    const struct bkpfs_meta *meta,
+			    const struct bkpfs_vindex *vi);
+extern int bkpfs_check_max_versions(struct path *lower_root,
+				    unsigned int max_versions);
+extern int bkpfs_get_meta(struct inode *inode, struct dentry *lower_dentry,
+			  struct bkpfs_meta *meta);
+extern void bkpfs_set_meta(struct inode *inode, const struct bkpfs_meta *meta);
+extern int __bkpfs_sync_meta(struct inode *inode, struct dentry *lower_dentry);
+extern int bkpfs_sync_meta(struct inode *inode, struct dentry *lower_dentry);
+extern int bkpfs_mark_no_base(struct inode *inode,
+			      struct dentry *lower_dentry);
+extern void bkpfs_set_version_bytes(struct inode *inode, int version,
+				    loff_t bytes);
+extern void bkpfs_set_version_csum(struct inode *inode, int version,
+				   u32 csum);
+
+/* modified byte ranges of a file (extent.c) */
+struct bkpfs_extent_map {
+	struct rb_root_cached root;
+	unsigned int nr;		/* number of extents in root */
+	bool all;			/* everything changed */
+};
+
+extern void bkpfs_extent_map_init(struct bkpfs_extent_map *map);
+extern void bkpfs_extent_map_clear(struct bkpfs_extent_map *map);
+extern void bkpfs_extent_map_set_all(struct bkpfs_extent_map *map);
+extern int bkpfs_extent_map_add(struct bkpfs_extent_map *map,
+				loff_t start, loff_t last);
+extern void bkpfs_extent_map_splice(struct bkpfs_extent_map *dst,
+				    struct bkpfs_extent_map *src);
+extern bool bkpfs_extent_map_next(struct bkpfs_extent_map *map, loff_t pos,
+				  loff_t *start, loff_t *end);
+extern bool bkpfs_extent_map_gap(struct bkpfs_extent_map *map, loff_t pos,
+				 loff_t end, loff_t *start, loff_t *stop);
+extern loff_t bkpfs_extent_map_bytes(struct bkpfs_extent_map *map,
+				     loff_t size);
+extern void bkpfs_mark_range(struct inode *inode, loff_t pos, loff_t len);
+extern void bkpfs_mark_all(struct inode *inode);
+
+struct bkpfs_backup_job;
 
 /* file private data */
 struct bkpfs_file_info {
 	struct file *lower_file;
 	const struct vm_operations_struct *lower_vm_ops;
+	unsigned long state;		/* BKPFS_F_* bits */
 };
 
+/* bkpfs_file_info state bits */
+#define BKPFS_F_WRITTEN		0	/* modified since it was opened */
+
 /* bkpfs inode data in memory */
 struct bkpfs_inode_info {
 	struct inode *lower_inode;
+	unsigned long state;		/* BKPFS_I_* bits */
+	struct mutex backup_mutex;	/* serializes versions, protects meta */
+	atomic_t backup_pending;	/* queued but unfinished backups */
+	spinlock_t extent_lock;		/* protects extents, backup_job, policy */
+	struct bkpfs_extent_map extents; /* changed since the last backup */
+	struct bkpfs_backup_job *backup_job; /* queued, not yet started */
+	struct bkpfs_policy policy;	/* the file's own, if POLICY_VALID */
+	atomic_t policy_writes;		/* writes since the last version */
+	atomic64_t policy_bytes;	/* bytes written since then */
+	unsigned long last_version;	/* jiffies when it was queued */
+	int cow_version;		/* fed by writes, see cow.c */
+	int cow_depth;			/* its header's depth */
+	loff_t cow_size;		/* its size */
+	struct bkpfs_extent_map cow_saved; /* ranges it holds */
+	struct bkpfs_meta meta;		/* cached counters, see BKPFS_I_META_* */
+	struct bkpfs_vindex vindex;	/* cached live versions */
+	atomic_t backups_added;		/* dirs: bumped by bkpfs_note_backup */
 	struct inode vfs_inode;
 };
 
+/* bkpfs_inode_info state bits */
+#define BKPFS_I_DIRTY		0	/* modified since the last version */
+#define BKPFS_I_META_VALID	1	/* meta holds the lower counters */
+#define BKPFS_I_META_DIRTY	2	/* meta not yet written back */
+#define BKPFS_I_META_NONE	3	/* the file never had versions */
+#define BKPFS_I_NO_BACKUPS	4	/* dirs: readdir needn't filter */
+#define BKPFS_I_VERSION		5	/* a version seen through .versions */
+#define BKPFS_I_POLICY_VALID	6	/* policy holds the file's own */
+
 /* bkpfs dentry data in memory */
 struct bkpfs_dentry_info {
 	spinlock_t lock;	/* protects lower_path */
 	struct path lower_path;
 };
 
+/* compress=: idle transforms of one algorithm */
+struct bkpfs_comp_pool {
+	spinlock_t lock;
+	int nr;
+	struct crypto_comp *idle[BKPFS_COMP_POOL];
+};
+
 /* bkpfs super-block data in memory */
 struct bkpfs_sb_info {
 	struct super_block *lower_sb;
+	struct workqueue_struct *backup_wq;
+	atomic_t backup_pending;	/* jobs queued on backup_wq */
+	wait_queue_head_t backup_wait;	/* throttled ->release, flushers */
+	spinlock_t backup_lock;		/* protects backup_jobs */
+	struct list_head backup_jobs;	/* queued jobs not started yet */
+	unsigned int coalesce_ms;	/* coalesce_ms=: delay of a backup */
+	struct bkpfs_policy policy;	/* policy=: when versions are taken */
+	bool reflink;			/* lower fs has ->remap_file_range */
+	unsigned int max_versions;	/* maxver=: versions kept per file */
+	loff_t max_bytes;		/* maxbytes=: space per file, 0 = any */
+	char *backup_dir_name;		/* backupdir=, NULL if not given */
+	struct path backup_dir;		/* the version store, if any */
+	const struct cred *creator_cred; /* accesses the version store */
+	bool dedup;			/* dedup: versions are chunk lists */
+	struct path chunk_dir;		/* the chunk store, with dedup */
+	struct crypto_shash *chunk_hash; /* names chunks by content */
+	struct mutex chunk_lock[BKPFS_CHUNK_LOCKS]; /* chunk refcounts */
+	int compress;			/* compress=: BKPFS_COMP_* */
+	struct bkpfs_comp_pool comp_pool[BKPFS_COMP_NR];
 };
 
 /*
@@ -129,6 +484,25 @@ static inline void bkpfs_set_lower_inode(struct inode *i, struct inode *val)
 	BKPFS_I(i)->lower_inode = val;
 }
 
+/*
+ * Record that the file data changed since the last backup version.  The
+ * bit is tested first so that a steady stream of writes to an already
+ * dirty file doesn't keep bouncing the cache line between CPUs.
+ */
+static inline void bkpfs_mark_dirty(struct inode *inode)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+
+	if (!test_bit(BKPFS_I_DIRTY, &info->state))
+		set_bit(BKPFS_I_DIRTY, &info->state);
+}
+
+/* consume the dirty state: true if a new version should be taken */
+static inline bool bkpfs_test_clear_dirty(struct inode *inode)
+{
+	return test_and_clear_bit(BKPFS_I_DIRTY, &BKPFS_I(inode)->state);
+}
+
 /* superblock to lower superblock */
 static inline struct super_block *bkpfs_lower_super(
 	const struct super_block *sb)
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _BKPFS_IOCTL_H_
+#define _BKPFS_IOCTL_H_
+
+/*
+ * bkpfs ioctls beyond the ones in custom_ioctl.h, shared by the kernel
+ * and user space.  Fields have fixed sizes so 32-bit programs can use
+ * them unchanged.
+ */
+
+#include <linux/types.h>
+
+/* read part of a version into user memory: struct bkpfs_view_args */
+#define VIEW_VERSION_ITER 100038
+
+/* bkpfs_view_args.flags */
+#define BKPFS_VIEW_EOF	0x1	/* the read reached the end of the version */
+
+struct bkpfs_view_args {
+	__s32 version;	/* -2 (oldest), -1 (newest) or a version number */
+	__u32 iovcnt;	/* number of entries in iov */
+	__u64 iov;	/* struct iovec array to read into */
+	__u64 offset;	/* where in the version to start */
+	__u64 length;	/* read at most this much (and at most the iovecs) */
+	__u64 nread;	/* out: bytes read */
+	__u32 flags;	/* out: BKPFS_VIEW_* */
+	__u32 reserved;
+};
+
+#endif	/* not _BKPFS_IOCTL_H_ */
@@ -0,0 +1,440 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+
+/*
+ * With the "compress=ALG" mount option, versions are stored compressed
+ * in blocks of BKPFS_COMPRESS_BLOCK bytes, each compressed on its own so
+ * that any range of a version can be read by decompressing only the
+ * blocks it touches.  The backup file starts with the block index, an
+ * array of nr_blocks + 1 little-endian offsets of the blocks in the
+ * file (the last one is the end of the data), followed by the blocks.
+ * A block whose stored length is
+ *	0			is all zeros,
+ *	its logical length	is stored as is (it didn't compress),
+ *	anything shorter	is compressed.
+ * A BKPFS_COMPRESS_XATTR header marks the file as compressed and tells
+ * the algorithm, so versions stay readable whatever the file system is
+ * mounted with later.
+ */
+
+#define BKPFS_COMPRESS_XATTR	"user.bkpfs.compress"
+#define BKPFS_COMPRESS_BLOCK	(64 * 1024)
+/* largest block size accepted from disk */
+#define BKPFS_COMPRESS_BLOCK_MAX (1024 * 1024)
+
+struct bkpfs_compress_disk {
+	__le64 size;		/* of the version */
+	__le32 block_size;
+	__le16 alg;
+	__le16 reserved;
+};
+
+/* names of the compress= algorithms, also their crypto API names */
+const char *const bkpfs_comp_names[BKPFS_COMP_NR] = {
+	[BKPFS_COMP_NONE]	= "none",
+	[BKPFS_COMP_LZ4]	= "lz4",
+	[BKPFS_COMP_ZSTD]	= "zstd",
+};
+
+/*
+ * A crypto_comp transform keeps its workspace in its context, so it can't
+ * be used by two threads at once.  Idle transforms are kept per algorithm
+ * and handed out one per user; more are allocated when they run out.
+ */
+static struct crypto_comp *bkpfs_comp_get(struct super_block *sb, int alg)
+{
+	struct bkpfs_comp_pool *pool = &BKPFS_SB(sb)->comp_pool[alg];
+	struct crypto_comp *tfm = NULL;
+
+	spin_lock(&pool->lock);
+	if (pool->nr)
+		tfm = pool->idle[--pool->nr];
+	spin_unlock(&pool->lock);
+	if (!tfm)
+		tfm = crypto_alloc_comp(bkpfs_comp_names[alg], 0, 0);
+	return tfm;
+}
+
+static void bkpfs_comp_put(struct super_block *sb, int alg,
+			   struct crypto_comp *tfm)
+{
+	struct bkpfs_comp_pool *pool = &BKPFS_SB(sb)->comp_pool[alg];
+
+	spin_lock(&pool->lock);
+	if (pool->nr < BKPFS_COMP_POOL) {
+		pool->idle[pool->nr++] = tfm;
+		tfm = NULL;
+	}
+	spin_unlock(&pool->lock);
+	if (tfm)
+		crypto_free_comp(tfm);
+}
+
+/**
+ * bkpfs_compress_check - is a compress= algorithm available?
+ * @sb: bkpfs super block
+ * @alg: BKPFS_COMP_*
+ *
+ * Allocates a transform for @alg, which is then kept for later use.
+ */
+int bkpfs_compress_check(struct super_block *sb, int alg)
+{
+	struct crypto_comp *tfm;
+
+	if (alg == BKPFS_COMP_NONE)
+		return 0;
+	tfm = bkpfs_comp_get(sb, alg);
+	if (IS_ERR(tfm)) {
+		printk(KERN_ERR "bkpfs: compression '%s' not available\n",
+		       bkpfs_comp_names[alg]);
+		return PTR_ERR(tfm);
+	}
+	bkpfs_comp_put(sb, alg, tfm);
+	return 0;
+}
+
+int bkpfs_compress_mount(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	int i;
+
+	for (i = 0; i < BKPFS_COMP_NR; i++)
+		spin_lock_init(&sbi->comp_pool[i].lock);
+	return bkpfs_compress_check(sb, sbi->compress);
+}
+
+void bkpfs_compress_unmount(struct super_block *sb)
+{
+	struct bkpfs_comp_pool *pool;
+	int i;
+
+	for (i = 0; i < BKPFS_COMP_NR; i++) {
+		pool = &BKPFS_SB(sb)->comp_pool[i];
+		while (pool->nr)
+			crypto_free_comp(pool->idle[--pool->nr]);
+	}
+}
+
+/**
+ * bkpfs_compress_get - is a backup file compressed?
+ * @bkp_dentry: lower dentry of the backup file
+ * @c: filled with the version's size, block size and algorithm if so
+ *
+ * Returns 1 for a compressed version, 0 for any other backup file, or a
+ * negative errno.
+ */
+int bkpfs_compress_get(struct dentry *bkp_dentry, struct bkpfs_compressed *c)
+{
+	struct bkpfs_compress_disk disk;
+	ssize_t ret;
+
+	ret = vfs_getxattr(bkp_dentry, BKPFS_COMPRESS_XATTR, &disk,
+			   sizeof(disk));
+	if (ret == -ENODATA || ret == -EOPNOTSUPP)
+		return 0;
+	if (ret < 0)
+		return ret;
+	if (ret != sizeof(disk))
+		return -EUCLEAN;
+	c->size = le64_to_cpu(disk.size);
+	c->block_size = le32_to_cpu(disk.block_size);
+	c->alg = le16_to_cpu(disk.alg);
+	if (c->size < 0 || c->alg <= BKPFS_COMP_NONE ||
+	    c->alg >= BKPFS_COMP_NR || !c->block_size ||
+	    c->block_size > BKPFS_COMPRESS_BLOCK_MAX)
+		return -EUCLEAN;
+	return 1;
+}
+
+static u32 bkpfs_compress_nr_blocks(const struct bkpfs_compressed *c)
+{
+	return DIV_ROUND_UP_ULL(c->size, c->block_size);
+}
+
+/* write the collected index entries [first, first + nr) */
+static int bkpfs_write_index(struct file *out, const __le64 *index,
+			     u32 first, u32 nr)
+{
+	loff_t pos = (loff_t)first * sizeof(*index);
+	ssize_t ret;
+
+	ret = kernel_write(out, index, nr * sizeof(*index), &pos);
+	if (ret < 0)
+		return ret;
+	return ret == nr * sizeof(*index) ? 0 : -EIO;
+}
+
+/**
+ * bkpfs_compress_store - store data compressed in independent blocks
+ * @sb: bkpfs super block
+ * @in: lower file to back up
+ * @size: number of bytes of @in to store
+ * @out: the new, empty backup file
+ * @alg: BKPFS_COMP_* algorithm to use
+ * @csum: set to the crc32c of the data, as it is read anyway
+ *
+ * The index is written a page of entries at a time as the blocks are,
+ * so memory use doesn't grow with the file.
+ */
+int bkpfs_compress_store(struct super_block *sb, struct file *in,
+			 loff_t size, struct file *out, int alg, u32 *csum)
+{
+	const u32 per_page = PAGE_SIZE / sizeof(__le64);
+	struct bkpfs_compress_disk disk;
+	struct crypto_comp *tfm;
+	struct kvec kvec;
+	struct iov_iter iter;
+	u32 nr, i, first = 0;
+	loff_t pos, opos;
+	unsigned int clen;
+	size_t len;
+	ssize_t ret;
+	__le64 *index;
+	u8 *buf, *cbuf, *src;
+	int err = 0;
+
+	nr = DIV_ROUND_UP_ULL(size, BKPFS_COMPRESS_BLOCK);
+	opos = ((loff_t)nr + 1) * sizeof(*index);
+	index = (__le64 *)__get_free_page(GFP_KERNEL);
+	if (!index)
+		return -ENOMEM;
+	buf = kvmalloc(2 * BKPFS_COMPRESS_BLOCK, GFP_KERNEL);
+	if (!buf) {
+		err = -ENOMEM;
+		goto out_index;
+	}
+	cbuf = buf + BKPFS_COMPRESS_BLOCK;
+	tfm = bkpfs_comp_get(sb, alg);
+	if (IS_ERR(tfm)) {
+		err = PTR_ERR(tfm);
+		goto out_buf;
+	}
+
+	*csum = ~0;
+	for (i = 0; i < nr; i++) {
+		pos = (loff_t)i * BKPFS_COMPRESS_BLOCK;
+		len = min_t(loff_t, size - pos, BKPFS_COMPRESS_BLOCK);
+		kvec.iov_base = buf;
+		kvec.iov_len = len;
+		iov_iter_kvec(&iter, READ, &kvec, 1, len);
+		/* the file may have shrunk since: store zeros */
+		ret = bkpfs_read_full(in, &iter, len, pos);
+		if (ret < 0) {
+			err = ret;
+			break;
+		}
+		*csum = crc32c(*csum, buf, len);
+
+		if (i - first == per_page) {
+			err = bkpfs_write_index(out, index, first, per_page);
+			if (err)
+				break;
+			first = i;
+		}
+		index[i - first] = cpu_to_le64(opos);
+
+		/* holes and zeroed blocks take no space */
+		if (!memchr_inv(buf, 0, len))
+			continue;
+		/* fails if the output doesn't fit: then store it as is */
+		clen = len - 1;
+		src = cbuf;
+		if (crypto_comp_compress(tfm, buf, len, cbuf, &clen) ||
+		    clen >= len) {
+			src = buf;
+			clen = len;
+		}
+		ret = kernel_write(out, src, clen, &opos);
+		if (ret != clen) {
+			err = ret < 0 ? ret : -EIO;
+			break;
+		}
+	}
+	bkpfs_comp_put(sb, alg, tfm);
+	if (err)
+		goto out_buf;
+
+	/* the end of the last block */
+	if (nr + 1 - first > per_page) {
+		err = bkpfs_write_index(out, index, first, per_page);
+		if (err)
+			goto out_buf;
+		first += per_page;
+	}
+	index[nr - first] = cpu_to_le64(opos);
+	err = bkpfs_write_index(out, index, first, nr + 1 - first);
+	if (err)
+		goto out_buf;
+
+	disk.size = cpu_to_le64(size);
+	disk.block_size = cpu_to_le32(BKPFS_COMPRESS_BLOCK);
+	disk.alg = cpu_to_le16(alg);
+	disk.reserved = 0;
+	err = vfs_setxattr(out->f_path.dentry, BKPFS_COMPRESS_XATTR, &disk,
+			   sizeof(disk), 0);
+out_buf:
+	kvfree(buf);
+out_index:
+	free_page((unsigned long)index);
+	return err;
+}
+
+/*
+ * Fill @buf with block @i of a compressed version.  @cbuf has room for a
+ * block as stored.  Returns the block's length, or a negative errno.
+ */
+static ssize_t bkpfs_compress_block(struct file *file,
+				    const struct bkpfs_compressed *c,
+				    struct crypto_comp *tfm, u32 i,
+				    u8 *buf, u8 *cbuf)
+{
+	__le64 ends[2];
+	loff_t pos = (loff_t)i * sizeof(ends[0]), start;
+	size_t len, stored;
+	unsigned int dlen;
+	ssize_t ret;
+
+	len = min_t(loff_t, c->size - (loff_t)i * c->block_size,
+		    c->block_size);
+	ret = kernel_read(file, ends, sizeof(ends), &pos);
+	if (ret < 0)
+		return ret;
+	if (ret != sizeof(ends))
+		return -EUCLEAN;
+	start = le64_to_cpu(ends[0]);
+	if (le64_to_cpu(ends[1]) < start ||
+	    le64_to_cpu(ends[1]) - start > len)
+		return -EUCLEAN;
+	stored = le64_to_cpu(ends[1]) - start;
+
+	if (!stored) {
+		memset(buf, 0, len);
+		return len;
+	}
+	ret = kernel_read(file, stored == len ? buf : cbuf, stored, &start);
+	if (ret < 0)
+		return ret;
+	if (ret != stored)
+		return -EUCLEAN;
+	if (stored == len)
+		return len;
+
+	dlen = c->block_size;
+	if (crypto_comp_decompress(tfm, cbuf, stored, buf, &dlen) ||
+	    dlen != len)
+		return -EUCLEAN;
+	return len;
+}
+
+/**
+ * bkpfs_compress_read - read part of a compressed version
+ * @sb: bkpfs super block
+ * @file: the version's backup file, open for reading
+ * @c: its header, from bkpfs_compress_get
+ * @to: destination
+ * @len: bytes to read, at most up to the end of the version
+ * @pos: offset in the version
+ *
+ * Only the blocks overlapping [@pos, @pos + @len) are decompressed, one
+ * at a time.
+ */
+ssize_t bkpfs_compress_read(struct super_block *sb, struct file *file,
+			    const struct bkpfs_compressed *c,
+			    struct iov_iter *to, size_t len, loff_t pos)
+{
+	struct crypto_comp *tfm;
+	size_t done = 0, n;
+	ssize_t ret = 0;
+	u32 i, off;
+	u8 *buf;
+
+	buf = kvmalloc(2 * c->block_size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	tfm = bkpfs_comp_get(sb, c->alg);
+	if (IS_ERR(tfm)) {
+		kvfree(buf);
+		return PTR_ERR(tfm);
+	}
+
+	while (done < len) {
+		i = div_u64_rem(pos + done, c->block_size, &off);
+		if (i >= bkpfs_compress_nr_blocks(c)) {
+			ret = -EUCLEAN;
+			break;
+		}
+		ret = bkpfs_compress_block(file, c, tfm, i, buf,
+					   buf + c->block_size);
+		if (ret < 0)
+			break;
+		n = min_t(size_t, len - done, ret - off);
+		if (copy_to_iter(buf + off, n, to) != n) {
+			ret = -EFAULT;
+			break;
+		}
+		done += n;
+	}
+	bkpfs_comp_put(sb, c->alg, tfm);
+	kvfree(buf);
+	return ret < 0 ? ret : len;
+}
+
+/**
+ * bkpfs_compress_restore - write the data of a compressed version to @out
+ * @sb: bkpfs super block
+ * @file: the version's backup file, open for reading
+ * @c: its header, from bkpfs_compress_get
+ * @out: empty lower file opened for writing
+ *
+ * Zero blocks are left as holes.
+ */
+int bkpfs_compress_restore(struct super_block *sb, struct file *file,
+			   const struct bkpfs_compressed *c, struct file *out)
+{
+	struct crypto_comp *tfm;
+	u32 i, nr = bkpfs_compress_nr_blocks(c);
+	loff_t pos;
+	ssize_t ret = 0, len;
+	u8 *buf;
+
+	buf = kvmalloc(2 * c->block_size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	tfm = bkpfs_comp_get(sb, c->alg);
+	if (IS_ERR(tfm)) {
+		kvfree(buf);
+		return PTR_ERR(tfm);
+	}
+
+	for (i = 0; i < nr; i++) {
+		len = bkpfs_compress_block(file, c, tfm, i, buf,
+					   buf + c->block_size);
+		if (len < 0) {
+			ret = len;
+			break;
+		}
+		if (!memchr_inv(buf, 0, len))
+			continue;
+		pos = (loff_t)i * c->block_size;
+		ret = kernel_write(out, buf, len, &pos);
+		if (ret >= 0 && ret != len)
+			ret = -EIO;
+		if (ret < 0)
+			break;
+	}
+	bkpfs_comp_put(sb, c->alg, tfm);
+	kvfree(buf);
+	if (ret < 0)
+		return ret;
+	return vfs_truncate(&out->f_path, c->size);
+}
@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+
+/*
+ * Copy-on-write versions (policy "cow").  Instead of copying a file when
+ * it is closed, the first write after an open starts a new, empty
+ * version that reads what it doesn't hold from the main file.  From then
+ * on every write, page_mkwrite or truncation first copies the old
+ * contents of the ranges it is about to change into that version, once
+ * per range, so the version keeps the file as it was when it started
+ * and costs only the bytes overwritten since.  When the next version is
+ * taken, the old one reads from that instead and writes stop feeding it.
+ *
+ * Which version is fed and what it holds is cached in the bkpfs inode,
+ * under the backup_mutex.  A file with no copy-on-write version being
+ * fed has cow_version BKPFS_COW_NONE, which writes check without a lock.
+ */
+
+/* the cached state is stale: look at the versions again next time */
+void bkpfs_cow_forget(struct inode *inode)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+
+	lockdep_assert_held(&info->backup_mutex);
+
+	WRITE_ONCE(info->cow_version, 0);
+	bkpfs_extent_map_clear(&info->cow_saved);
+}
+
+/* find out whether the newest version of @inode is being fed */
+static int bkpfs_cow_load(struct inode *inode, struct path *lower_path)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_vindex *vi = &info->vindex;
+	struct bkpfs_meta meta;
+	struct path bkp_path;
+	int err, version, parent, depth;
+
+	if (info->cow_version)
+		return 0;
+	err = bkpfs_get_meta(inode, lower_path->dentry, &meta);
+	if (err == -ENODATA || (!err && !vi->nr))
+		goto none;
+	if (err)
+		return err;
+	version = vi->ver[vi->nr - 1].version;
+	err = bkpfs_version_lookup(inode->i_sb, lower_path, version,
+				   &bkp_path);
+	if (err == -ENOENT)
+		goto none;
+	if (err)
+		return err;
+	err = bkpfs_read_cow(bkp_path.dentry, &parent, &depth,
+			     &info->cow_saved);
+	if (err > 0 && !parent) {
+		info->cow_depth = depth;
+		info->cow_size = i_size_read(d_inode(bkp_path.dentry));
+		WRITE_ONCE(info->cow_version, version);
+	}
+	path_put(&bkp_path);
+	if (info->cow_version > 0)
+		return 0;
+	bkpfs_extent_map_clear(&info->cow_saved);
+	if (err < 0)
+		return err;
+none:
+	WRITE_ONCE(info->cow_version, BKPFS_COW_NONE);
+	return 0;
+}
+
+/*
+ * Copy what the fed version doesn't hold of [@pos, @end) from the main
+ * file into it.  With too many ranges to track, it takes everything and
+ * becomes a full copy, which isn't fed any more.
+ */
+static int __bkpfs_cow_save(struct inode *inode, struct path *lower_path,
+			    loff_t pos, loff_t end)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_extent_map *saved = &info->cow_saved;
+	struct file *in = NULL, *out;
+	struct path bkp_path;
+	loff_t p, start, stop, isize;
+	unsigned int n = 0;
+	int err;
+
+	end = min(end, info->cow_size);
+	for (p = pos; bkpfs_extent_map_gap(saved, p, end, &start, &stop);
+	     p = stop)
+		n++;
+	if (!n)
+		return 0;
+	if (saved->nr + n >= BKPFS_MAX_DIRTY_EXTENTS) {
+		pos = 0;
+		end = info->cow_size;
+	}
+
+	err = bkpfs_version_lookup(inode->i_sb, lower_path, info->cow_version,
+				   &bkp_path);
+	if (err)
+		goto out;
+	out = dentry_open(&bkp_path, O_WRONLY, current_cred());
+	path_put(&bkp_path);
+	if (IS_ERR(out)) {
+		err = PTR_ERR(out);
+		goto out;
+	}
+	in = dentry_open(lower_path, O_RDONLY, current_cred());
+	if (IS_ERR(in)) {
+		err = PTR_ERR(in);
+		in = NULL;
+		goto out_put;
+	}
+
+	/* past the main file's EOF, the version's holes are right already */
+	isize = i_size_read(file_inode(in));
+	for (p = pos; !err &&
+	     bkpfs_extent_map_gap(saved, p, end, &start, &stop); p = stop) {
+		if (start < isize)
+			err = bkpfs_copy_range(in, out, start,
+					       min(stop, isize) - start);
+		if (!err)
+			err = bkpfs_extent_map_add(saved, start, stop - 1);
+	}
+	if (err)
+		goto out_put;
+
+	if (bkpfs_extent_map_gap(saved, 0, info->cow_size, &start, &stop)) {
+		err = bkpfs_write_cow(out->f_path.dentry, 0, info->cow_depth,
+				      saved, info->cow_size);
+		if (!err)
+			bkpfs_set_version_bytes(inode, info->cow_version,
+						bkpfs_extent_map_bytes(saved,
+							info->cow_size));
+	} else {
+		err = bkpfs_fill_cow(inode->i_sb, lower_path,
+				     info->cow_version);
+		if (!err) {
+			bkpfs_set_version_bytes(inode, info->cow_version,
+						info->cow_size);
+			bkpfs_extent_map_clear(saved);
+			WRITE_ONCE(info->cow_version, BKPFS_COW_NONE);
+		}
+	}
+out_put:
+	if (in)
+		fput(in);
+	fput(out);
+out:
+	/* saved may hold ranges the version's header doesn't */
+	if (err)
+		bkpfs_cow_forget(inode);
+	return err;
+}
+
+/**
+ * bkpfs_cow_save - save the old contents of a range about to change
+ * @inode: bkpfs inode of the main file
+ * @lower_path: lower path of the main file
+ * @pos: start of the range
+ * @len: its length, 0 for up to the end of the file
+ *
+ * If a copy-on-write version of the file is being fed, copies what it
+ * doesn't hold yet of the range from the main file into it.  Returns 0,
+ * or an error the write has to fail with, as the version would lose data
+ * otherwise.
+ */
+int bkpfs_cow_save(struct inode *inode, struct path *lower_path, loff_t pos,
+		   loff_t len)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	const struct cred *old_cred = NULL;
+	int err;
+
+	if (READ_ONCE(info->cow_version) == BKPFS_COW_NONE)
+		return 0;
+
+	mutex_lock(&info->backup_mutex);
+	if (sbi->backup_dir.dentry)
+		old_cred = override_creds(sbi->creator_cred);
+	err = bkpfs_cow_load(inode, lower_path);
+	if (!err && info->cow_version > 0)
+		err = __bkpfs_cow_save(inode, lower_path, pos,
+				       len > 0 && pos <= LLONG_MAX - len ?
+				       pos + len : LLONG_MAX);
+	if (old_cred)
+		revert_creds(old_cred);
+	mutex_unlock(&info->backup_mutex);
+	return err;
+}
+
+/**
+ * bkpfs_cow_complete - stop feeding a copy-on-write version
+ * @inode: bkpfs inode of the main file
+ * @lower_path: lower path of the main file
+ *
+ * Makes the copy-on-write version being fed, if any, a full copy, so the
+ * main file can be changed wholesale (by a restore).  Must be called
+ * with the backup_mutex held.
+ */
+int bkpfs_cow_complete(struct inode *inode, struct path *lower_path)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	int err;
+
+	err = bkpfs_cow_load(inode, lower_path);
+	if (!err && info->cow_version > 0)
+		err = __bkpfs_cow_save(inode, lower_path, 0, LLONG_MAX);
+	return err;
+}
+
+/**
+ * bkpfs_cow_seal - a new version of a file was taken
+ * @inode: bkpfs inode of the main file
+ * @lower_path: lower path of the main file
+ * @version: the new version
+ * @ok: whether its data was stored
+ *
+ * If the version before it was being fed, it reads from @version from
+ * now on, or if @version is incomplete, it is made a full copy.  Either
+ * way writes don't feed it any more.  Must be called with the
+ * backup_mutex held since before the data of @version was taken.
+ */
+void bkpfs_cow_seal(struct inode *inode, struct path *lower_path, int version,
+		    bool ok)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_extent_map saved;
+	struct path bkp_path;
+	int prev, parent, depth, err;
+
+	lockdep_assert_held(&info->backup_mutex);
+
+	prev = bkpfs_vindex_prev(&info->vindex, version);
+	if (!prev)
+		goto out;
+	if (bkpfs_version_lookup(inode->i_sb, lower_path, prev, &bkp_path))
+		goto out;
+	bkpfs_extent_map_init(&saved);
+	err = bkpfs_read_cow(bkp_path.dentry, &parent, &depth, &saved);
+	if (err > 0 && !parent) {
+		err = -EIO;
+		if (ok)
+			err = bkpfs_write_cow(bkp_path.dentry, version, depth,
+					      &saved, i_size_read(
+						d_inode(bkp_path.dentry)));
+		/* the main file hasn't changed yet, so this is still right */
+		if (err)
+			err = bkpfs_fill_cow(inode->i_sb, lower_path, prev);
+		if (err)
+			printk(KERN_ERR "bkpfs: lost copy-on-write version %d "
+			       "of inode %lu: %d\n", prev, inode->i_ino, err);
+	}
+	bkpfs_extent_map_clear(&saved);
+	path_put(&bkp_path);
+out:
+	bkpfs_cow_forget(inode);
+}
+
+/**
+ * bkpfs_cow_start - start a copy-on-write version of a file
+ * @file: the upper file, about to be written for the first time
+ *
+ * Unless the file hasn't changed since the copy-on-write version being
+ * fed started, creates an empty version of the file's size that reads
+ * from the main file, and seals the one before.  Shared mappings are
+ * written back first, which write-protects them, so every later store
+ * through one goes through page_mkwrite.
+ */
+int bkpfs_cow_start(struct file *file)
+{
+	struct inode *inode = file_inode(file);
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	struct path *lower_path = &bkpfs_lower_file(file)->f_path;
+	const struct cred *old_cred = NULL;
+	struct file *backup_file;
+	loff_t size;
+	int err, version, depth = 0;
+
+	if (d_unlinked(lower_path->dentry))
+		return 0;
+	err = filemap_write_and_wait(d_inode(lower_path->dentry)->i_mapping);
+	if (err)
+		return err;
+	/* versions still queued are older than this one */
+	bkpfs_wait_backups(inode);
+
+	mutex_lock(&info->backup_mutex);
+	if (sbi->backup_dir.dentry)
+		old_cred = override_creds(sbi->creator_cred);
+	err = bkpfs_cow_load(inode, lower_path);
+	if (err)
+		goto out;
+	if (!bkpfs_test_clear_dirty(inode) && info->cow_version > 0)
+		goto out;
+	spin_lock(&info->extent_lock);
+	bkpfs_extent_map_clear(&info->extents);
+	spin_unlock(&info->extent_lock);
+
+	if (info->cow_version > 0) {
+		depth = info->cow_depth + 1;
+		/* keep the chain of versions read through short */
+		if (depth >= BKPFS_MAX_DELTA_CHAIN) {
+			err = __bkpfs_cow_save(inode, lower_path, 0,
+					       LLONG_MAX);
+			if (err)
+				goto out_dirty;
+			depth = 0;
+		}
+	}
+
+	size = i_size_read(d_inode(lower_path->dentry));
+	backup_file = bkpfs_backup(inode, lower_path, 0, &version);
+	if (IS_ERR(backup_file)) {
+		err = PTR_ERR(backup_file);
+		goto out_dirty;
+	}
+	err = vfs_truncate(&backup_file->f_path, size);
+	if (!err && size) {
+		bkpfs_extent_map_clear(&info->cow_saved);
+		err = bkpfs_write_cow(backup_file->f_path.dentry, 0, depth,
+				      &info->cow_saved, size);
+	}
+	fput(backup_file);
+	bkpfs_cow_seal(inode, lower_path, version, !err);
+	if (!err)
+		err = __bkpfs_sync_meta(inode, lower_path->dentry);
+	if (err)
+		goto out_dirty;
+	if (size) {
+		info->cow_depth = depth;
+		info->cow_size = size;
+		WRITE_ONCE(info->cow_version, version);
+	}
+	WRITE_ONCE(info->last_version, jiffies);
+	goto out;
+
+out_dirty:
+	printk(KERN_ERR "bkpfs: cannot start copy-on-write version of "
+	       "inode %lu: %d\n", inode->i_ino, err);
+	bkpfs_mark_all(inode);
+	bkpfs_mark_dirty(inode);
+out:
+	if (old_cred)
+		revert_creds(old_cred);
+	mutex_unlock(&info->backup_mutex);
+	return err;
+}
@@ -0,0 +1,621 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+
+/*
+ * With the "dedup" mount option, versions don't hold file data.  The
+ * data is cut into chunks at content-defined boundaries (a gear rolling
+ * hash, so an insertion only changes the chunks around it), and every
+ * chunk is stored once, named by its SHA-256, in "chunks/XX/HASH" of the
+ * version store.  The backup file of a version is then a manifest: an
+ * array of struct bkpfs_chunk_ref, plus a BKPFS_DEDUP_XATTR header that
+ * marks it as one.  Chunks carry a reference count in BKPFS_REFS_XATTR
+ * and are removed when the last version using them is deleted.  A
+ * version holds one reference on each distinct chunk it uses, however
+ * often the chunk occurs in it, so the count is updated once per chunk
+ * and version.
+ *
+ * Reference counts are only ever too high after a crash, never too low:
+ * a chunk is referenced before the manifest entry that uses it is
+ * written, and dereferenced only after its manifest is gone.  A version
+ * that fails to be stored drops the references it took.
+ */
+
+#define BKPFS_DEDUP_XATTR	"user.bkpfs.dedup"
+#define BKPFS_REFS_XATTR	"user.bkpfs.refs"
+
+#define BKPFS_CHUNK_DIR		"chunks"
+#define BKPFS_CHUNK_MIN		(2 * 1024)
+#define BKPFS_CHUNK_MAX		(64 * 1024)
+/* 13 bits: a boundary every 8 KiB on average (past the minimum) */
+#define BKPFS_CHUNK_MASK	(0x1fffULL << 51)
+
+struct bkpfs_chunk_ref {
+	__le64 offset;		/* of the chunk in the version */
+	__le32 len;
+	__le32 reserved;
+	u8 hash[BKPFS_CHUNK_HASH_SIZE];
+};
+
+/* a chunk of the set of distinct chunks of a version */
+struct bkpfs_chunk_node {
+	struct rb_node node;
+	u8 hash[BKPFS_CHUNK_HASH_SIZE];
+};
+
+struct bkpfs_manifest_disk {
+	__le64 size;		/* of the version */
+	__le32 nr_chunks;
+	__le32 reserved;
+};
+
+/* random values for the gear hash; fixed, so boundaries are stable */
+static u64 bkpfs_gear[256];
+
+void bkpfs_init_dedup(void)
+{
+	u64 x = 0x626b7066736765ULL;	/* splitmix64 */
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(bkpfs_gear); i++) {
+		u64 z = (x += 0x9e3779b97f4a7c15ULL);
+
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		bkpfs_gear[i] = z ^ (z >> 31);
+	}
+}
+
+/* length of the chunk at the start of @buf, which holds @len bytes */
+static size_t bkpfs_chunk_len(const u8 *buf, size_t len)
+{
+	u64 h = 0;
+	size_t i;
+
+	if (len <= BKPFS_CHUNK_MIN)
+		return len;
+	len = min_t(size_t, len, BKPFS_CHUNK_MAX);
+	for (i = BKPFS_CHUNK_MIN; i < len; i++) {
+		h = (h << 1) + bkpfs_gear[buf[i]];
+		if (!(h & BKPFS_CHUNK_MASK))
+			return i + 1;
+	}
+	return len;
+}
+
+/**
+ * bkpfs_dedup_mount - set up the chunk store of a super block
+ * @sb: bkpfs super block, with its version store open
+ *
+ * Without the dedup option an existing chunk store is still opened, so
+ * versions stored by an earlier dedup mount can be read and deleted.
+ */
+int bkpfs_dedup_mount(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	int i, err;
+
+	for (i = 0; i < BKPFS_CHUNK_LOCKS; i++)
+		mutex_init(&sbi->chunk_lock[i]);
+	err = bkpfs_store_subdir(&sbi->backup_dir, BKPFS_CHUNK_DIR,
+				 sbi->dedup, &sbi->chunk_dir);
+	if (!sbi->dedup)
+		return err == -ENOENT ? 0 : err;
+	if (err)
+		return err;
+	sbi->chunk_hash = crypto_alloc_shash("sha256", 0, 0);
+	if (IS_ERR(sbi->chunk_hash)) {
+		err = PTR_ERR(sbi->chunk_hash);
+		sbi->chunk_hash = NULL;
+		path_put(&sbi->chunk_dir);
+		sbi->chunk_dir.dentry = NULL;
+		sbi->chunk_dir.mnt = NULL;
+	}
+	return err;
+}
+
+void bkpfs_dedup_unmount(struct super_block *sb)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+
+	if (sbi->chunk_dir.dentry)
+		path_put(&sbi->chunk_dir);
+	if (sbi->chunk_hash)
+		crypto_free_shash(sbi->chunk_hash);
+}
+
+/* "XX/HASH" in the chunk store */
+static void bkpfs_chunk_name(const u8 *hash, char *shard, char *name)
+{
+	snprintf(shard, 3, "%02x", hash[0]);
+	*bin2hex(name, hash, BKPFS_CHUNK_HASH_SIZE) = '\0';
+}
+
+static struct mutex *bkpfs_chunk_lock(struct bkpfs_sb_info *sbi,
+				      const u8 *hash)
+{
+	return &sbi->chunk_lock[hash[1] % BKPFS_CHUNK_LOCKS];
+}
+
+/* add @new to @chunks, unless its chunk is in there already */
+static bool bkpfs_chunk_set_add(struct rb_root *chunks,
+				struct bkpfs_chunk_node *new)
+{
+	struct rb_node **p = &chunks->rb_node, *parent = NULL;
+	struct bkpfs_chunk_node *c;
+	int cmp;
+
+	while (*p) {
+		parent = *p;
+		c = rb_entry(parent, struct bkpfs_chunk_node, node);
+		cmp = memcmp(new->hash, c->hash, BKPFS_CHUNK_HASH_SIZE);
+		if (!cmp)
+			return false;
+		p = cmp < 0 ? &parent->rb_left : &parent->rb_right;
+	}
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, chunks);
+	return true;
+}
+
+static int bkpfs_chunk_refs(struct dentry *dentry, u32 *refs)
+{
+	__le32 val;
+	ssize_t ret;
+
+	ret = vfs_getxattr(dentry, BKPFS_REFS_XATTR, &val, sizeof(val));
+	if (ret < 0)
+		return ret;
+	if (ret != sizeof(val))
+		return -EUCLEAN;
+	*refs = le32_to_cpu(val);
+	return 0;
+}
+
+static int bkpfs_chunk_set_refs(struct dentry *dentry, u32 refs)
+{
+	__le32 val = cpu_to_le32(refs);
+
+	return vfs_setxattr(dentry, BKPFS_REFS_XATTR, &val, sizeof(val), 0);
+}
+
+/*
+ * Take a reference on the chunk holding @data, storing it first if it
+ * isn't in the store yet.  Adds the bytes stored to *@new_bytes.
+ */
+static int bkpfs_chunk_get(struct super_block *sb, const u8 *hash,
+			   const void *data, size_t len, loff_t *new_bytes)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	char shard[3], name[2 * BKPFS_CHUNK_HASH_SIZE + 1];
+	struct path dir, path;
+	struct dentry *dentry;
+	struct file *file;
+	loff_t pos = 0;
+	ssize_t ret;
+	u32 refs;
+	int err;
+
+	bkpfs_chunk_name(hash, shard, name);
+	err = bkpfs_store_subdir(&sbi->chunk_dir, shard, true, &dir);
+	if (err)
+		return err;
+
+	mutex_lock(bkpfs_chunk_lock(sbi, hash));
+	inode_lock_nested(d_inode(dir.dentry), I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, dir.dentry, strlen(name));
+	if (!IS_ERR(dentry) && d_is_negative(dentry)) {
+		err = vfs_create(d_inode(dir.dentry), dentry, S_IFREG | 0600,
+				 true);
+		if (err) {
+			dput(dentry);
+			dentry = ERR_PTR(err);
+		}
+	}
+	inode_unlock(d_inode(dir.dentry));
+	if (IS_ERR(dentry)) {
+		err = PTR_ERR(dentry);
+		goto out;
+	}
+	path.dentry = dentry;
+	path.mnt = dir.mnt;
+
+	err = bkpfs_chunk_refs(dentry, &refs);
+	if (!err) {
+		err = bkpfs_chunk_set_refs(dentry, refs + 1);
+		goto out_dput;
+	}
+	if (err != -ENODATA)
+		goto out_dput;
+
+	/* new, or left incomplete by a crash: (re)write the data */
+	err = vfs_truncate(&path, 0);
+	if (err)
+		goto out_dput;
+	file = dentry_open(&path, O_WRONLY, current_cred());
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		goto out_dput;
+	}
+	ret = kernel_write(file, data, len, &pos);
+	fput(file);
+	if (ret != len) {
+		err = ret < 0 ? ret : -EIO;
+		goto out_dput;
+	}
+	err = bkpfs_chunk_set_refs(dentry, 1);
+	if (!err)
+		*new_bytes += len;
+out_dput:
+	dput(dentry);
+out:
+	mutex_unlock(bkpfs_chunk_lock(sbi, hash));
+	path_put(&dir);
+	return err;
+}
+
+/* drop a reference on a chunk, deleting it with the last one */
+static int bkpfs_chunk_put(struct super_block *sb, const u8 *hash)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	char shard[3], name[2 * BKPFS_CHUNK_HASH_SIZE + 1];
+	struct dentry *dentry;
+	struct path dir;
+	u32 refs;
+	int err;
+
+	if (!sbi->chunk_dir.dentry)
+		return 0;
+	bkpfs_chunk_name(hash, shard, name);
+	err = bkpfs_store_subdir(&sbi->chunk_dir, shard, false, &dir);
+	if (err)
+		return err == -ENOENT ? 0 : err;
+
+	mutex_lock(bkpfs_chunk_lock(sbi, hash));
+	inode_lock_nested(d_inode(dir.dentry), I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, dir.dentry, strlen(name));
+	if (IS_ERR(dentry)) {
+		err = PTR_ERR(dentry);
+		goto out;
+	}
+	if (d_is_positive(dentry)) {
+		err = bkpfs_chunk_refs(dentry, &refs);
+		if (err == -ENODATA)
+			refs = 0;
+		else if (err)
+			goto out_dput;
+		if (refs > 1)
+			err = bkpfs_chunk_set_refs(dentry, refs - 1);
+		else
+			err = vfs_unlink(d_inode(dir.dentry), dentry, NULL);
+	}
+out_dput:
+	dput(dentry);
+out:
+	inode_unlock(d_inode(dir.dentry));
+	mutex_unlock(bkpfs_chunk_lock(sbi, hash));
+	path_put(&dir);
+	return err;
+}
+
+/* free @chunks, dropping the references held on them first if @put */
+static void bkpfs_chunk_set_free(struct super_block *sb,
+				 struct rb_root *chunks, bool put)
+{
+	struct bkpfs_chunk_node *c, *next;
+
+	rbtree_postorder_for_each_entry_safe(c, next, chunks, node) {
+		/* a reference that can't be dropped only wastes space */
+		if (put)
+			bkpfs_chunk_put(sb, c->hash);
+		kfree(c);
+	}
+	*chunks = RB_ROOT;
+}
+
+static struct file *bkpfs_chunk_open(struct super_block *sb, const u8 *hash)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	char shard[3], name[2 * BKPFS_CHUNK_HASH_SIZE + 1];
+	char path_name[sizeof(shard) + sizeof(name)];
+	struct file *file;
+	struct path path;
+	int err;
+
+	if (!sbi->chunk_dir.dentry)
+		return ERR_PTR(-EUCLEAN);
+	bkpfs_chunk_name(hash, shard, name);
+	snprintf(path_name, sizeof(path_name), "%s/%s", shard, name);
+	err = vfs_path_lookup(sbi->chunk_dir.dentry, sbi->chunk_dir.mnt,
+			      path_name, 0, &path);
+	if (err)
+		return ERR_PTR(err == -ENOENT ? -EUCLEAN : err);
+	file = dentry_open(&path, O_RDONLY, current_cred());
+	path_put(&path);
+	return file;
+}
+
+static int bkpfs_read_ref(struct file *manifest, u32 i,
+			  struct bkpfs_chunk_ref *ref)
+{
+	loff_t pos = (loff_t)i * sizeof(*ref);
+	ssize_t ret;
+
+	ret = kernel_read(manifest, ref, sizeof(*ref), &pos);
+	if (ret < 0)
+		return ret;
+	return ret == sizeof(*ref) ? 0 : -EUCLEAN;
+}
+
+/**
+ * bkpfs_dedup_get - is a backup file a chunk manifest?
+ * @bkp_dentry: lower dentry of the backup file
+ * @m: filled with the version's size and chunk count if so
+ *
+ * Returns 1 for a manifest, 0 for any other backup file, or a negative
+ * errno.
+ */
+int bkpfs_dedup_get(struct dentry *bkp_dentry, struct bkpfs_manifest *m)
+{
+	struct bkpfs_manifest_disk disk;
+	ssize_t ret;
+
+	ret = vfs_getxattr(bkp_dentry, BKPFS_DEDUP_XATTR, &disk,
+			   sizeof(disk));
+	if (ret == -ENODATA || ret == -EOPNOTSUPP)
+		return 0;
+	if (ret < 0)
+		return ret;
+	if (ret != sizeof(disk))
+		return -EUCLEAN;
+	m->size = le64_to_cpu(disk.size);
+	m->nr_chunks = le32_to_cpu(disk.nr_chunks);
+	return 1;
+}
+
+/**
+ * bkpfs_dedup_store - store data as chunks and write its manifest
+ * @sb: bkpfs super block
+ * @in: lower file to back up
+ * @size: number of bytes of @in to store
+ * @out: the new, empty backup file
+ * @new_bytes: increased by the bytes of chunks not in the store before
+ * @csum: set to the crc32c of the data, as it is read anyway
+ */
+int bkpfs_dedup_store(struct super_block *sb, struct file *in, loff_t size,
+		      struct file *out, loff_t *new_bytes, u32 *csum)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	SHASH_DESC_ON_STACK(desc, sbi->chunk_hash);
+	struct bkpfs_manifest_disk disk;
+	struct bkpfs_chunk_ref ref;
+	struct bkpfs_chunk_node *node = NULL;
+	struct rb_root chunks = RB_ROOT;
+	struct kvec kvec;
+	struct iov_iter iter;
+	loff_t rpos = 0, cpos = 0, opos = 0;
+	size_t head = 0, avail = 0, n, len;
+	u32 nr = 0;
+	ssize_t ret;
+	u8 *buf;
+	int err = 0;
+
+	/* room to always look at a whole maximal chunk */
+	buf = kvmalloc(2 * BKPFS_CHUNK_MAX, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	desc->tfm = sbi->chunk_hash;
+	desc->flags = 0;
+	memset(&ref, 0, sizeof(ref));
+	*csum = ~0;
+
+	while (cpos < size) {
+		if (avail < BKPFS_CHUNK_MAX && rpos < size) {
+			memmove(buf, buf + head, avail);
+			head = 0;
+			n = min_t(loff_t, 2 * BKPFS_CHUNK_MAX - avail,
+				  size - rpos);
+			kvec.iov_base = buf + avail;
+			kvec.iov_len = n;
+			iov_iter_kvec(&iter, READ, &kvec, 1, n);
+			/* the file may have shrunk since: store zeros */
+			ret = bkpfs_read_full(in, &iter, n, rpos);
+			if (ret < 0) {
+				err = ret;
+				break;
+			}
+			*csum = crc32c(*csum, buf + avail, n);
+			avail += n;
+			rpos += n;
+		}
+
+		len = bkpfs_chunk_len(buf + head, avail);
+		err = crypto_shash_digest(desc, buf + head, len, ref.hash);
+		if (err)
+			break;
+		if (!node) {
+			node = kmalloc(sizeof(*node), GFP_KERNEL);
+			if (!node) {
+				err = -ENOMEM;
+				break;
+			}
+		}
+		memcpy(node->hash, ref.hash, BKPFS_CHUNK_HASH_SIZE);
+		/* only the first time the version uses the chunk */
+		if (bkpfs_chunk_set_add(&chunks, node)) {
+			err = bkpfs_chunk_get(sb, ref.hash, buf + head, len,
+					      new_bytes);
+			if (err) {
+				rb_erase(&node->node, &chunks);
+				break;
+			}
+			node = NULL;
+		}
+		ref.offset = cpu_to_le64(cpos);
+		ref.len = cpu_to_le32(len);
+		ret = kernel_write(out, &ref, sizeof(ref), &opos);
+		if (ret != sizeof(ref)) {
+			err = ret < 0 ? ret : -EIO;
+			break;
+		}
+		nr++;
+		cpos += len;
+		head += len;
+		avail -= len;
+	}
+	kvfree(buf);
+	kfree(node);
+
+	if (!err) {
+		disk.size = cpu_to_le64(size);
+		disk.nr_chunks = cpu_to_le32(nr);
+		disk.reserved = 0;
+		err = vfs_setxattr(out->f_path.dentry, BKPFS_DEDUP_XATTR,
+				   &disk, sizeof(disk), 0);
+	}
+	/* without its header the file is no manifest: nothing uses them */
+	bkpfs_chunk_set_free(sb, &chunks, err);
+	return err;
+}
+
+/**
+ * bkpfs_dedup_read - read part of a version from its chunks
+ * @sb: bkpfs super block
+ * @manifest: the version's backup file, open for reading
+ * @m: its header, from bkpfs_dedup_get
+ * @to: destination
+ * @len: bytes to read, at most up to the end of the version
+ * @pos: offset in the version
+ *
+ * The chunk holding @pos is found by a binary search over the manifest,
+ * which is read through the page cache.
+ */
+ssize_t bkpfs_dedup_read(struct super_block *sb, struct file *manifest,
+			 const struct bkpfs_manifest *m, struct iov_iter *to,
+			 size_t len, loff_t pos)
+{
+	struct bkpfs_chunk_ref ref;
+	struct file *chunk;
+	u32 lo = 0, hi = m->nr_chunks, mid;
+	loff_t off;
+	size_t done = 0, n;
+	ssize_t ret;
+	int err;
+
+	/* the last chunk starting at or before @pos */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		err = bkpfs_read_ref(manifest, mid, &ref);
+		if (err)
+			return err;
+		if (le64_to_cpu(ref.offset) <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	for (; done < len && lo < m->nr_chunks; lo++) {
+		err = bkpfs_read_ref(manifest, lo, &ref);
+		if (err)
+			return err;
+		off = pos + done - le64_to_cpu(ref.offset);
+		if (off < 0 || off >= le32_to_cpu(ref.len))
+			return -EUCLEAN;
+		n = min_t(loff_t, len - done, le32_to_cpu(ref.len) - off);
+		chunk = bkpfs_chunk_open(sb, ref.hash);
+		if (IS_ERR(chunk))
+			return PTR_ERR(chunk);
+		ret = bkpfs_read_full(chunk, to, n, off);
+		fput(chunk);
+		if (ret < 0)
+			return ret;
+		done += n;
+	}
+	return done == len ? len : -EUCLEAN;
+}
+
+/**
+ * bkpfs_dedup_restore - write the data of a version to @out
+ * @sb: bkpfs super block
+ * @manifest: the version's backup file, open for reading
+ * @m: its header, from bkpfs_dedup_get
+ * @out: empty lower file opened for writing
+ */
+int bkpfs_dedup_restore(struct super_block *sb, struct file *manifest,
+			const struct bkpfs_manifest *m, struct file *out)
+{
+	struct bkpfs_chunk_ref ref;
+	struct file *chunk;
+	ssize_t copied;
+	loff_t off, len;
+	u32 i;
+	int err;
+
+	for (i = 0; i < m->nr_chunks; i++) {
+		err = bkpfs_read_ref(manifest, i, &ref);
+		if (err)
+			return err;
+		chunk = bkpfs_chunk_open(sb, ref.hash);
+		if (IS_ERR(chunk))
+			return PTR_ERR(chunk);
+		len = le32_to_cpu(ref.len);
+		for (off = 0; off < len; off += copied) {
+			copied = vfs_copy_file_range(chunk, off, out,
+						     le64_to_cpu(ref.offset) +
+						     off, len - off, 0);
+			if (copied <= 0) {
+				fput(chunk);
+				return copied < 0 ? copied : -EUCLEAN;
+			}
+		}
+		fput(chunk);
+	}
+	return vfs_truncate(&out->f_path, m->size);
+}
+
+/**
+ * bkpfs_dedup_release - drop the chunk references of a deleted version
+ * @sb: bkpfs super block
+ * @manifest: the version's backup file, open for reading
+ * @m: its header, from bkpfs_dedup_get
+ *
+ * Called once the manifest is unlinked.  Each distinct chunk is
+ * dereferenced once.  Keeps going past errors, so as few chunks as
+ * possible are leaked.
+ */
+int bkpfs_dedup_release(struct super_block *sb, struct file *manifest,
+			const struct bkpfs_manifest *m)
+{
+	struct bkpfs_chunk_node *node = NULL;
+	struct rb_root chunks = RB_ROOT;
+	struct bkpfs_chunk_ref ref;
+	int err = 0, ret;
+	u32 i;
+
+	for (i = 0; i < m->nr_chunks; i++) {
+		if (!node)
+			node = kmalloc(sizeof(*node), GFP_KERNEL);
+		ret = node ? bkpfs_read_ref(manifest, i, &ref) : -ENOMEM;
+		if (!ret) {
+			memcpy(node->hash, ref.hash, BKPFS_CHUNK_HASH_SIZE);
+			if (bkpfs_chunk_set_add(&chunks, node)) {
+				ret = bkpfs_chunk_put(sb, ref.hash);
+				node = NULL;
+			}
+		}
+		if (ret && !err)
+			err = ret;
+	}
+	kfree(node);
+	bkpfs_chunk_set_free(sb, &chunks, false);
+	return err;
+}
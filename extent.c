@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+#include <linux/interval_tree_generic.h>
+
+/*
+ * Modified byte ranges of a file, kept as an interval tree of disjoint,
+ * non-adjacent extents.  Overlapping or touching ranges are merged on
+ * insert, so appends and rewrites of the same region keep a single node.
+ */
+struct bkpfs_extent {
+	struct rb_node rb;
+	loff_t start;
+	loff_t last;		/* inclusive */
+	loff_t __subtree_last;
+};
+
+#define BKPFS_EXTENT_START(e) ((e)->start)
+#define BKPFS_EXTENT_LAST(e) ((e)->last)
+
+INTERVAL_TREE_DEFINE(struct bkpfs_extent, rb, loff_t, __subtree_last,
+		     BKPFS_EXTENT_START, BKPFS_EXTENT_LAST, static,
+		     bkpfs_extent)
+
+void bkpfs_extent_map_init(struct bkpfs_extent_map *map)
+{
+	map->root = RB_ROOT_CACHED;
+	map->nr = 0;
+	map->all = false;
+}
+
+/* forget all ranges (but not the "all" state) */
+static void bkpfs_extent_map_free(struct bkpfs_extent_map *map)
+{
+	struct bkpfs_extent *e;
+
+	while ((e = bkpfs_extent_iter_first(&map->root, 0, LLONG_MAX))) {
+		bkpfs_extent_remove(e, &map->root);
+		kfree(e);
+	}
+	map->nr = 0;
+}
+
+void bkpfs_extent_map_clear(struct bkpfs_extent_map *map)
+{
+	bkpfs_extent_map_free(map);
+	map->all = false;
+}
+
+/* the whole file is to be considered modified */
+void bkpfs_extent_map_set_all(struct bkpfs_extent_map *map)
+{
+	bkpfs_extent_map_free(map);
+	map->all = true;
+}
+
+/*
+ * Add [start, last] to @map, merging with every extent it overlaps or
+ * touches.  Returns -EAGAIN if a new node is needed and *@new is NULL;
+ * the caller then allocates one outside of its lock and retries.  A
+ * preallocated node that was not used is left in *@new.
+ */
+static int __bkpfs_extent_map_add(struct bkpfs_extent_map *map,
+				  loff_t start, loff_t last,
+				  struct bkpfs_extent **new)
+{
+	struct bkpfs_extent *e, *next, *keep = NULL;
+
+	if (map->all)
+		return 0;
+
+	e = bkpfs_extent_iter_first(&map->root, start ? start - 1 : 0,
+				    last < LLONG_MAX ? last + 1 : last);
+	while (e) {
+		next = bkpfs_extent_iter_next(e, start ? start - 1 : 0,
+					      last < LLONG_MAX ? last + 1 : last);
+		bkpfs_extent_remove(e, &map->root);
+		start = min(start, e->start);
+		last = max(last, e->last);
+		if (keep) {
+			kfree(e);
+			map->nr--;
+		} else {
+			keep = e;
+		}
+		e = next;
+	}
+	if (!keep) {
+		if (!*new)
+			return -EAGAIN;
+		keep = *new;
+		*new = NULL;
+		map->nr++;
+	}
+	keep->start = start;
+	keep->last = last;
+	bkpfs_extent_insert(keep, &map->root);
+
+	/* too fragmented to be worth tracking: back up everything */
+	if (map->nr > BKPFS_MAX_DIRTY_EXTENTS)
+		bkpfs_extent_map_set_all(map);
+	return 0;
+}
+
+/* like __bkpfs_extent_map_add, for maps nobody else can see */
+int bkpfs_extent_map_add(struct bkpfs_extent_map *map,
+			 loff_t start, loff_t last)
+{
+	struct bkpfs_extent *new = NULL;
+	int err;
+
+	while ((err = __bkpfs_extent_map_add(map, start, last, &new)) ==
+	       -EAGAIN) {
+		new = kmalloc(sizeof(struct bkpfs_extent), GFP_NOFS);
+		if (!new) {
+			bkpfs_extent_map_set_all(map);
+			return -ENOMEM;
+		}
+	}
+	kfree(new);
+	return err;
+}
+
+/* move every range of @src into @dst, leaving @src empty */
+void bkpfs_extent_map_splice(struct bkpfs_extent_map *dst,
+			     struct bkpfs_extent_map *src)
+{
+	struct bkpfs_extent *e;
+
+	if (src->all) {
+		bkpfs_extent_map_set_all(dst);
+		bkpfs_extent_map_clear(src);
+		return;
+	}
+	while ((e = bkpfs_extent_iter_first(&src->root, 0, LLONG_MAX))) {
+		bkpfs_extent_remove(e, &src->root);
+		src->nr--;
+		/* reuses e as the new node if it doesn't merge */
+		__bkpfs_extent_map_add(dst, e->start, e->last, &e);
+		kfree(e);
+	}
+	bkpfs_extent_map_clear(src);
+}
+
+/**
+ * bkpfs_extent_map_next - find the next range at or after @pos
+ * @map: extent map to walk
+ * @pos: offset to start searching from
+ * @start: start of the range found (clipped to @pos)
+ * @end: end of the range found (exclusive)
+ *
+ * Returns false once there are no more ranges.
+ */
+bool bkpfs_extent_map_next(struct bkpfs_extent_map *map, loff_t pos,
+			   loff_t *start, loff_t *end)
+{
+	struct bkpfs_extent *e;
+
+	if (map->all) {
+		*start = pos;
+		*end = LLONG_MAX;
+		return pos < LLONG_MAX;
+	}
+	e = bkpfs_extent_iter_first(&map->root, pos, LLONG_MAX);
+	if (!e)
+		return false;
+	*start = max(e->start, pos);
+	*end = e->last < LLONG_MAX ? e->last + 1 : LLONG_MAX;
+	return true;
+}
+
+/**
+ * bkpfs_extent_map_gap - find the next range @map doesn't cover
+ * @map: extent map to walk
+ * @pos: offset to start searching from
+ * @end: where to stop searching (exclusive)
+ * @start: start of the range found
+ * @stop: its end (exclusive), at most @end
+ *
+ * Returns false if @map covers all of [@pos, @end).
+ */
+bool bkpfs_extent_map_gap(struct bkpfs_extent_map *map, loff_t pos,
+			  loff_t end, loff_t *start, loff_t *stop)
+{
+	loff_t s, e;
+
+	while (pos < end) {
+		if (!bkpfs_extent_map_next(map, pos, &s, &e)) {
+			*start = pos;
+			*stop = end;
+			return true;
+		}
+		if (s > pos) {
+			*start = pos;
+			*stop = min(s, end);
+			return true;
+		}
+		pos = e;
+	}
+	return false;
+}
+
+/* number of bytes below @size covered by @map */
+loff_t bkpfs_extent_map_bytes(struct bkpfs_extent_map *map, loff_t size)
+{
+	loff_t pos = 0, start, end, bytes = 0;
+
+	while (pos < size && bkpfs_extent_map_next(map, pos, &start, &end)) {
+		if (start >= size)
+			break;
+		bytes += min(end, size) - start;
+		pos = end;
+	}
+	return bytes;
+}
+
+/**
+ * bkpfs_mark_range - record that @len bytes at @pos of @inode changed
+ * @inode: bkpfs inode
+ * @pos: first modified byte
+ * @len: number of modified bytes (0 for "up to infinity")
+ *
+ * Marks the inode dirty and remembers the range, so that the next version
+ * can hold just the bytes that changed since the last one.
+ */
+void bkpfs_mark_range(struct inode *inode, loff_t pos, loff_t len)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_extent *new = NULL;
+	loff_t last;
+
+	if (len <= 0 || pos > LLONG_MAX - len)
+		last = LLONG_MAX;
+	else
+		last = pos + len - 1;
+
+	spin_lock(&info->extent_lock);
+	while (__bkpfs_extent_map_add(&info->extents, pos, last, &new) ==
+	       -EAGAIN) {
+		spin_unlock(&info->extent_lock);
+		new = kmalloc(sizeof(struct bkpfs_extent), GFP_NOFS);
+		spin_lock(&info->extent_lock);
+		if (!new) {
+			bkpfs_extent_map_set_all(&info->extents);
+			break;
+		}
+	}
+	spin_unlock(&info->extent_lock);
+	kfree(new);
+	/* only now, or a close in between would take a version without it */
+	bkpfs_mark_dirty(inode);
+}
+
+/* the whole file changed (or we lost track of what did) */
+void bkpfs_mark_all(struct inode *inode)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+
+	spin_lock(&info->extent_lock);
+	bkpfs_extent_map_set_all(&info->extents);
+	spin_unlock(&info->extent_lock);
+}
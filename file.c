@@ -11,443 +11,452 @@
 
 #include "bkpfs.h"
 #include </usr/src/hw2-sjeevan/include/linux/custom_ioctl.h>
-
-bool BACKUP_FLAG = false;
+#include "bkpfs_ioctl.h"
 
 /**
- * bkp_getxattr - gets the matching attribute value
- * @lower_dentry: lower dentry of the file
- * @name: attribute name
- * @buffer: the buffer to place matching value
- * @size: size of buffer
+ * bkp_resolve_version - turns an ioctl version argument into a number
+ * @file: struct file of the main file
+ * @version_num: -2 (oldest), -1 (newest) or a version number
  */
 static int
-bkp_getxattr(struct dentry *lower_dentry, const char *name,
-void *buffer, size_t size)
+bkp_resolve_version(struct file *file, int version_num)
 {
-        int err;
-        if (!(d_inode(lower_dentry)->i_opflags & IOP_XATTR)) {
-                err = -EOPNOTSUPP;
-                goto out;
-        } 
-	err = vfs_getxattr(lower_dentry, name, buffer, size);
-out:
-        return err;
+	struct bkpfs_meta meta;
+	int err;
+
+	if (version_num != -1 && version_num != -2)
+		return version_num;
+	err = bkpfs_get_meta(file_inode(file),
+			     bkpfs_lower_file(file)->f_path.dentry, &meta);
+	if (err)
+		return err;
+	if (!meta.num_version)
+		return -ENOENT;
+	return version_num == -2 ? meta.min_version : meta.cur_version;
 }
 
-/**
- * bkp_setxattr - sets the attributes needed
- * @lower_dentry: lower dentry of the file
- * @size: size of buffer
- * @init_flag: indicates if initialisation
- */
-static int
-bkp_setxattr(struct dentry *lower_dentry, size_t size,
-int flags, const bool init_flag)
+/* copy the user's xattrs of @from to @to; the version metadata is not */
+static int bkpfs_copy_xattrs(struct dentry *from, struct dentry *to)
 {
-        int err;
-	int min_version = 1, max_version = 4;
-	int cur_version = 0, num_version = 0; 
- 	
-	if (!(d_inode(lower_dentry)->i_opflags & IOP_XATTR)) {
-                err = -EOPNOTSUPP;
-                goto out;
+	ssize_t list_size, size;
+	char *list, *name, *value;
+	int err = 0;
+
+	list_size = vfs_listxattr(from, NULL, 0);
+	if (list_size <= 0)
+		return list_size == -EOPNOTSUPP ? 0 : list_size;
+	list = kmalloc(list_size, GFP_KERNEL);
+	if (!list)
+		return -ENOMEM;
+	list_size = vfs_listxattr(from, list, list_size);
+	if (list_size < 0) {
+		err = list_size;
+		goto out;
 	}
-	if (init_flag) {
-		err = vfs_setxattr(lower_dentry, "user.max_version", &max_version, size, flags);
-		if (err)
-			goto out;
-		err = vfs_setxattr(lower_dentry, "user.min_version", &min_version, size, flags);
-		if (err)
-			goto out;
-		err = vfs_setxattr(lower_dentry, "user.cur_version", &cur_version, size, flags);
-		if (err)
-			goto out;
-		err = vfs_setxattr(lower_dentry, "user.num_version", &num_version, size, flags);
-		if (err)
-			goto out;
+	for (name = list; !err && name < list + list_size;
+	     name += strlen(name) + 1) {
+		if (!strcmp(name, BKPFS_META_XATTR))
+			continue;
+		size = vfs_getxattr(from, name, NULL, 0);
+		if (size < 0) {
+			err = size;
+			break;
+		}
+		value = kmalloc(size ?: 1, GFP_KERNEL);
+		if (!value) {
+			err = -ENOMEM;
+			break;
+		}
+		size = vfs_getxattr(from, name, value, size);
+		if (size < 0)
+			err = size;
+		else
+			err = vfs_setxattr(to, name, value, size, 0);
+		kfree(value);
 	}
-out:	
+out:
+	kfree(list);
 	return err;
 }
 
-/**
- * init_qstr - initialises struct qstr (needed to create dentry)
- * @filename: name of the file
- * @lower_dir_dentry: dentry of directory of lower FS
+/*
+ * Writes through another open of the old inode would be lost once the
+ * new one is in place, and never be versioned either.  @file and the
+ * restore's own open of the lower file are the only writers allowed.
  */
-static struct 
-qstr init_qstr(const char *filename,
-struct dentry *lower_dir_dentry)
+static bool bkpfs_other_writers(struct file *file, struct inode *lower_inode)
 {
-	struct qstr new_qstr;
-	
-	new_qstr.name = filename;
-        new_qstr.len  = strlen(filename);
-        new_qstr.hash = full_name_hash(lower_dir_dentry, new_qstr.name, new_qstr.len);
-
-	return new_qstr;
-}	
+	int mine = (file->f_mode & FMODE_WRITE) ? 2 : 1;
 
-/**
- * create_dentry - creates a new dentry 
- * @lower_parent_path: lower path of its parent
- * @this: initialised quick string
- * @lower_path: lower path of the file
- */
-static struct dentry
-*create_dentry(struct path lower_parent_path, struct qstr *this,
-struct path *lower_path)
-{
-	struct dentry *lower_dentry;
-	struct dentry *lower_dir_dentry = lower_parent_path.dentry;
-	struct vfsmount *lower_dir_mnt = lower_parent_path.mnt;
-	
-	/* create a new negative dentry for the lower file system */
-	lower_dentry = d_alloc(lower_dir_dentry, this);
-	d_add(lower_dentry, NULL);
-
-	/* initialise the lower sturct lower path of bkpfs dentry */
-	lower_path->dentry = lower_dentry;
-        lower_path->mnt = mntget(lower_dir_mnt);
-     
-	return lower_dentry; 
+	return atomic_read(&lower_inode->i_writecount) > mine;
 }
 
 /**
- * create_inode - creates a new inode for given dentry 
- * @lower_parent_dentry: lower dentry of its parent
- * @lower_dentry: the file's lower dentry
- * @mode: the file permissions
+ * bkpfs_restore_staged - replace the main file by a restored copy
+ * @file: struct file of the main file
+ * @version_num: version to restore
+ *
+ * The version is rebuilt in an unnamed temporary file next to the main
+ * file, which gets the main file's owner, mode, xattrs and version
+ * metadata and is then renamed over it.  Readers see the old or the new
+ * file, never a mix; files open for reading keep the old contents.  The
+ * lower inode changes, so this is not possible if the file has other
+ * links or other writers, or if its versions are found by inode number
+ * in a version store: then -EOPNOTSUPP is returned.  Must be called with
+ * the inode's backup_mutex held.
  */
-static int 
-create_inode(struct dentry *lower_dentry,
-struct dentry *lower_parent_dentry,
-umode_t mode, bool want_excl)
+static int bkpfs_restore_staged(struct file *file, int version_num)
 {
-	int err = 0;
-	
-	lower_parent_dentry = lock_parent(lower_dentry);
-        err = vfs_create(d_inode(lower_parent_dentry), lower_dentry, mode, want_excl);		
-        unlock_dir(lower_parent_dentry);
-	
+	struct inode *inode = file_inode(file);
+	struct path *lower_path = &bkpfs_lower_file(file)->f_path;
+	struct dentry *lower_dentry = lower_path->dentry;
+	struct inode *lower_inode = d_inode(lower_dentry);
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	struct dentry *lower_dir, *tmp;
+	const struct cred *old_cred;
+	struct bkpfs_meta meta;
+	struct path tmp_path;
+	struct file *out;
+	struct iattr ia;
+	int err;
+
+	if (sbi->backup_dir.dentry || lower_inode->i_nlink != 1 ||
+	    bkpfs_other_writers(file, lower_inode))
+		return -EOPNOTSUPP;
+	err = bkpfs_get_meta(inode, lower_dentry, &meta);
+	if (err)
+		return err;
+
+	lower_dir = dget_parent(lower_dentry);
+	tmp = vfs_tmpfile(lower_dir, lower_inode->i_mode, O_RDWR);
+	if (IS_ERR(tmp)) {
+		err = PTR_ERR(tmp);
+		goto out_dir;
+	}
+	tmp_path.mnt = lower_path->mnt;
+	tmp_path.dentry = tmp;
+	out = dentry_open(&tmp_path, O_WRONLY, current_cred());
+	if (IS_ERR(out)) {
+		err = PTR_ERR(out);
+		goto out_tmp;
+	}
+	err = bkpfs_restore_version(inode->i_sb, lower_path, version_num, out);
+	fput(out);
+	if (err)
+		goto out_tmp;
+
+	ia.ia_valid = ATTR_MODE;
+	ia.ia_mode = lower_inode->i_mode;
+	if (!uid_eq(d_inode(tmp)->i_uid, lower_inode->i_uid)) {
+		ia.ia_valid |= ATTR_UID;
+		ia.ia_uid = lower_inode->i_uid;
+	}
+	if (!gid_eq(d_inode(tmp)->i_gid, lower_inode->i_gid)) {
+		ia.ia_valid |= ATTR_GID;
+		ia.ia_gid = lower_inode->i_gid;
+	}
+	inode_lock(d_inode(tmp));
+	err = notify_change(tmp, &ia, NULL);
+	inode_unlock(d_inode(tmp));
+	if (!err)
+		err = bkpfs_copy_xattrs(lower_dentry, tmp);
+	if (err)
+		goto out_tmp;
+	/*
+	 * Without the record the versions would be orphaned, and the next
+	 * backup would start over at 1 and overwrite them.  It is internal,
+	 * so it is written whatever the caller may do to trusted xattrs.
+	 */
+	old_cred = override_creds(sbi->creator_cred);
+	err = bkpfs_write_meta(tmp, &meta, &BKPFS_I(inode)->vindex);
+	revert_creds(old_cred);
+	if (err)
+		goto out_tmp;
+
+	/* someone may have opened it for writing meanwhile */
+	if (bkpfs_other_writers(file, lower_inode)) {
+		err = -EOPNOTSUPP;
+		goto out_tmp;
+	}
+
+	err = bkpfs_install_tmpfile(lower_dir, tmp, lower_dentry);
+	if (err)
+		goto out_tmp;
+	clear_bit(BKPFS_I_META_DIRTY, &BKPFS_I(inode)->state);
+
+	/* the old inode is gone: don't back it up any more */
+	bkpfs_test_clear_dirty(inode);
+out_tmp:
+	dput(tmp);
+out_dir:
+	dput(lower_dir);
 	return err;
 }
 
+/**
+ * bkpfs_restore - make a version the current contents of a file
+ * @file: struct file of the main file
+ * @version_num: version number, or -2 (oldest) / -1 (newest)
+ *
+ * Restores never leave the file empty or half-written for readers: the
+ * version is cloned over the file if the lower fs can reflink, and
+ * otherwise built aside and renamed over it (bkpfs_restore_staged).
+ * Only when neither is possible is the file changed in place, and then
+ * only the pages that differ from the version are rewritten.
+ */
 static int bkpfs_restore(struct file *file, int version_num)
 {
-	int err = 0, get_xattr, vfs_err = 0;
-	struct path lower_backup_path;
-	struct dentry *parent;
-	struct file *lower_bkp_file, *main_file;
-	char bkp_fname[256], *main_fname;
-	loff_t pos_in = 0, pos_out = 0;
-	int min_buffer = 0, cur_buffer = 0;
-	parent = dget_parent((bkpfs_lower_file(file))->f_path.dentry);
+	int err = 0;
+	struct file *main_file;
 	
-	if (version_num == -2) {
-		get_xattr = bkp_getxattr(bkpfs_lower_file(file)->f_path.dentry, "user.min_version",
-					(void *) &min_buffer, sizeof (int));
-		version_num = min_buffer;
-	} else if (version_num == -1) {
-		get_xattr = bkp_getxattr(bkpfs_lower_file(file)->f_path.dentry, "user.cur_version",
-				(void *) &cur_buffer, sizeof (int));
-		version_num = cur_buffer;
+	version_num = bkp_resolve_version(file, version_num);
+	if (version_num < 0) {
+		err = version_num;
+		goto out;
 	}
 	if (version_num < 1) {
 		err = -ENOENT;
 		goto out;
 	}
-	main_fname = (char *) file->f_path.dentry->d_name.name;
-	sprintf(bkp_fname, ".backup.%s.%d", main_fname, version_num);
-	err = vfs_path_lookup(parent, bkpfs_lower_file(file)->f_path.mnt,
-				bkp_fname, 0, &lower_backup_path);
-	if (err) {
-		goto out;
-	}
 	
-	lower_bkp_file = dentry_open(&lower_backup_path,
-					O_RDWR, current_cred());	
-	if (IS_ERR(lower_bkp_file)) {
-                err = PTR_ERR(lower_bkp_file);
+	/* a copy-on-write version can't read from the file any more */
+	err = bkpfs_cow_complete(file_inode(file),
+				 &bkpfs_lower_file(file)->f_path);
+	if (err)
 		goto out;
-	}
-	
-	main_file = dentry_open(&(bkpfs_lower_file(file)->f_path), O_WRONLY, current_cred());
-	err = vfs_truncate(&main_file->f_path, 0);
-	if (err) {
+
+	/* before a staged restore, as that writes the metadata */
+	err = bkpfs_mark_no_base(file_inode(file),
+				 bkpfs_lower_file(file)->f_path.dentry);
+	if (err)
+		goto out;
+
+	/* with read access, a restore can skip what is already there */
+	main_file = dentry_open(&(bkpfs_lower_file(file)->f_path),
+				(file->f_mode & FMODE_READ) ? O_RDWR : O_WRONLY,
+				current_cred());
+	if (IS_ERR(main_file)) {
+		err = PTR_ERR(main_file);
 		goto out;
 	}
-	else {	
-		vfs_err = vfs_copy_file_range(
-			lower_bkp_file,
-			pos_in,
-			main_file,
-			pos_out, 
-			lower_bkp_file->f_inode->i_size, 0
-		);
-		if (vfs_err < lower_bkp_file->f_inode->i_size) {
-			err = -EIO;
-			goto out;
+	err = bkpfs_clone_version(file_inode(file)->i_sb,
+				  &bkpfs_lower_file(file)->f_path,
+				  version_num, main_file);
+	if (err == -EOPNOTSUPP) {
+		err = bkpfs_restore_staged(file, version_num);
+		if (err != -EOPNOTSUPP)
+			goto out_put;
+		if (main_file->f_mode & FMODE_READ) {
+			err = bkpfs_patch_version(file_inode(file)->i_sb,
+						  &bkpfs_lower_file(file)->f_path,
+						  version_num, main_file);
+		} else {
+			err = vfs_truncate(&main_file->f_path, 0);
+			if (!err)
+				err = bkpfs_restore_version(file_inode(file)->i_sb,
+							    &bkpfs_lower_file(file)->f_path,
+							    version_num, main_file);
 		}
 	}
+	fsstack_copy_inode_size(file_inode(file), file_inode(main_file));
+	bkpfs_cow_forget(file_inode(file));
+	/* the next version can't be a delta against what was there before */
+	bkpfs_mark_all(file_inode(file));
+out_put:
+	fput(main_file);
 out:	
-	//fput(lower_bkp_file);
-	//fput(main_file);
-	dput(parent);
 	return err;
 }
 
+/**
+ * bkp_unlink - removes one backup version and updates the counters
+ * @inode: bkpfs inode of the main file
+ * @lower_path: lower path of the main file
+ * @lower_del_dentry: lower dentry of the backup file to remove
+ * @version_num: version number of the backup file
+ */
 static int 
-bkp_unlink(struct file *file, struct dentry *lower_dir,
+bkp_unlink(struct inode *inode, struct path *lower_path,
 struct dentry *lower_del_dentry, int version_num)
 {
-	int i, err, get_xattr;
-	struct dentry *lower_dir_dentry, *parent, *lower_dentry;
-	char *max_version = "user.max_version", *min_version = "user.min_version";
-	char *num_version = "user.num_version", *cur_version = "user.cur_version";
-	int max_buffer = 0, min_buffer = 0, cur_buffer = 0, num_buffer = 0;
-	struct vfsmount *lower_dir_mnt;
-	struct path lower_parent_path, del_lower_path;		
-	char delete_filename[256];
-	struct file *lower_file;	
+	int err;
+	struct dentry *lower_dir_dentry, *lower_dentry;
+	struct bkpfs_vindex *vi = &BKPFS_I(inode)->vindex;
+	struct bkpfs_manifest m;
+	struct file *manifest;
+	struct bkpfs_meta meta;
+	bool newest;
 	
-	parent = dget_parent(file->f_path.dentry);
-	bkpfs_get_lower_path(parent, &lower_parent_path);
-	lower_dir = lower_parent_path.dentry;
-	lower_dir_mnt = lower_parent_path.mnt;
+	lower_dentry = lower_path->dentry;
+
+	err = bkpfs_get_meta(inode, lower_dentry, &meta);
+	if (err)
+		goto out;
+	newest = version_num == meta.cur_version;
+
+	/* a delta based on this version must not lose its data */
+	err = bkpfs_fold_version(inode->i_sb, lower_path, version_num,
+				 bkpfs_vindex_next(vi, version_num));
+	if (err)
+		goto out;
+	/* nor a copy-on-write version reading from it */
+	err = bkpfs_fold_cow(inode->i_sb, lower_path, version_num,
+			     bkpfs_vindex_prev(vi, version_num));
+	if (err)
+		goto out;
+
+	/* its chunks are let go once the manifest is gone */
+	manifest = bkpfs_version_manifest(inode->i_sb, lower_path,
+					  version_num, &m);
+	if (IS_ERR(manifest)) {
+		err = PTR_ERR(manifest);
+		goto out;
+	}
 	
 	dget(lower_del_dentry);
+	/* the backup may be in the store rather than next to the file */
 	lower_dir_dentry = lock_parent(lower_del_dentry);
-	err = vfs_unlink(lower_dir->d_inode, lower_del_dentry, NULL);
+	err = vfs_unlink(d_inode(lower_dir_dentry), lower_del_dentry, NULL);
 	if (err == -EBUSY && lower_del_dentry->d_flags & DCACHE_NFSFS_RENAMED) 
 		err = 0;
 	unlock_dir(lower_dir_dentry);
 	dput(lower_del_dentry);
-	if (err)
-		goto out;
-	
-	lower_file = bkpfs_lower_file(file);
-	lower_dentry = lower_file->f_path.dentry;
-	get_xattr = bkp_getxattr(lower_dentry, max_version, (void *) &max_buffer, sizeof (int));
-	if ((get_xattr < 0) || (get_xattr == -ENODATA)) {
-		err = get_xattr;
-		goto out;
-	}
-	get_xattr = bkp_getxattr(lower_dentry, min_version, (void *) &min_buffer, sizeof (int));
-	if ((get_xattr < 0) || (get_xattr == -ENODATA)) {
-		err = get_xattr;
-		goto out;
+	if (manifest) {
+		if (!err)
+			bkpfs_dedup_release(inode->i_sb, manifest, &m);
+		fput(manifest);
 	}
-	get_xattr = bkp_getxattr(lower_dentry, cur_version, (void *) &cur_buffer, sizeof (int));
-	if ((get_xattr < 0) || (get_xattr == -ENODATA)) {
-		err = get_xattr;
-		goto out;
-	}
-	get_xattr = bkp_getxattr(lower_dentry, num_version, (void *) &num_buffer, sizeof (int));
-	if ((get_xattr < 0) || (get_xattr == -ENODATA)) {
-		err = get_xattr;
-		goto out;
-	}
-	if (version_num == min_buffer) {
-		if (cur_buffer == min_buffer) {
-			num_buffer = 0;
-			min_buffer = 1;
-			cur_buffer = 0;
-			max_buffer = 4;
-		} else {
-			for (i = min_buffer + 1; i <= cur_buffer; i++) {
-				sprintf(delete_filename, ".backup.%s.%d", file->f_path.dentry->d_name.name, i);
-			        err = vfs_path_lookup(lower_dir_dentry, lower_dir_mnt, delete_filename, 0, &del_lower_path);
-				if (!err) {		
-					min_buffer = i;
-					num_buffer = num_buffer - 1;
-					break;
-				}  
-			}
-		}		
-	} else if (version_num == max_buffer) {
-		if (num_buffer == 1) {
-			cur_buffer = 0;
-			num_buffer = 0;
-			min_buffer = 1;
-			max_buffer = 4;
-		} else {
-			num_buffer = num_buffer -1;
-			for (i = cur_buffer -1; i >= min_buffer; i--) {
-				sprintf(delete_filename, ".backup.%s.%d", file->f_path.dentry->d_name.name, i);
-				err = vfs_path_lookup(lower_dir_dentry, lower_dir_mnt, delete_filename, 0, &del_lower_path);
-				if (!err) {		
-					cur_buffer = i;
-					max_buffer = i;
-					break;
-				}  
-			}
-		}
-	} else 
-		num_buffer = num_buffer - 1; 
-	
-	err = vfs_setxattr(lower_dentry, "user.max_version", (const void *) &max_buffer, sizeof (int), XATTR_REPLACE);
-	if (err)
-		goto out;
-	err = vfs_setxattr(lower_dentry, "user.min_version", (const void *) &min_buffer, sizeof (int), XATTR_REPLACE);
-	if (err)
-		goto out;
-	err = vfs_setxattr(lower_dentry, "user.cur_version", (const void *) &cur_buffer, sizeof (int), XATTR_REPLACE);
-	if (err)
-		goto out;
-	err = vfs_setxattr(lower_dentry, "user.num_version", (const void *) &num_buffer, sizeof (int), XATTR_REPLACE);
 	if (err)
 		goto out;
-	printk("After Unlink - Min: %d, Max: %d, Cur: %d, Num: %d\n", min_buffer, max_buffer, cur_buffer, num_buffer);
-out:
-	dput(parent);
-	bkpfs_put_lower_path(parent, &lower_parent_path);
 	
+	/* the index gives the new oldest/newest without any lookups */
+	bkpfs_vindex_del(vi, version_num);
+	/*
+	 * The ranges written since are relative to the version deleted,
+	 * so the next version can't be a delta against the one before it.
+	 */
+	if (newest && vi->nr)
+		vi->ver[vi->nr - 1].flags |= BKPFS_VER_NO_BASE;
+	bkpfs_meta_from_vindex(&meta, vi);
+	bkpfs_set_meta(inode, &meta);
+	bkpfs_cow_forget(inode);
+out:
 	return err;
 }
 
-static struct file *bkpfs_backup(struct file *file)
+/**
+ * bkpfs_backup - creates the next backup version of a file
+ * @inode: bkpfs inode of the main file
+ * @lower_path: lower path of the main file
+ * @need: estimated space the new version will take
+ * @version: set to the number of the new version
+ *
+ * Updates the version counters, retires the oldest versions as needed
+ * to stay within the maxver= and maxbytes= limits and returns the new,
+ * empty backup file opened for writing (or an ERR_PTR).  Called from the
+ * backup workqueue with the inode's backup_mutex held.
+ */
+struct file *bkpfs_backup(struct inode *inode, struct path *lower_path,
+			  loff_t need, int *version)
 {	
-	int i, err = 0, get_xattr;
-	int max_buffer = 0, min_buffer = 0, cur_buffer = 0, num_buffer = 0;
-	struct dentry *lower_dir_dentry = NULL;
-	struct qstr new_qstr;
-	struct dentry *lower_dentry, *orig_lowerdentry, *parent, *lower_parent_dentry = NULL;
-	struct path lower_path, lower_parent_path, del_lower_path;
-	struct vfsmount *lower_dir_mnt;	
-	struct file *lower_file = NULL, *orig_lowerfile = NULL;	
-	char *max_version = "user.max_version", *min_version = "user.min_version";
-	char *num_version = "user.num_version", *cur_version = "user.cur_version";
-	char current_filename[30], delete_filename[30]; 	
-	bool num_flag = false;
-	int delete_version;
-
-	/* get the parents dentry */
-	parent = dget_parent(file->f_path.dentry);
-
-        /* 
- 	 * gets the lower fs-specific parent struct path!
- 	 * The series of function calls made are below:
- 	 * spin_lock(&BKPFS_D(dent)->lock): grab the lock of bkpfs dentry.	 
- 	 * pathcpy(lower_path, &BKPFS_D(dent)->lower_path): copy struct path of bkpfs dentry.
- 	 * path_get(lower_path): increase reference count of mount, and lower fs specific dentry.
- 	 * spin_unlock(&BKPFS_D(dent)->lock): release the lock on bkpfs dentry.
- 	 */
-	
-	/* The lower path of bkpfs dentry has a link to lower fs dentry.
- 	 * struct path {
- 	 * 	struct vfsmount *mnt;
- 	 * 	struct dentry *dentry; // lower fs dentry
- 	 * } __randomize_layout;
- 	 */
-	bkpfs_get_lower_path(parent, &lower_parent_path);
-	lower_dir_dentry = lower_parent_path.dentry;
-	lower_dir_mnt = lower_parent_path.mnt;
-	
-	orig_lowerfile = bkpfs_lower_file(file);
-	orig_lowerdentry = orig_lowerfile->f_path.dentry;
-	
-	get_xattr = bkp_getxattr(orig_lowerdentry, max_version, (void *) &max_buffer, sizeof (int));
+	int err = 0;
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	unsigned int max_versions = READ_ONCE(sbi->max_versions);
+	loff_t max_bytes = READ_ONCE(sbi->max_bytes);
+	struct bkpfs_meta meta;
+	struct bkpfs_vindex *vi = &BKPFS_I(inode)->vindex;
+	struct dentry *orig_lowerdentry;
+	struct path lower_bkp_path, del_lower_path;
+	struct file *lower_file = NULL;	
+
+	orig_lowerdentry = lower_path->dentry;
 	
-	if ((get_xattr < 0) || (get_xattr == -ENODATA)) 
-		bkp_setxattr(orig_lowerdentry, sizeof (int), XATTR_CREATE, true);
-	get_xattr = bkp_getxattr(orig_lowerdentry, num_version, (void *) &num_buffer, sizeof (int));
-	if ((get_xattr < 0) || (get_xattr == -ENODATA)) {
-		err = get_xattr;
-		goto out;
+	err = bkpfs_get_meta(inode, orig_lowerdentry, &meta);
+	if (err == -ENODATA) {
+		bkpfs_init_meta(&meta);
+		err = 0;
 	}
-	get_xattr = bkp_getxattr(orig_lowerdentry, cur_version, (void *) &cur_buffer, sizeof (int));
-	if ((get_xattr < 0) || (get_xattr == -ENODATA)) {
-		err = get_xattr;
+	if (err)
 		goto out;
-	}
 
-	get_xattr = bkp_getxattr(orig_lowerdentry, min_version, (void *) &min_buffer, sizeof (int));
-	if ((get_xattr < 0) || (get_xattr == -ENODATA)) {
-		err = get_xattr;
-		goto out;
-	}
-	if (num_buffer == 4) {
-		
-		num_flag = true;
-		get_xattr = bkp_getxattr(orig_lowerdentry, max_version, (void *) &max_buffer, sizeof (int));
-		if ((get_xattr < 0) || (get_xattr == -ENODATA)) {
-			err = get_xattr;
-			goto out;
+	/* retention: retire the oldest versions to make room */
+	while (meta.num_version &&
+	       (meta.num_version >= max_versions ||
+		(max_bytes && vi->bytes + need > max_bytes))) {
+		err = bkpfs_version_lookup(inode->i_sb, lower_path,
+					   meta.min_version, &del_lower_path);
+		if (err == -ENOENT) {
+			/* already gone from the lower fs: just forget it */
+			bkpfs_vindex_del(vi, meta.min_version);
+			bkpfs_meta_from_vindex(&meta, vi);
+			bkpfs_set_meta(inode, &meta);
+			continue;
 		}
-		get_xattr = bkp_getxattr(orig_lowerdentry, min_version, (void *) &min_buffer, sizeof (int));
-		if ((get_xattr < 0) || (get_xattr == -ENODATA)) {
-			err = get_xattr;
-			goto out;
-		}
-		max_buffer = max_buffer + 1; 
-		delete_version = min_buffer;
-		
-		for (i = min_buffer + 1; i < max_buffer; i++) {
-			sprintf(delete_filename, "backup.%s.%d", file->f_path.dentry->d_name.name, i);			
-			err = vfs_path_lookup(lower_dir_dentry, lower_dir_mnt, delete_filename, 0, &del_lower_path);
-			if (!err) {
-				min_buffer = i;
-				err = vfs_setxattr(orig_lowerdentry, "user.min_version", (const void *) &min_buffer, sizeof (int), XATTR_REPLACE);
-				if (err)
-					goto out;
-				break;
-			}  
-		}
-		
-		num_buffer = num_buffer - 1;
-		err = vfs_setxattr(orig_lowerdentry, "user.num_version", (const void *) &num_buffer, sizeof (int), XATTR_REPLACE);
 		if (err)
 			goto out;
-		err = vfs_setxattr(orig_lowerdentry, "user.max_version", (const void *) &max_buffer, sizeof (int), XATTR_REPLACE);
+		err = bkp_unlink(inode, lower_path, del_lower_path.dentry,
+				 meta.min_version);
+		path_put(&del_lower_path);
 		if (err)
 			goto out;
-		sprintf(delete_filename, ".backup.%s.%d", file->f_path.dentry->d_name.name, (delete_version));
-		err = vfs_path_lookup(lower_dir_dentry, lower_dir_mnt, delete_filename, 0, &del_lower_path);
-		
-		if (!err) {
-			bkp_unlink(file, lower_dir_dentry, del_lower_path.dentry, delete_version);
-		} else 
+		/* bkp_unlink updated the counters */
+		err = bkpfs_get_meta(inode, orig_lowerdentry, &meta);
+		if (err)
 			goto out;
 	}
 	
-	cur_buffer = cur_buffer + 1;
-	sprintf(current_filename, ".backup.%s.%d", file->f_path.dentry->d_name.name, cur_buffer);
-	err = vfs_setxattr(orig_lowerdentry, "user.cur_version", (const void *) &cur_buffer, sizeof (int), XATTR_REPLACE);
+	meta.cur_version = meta.cur_version + 1;
+	err = bkpfs_vindex_add(vi, meta.cur_version);
 	if (err)
 		goto out;
 	
-	/* initialize the quick string structure */
-  	new_qstr = init_qstr(current_filename, lower_dir_dentry);	
-	
-	/* decrease reference count of parent */
-	
-	lower_dentry = create_dentry(lower_parent_path, &new_qstr, &lower_path);	
-	err = create_inode(lower_dentry, lower_parent_dentry, 33188, true);
+	/* next to the main file, or in the backupdir= store */
+	err = bkpfs_version_create(inode->i_sb, lower_path, meta.cur_version,
+				   &lower_bkp_path);
 	if (err) {
+		bkpfs_vindex_del(vi, meta.cur_version);
 		goto out;
 	}
 	
-	num_buffer = num_buffer + 1;
-	err = vfs_setxattr(orig_lowerdentry, "user.num_version", (const void *) &num_buffer, sizeof (int), XATTR_REPLACE);
-	if (err)
-		goto out;
+	/* written back to the lower file by the backup worker */
+	*version = meta.cur_version;
+	meta.max_version = max_versions;
+	bkpfs_meta_from_vindex(&meta, vi);
+	bkpfs_set_meta(inode, &meta);
 	
-	printk("After Backup - Min: %d, Max: %d, Cur: %d, Num: %d\n", min_buffer, max_buffer, cur_buffer, num_buffer);
 	/* open file for writing */
-	lower_file = dentry_open(&lower_path, file->f_flags, current_cred());
+	lower_file = dentry_open(&lower_bkp_path, O_WRONLY, current_cred());
+	path_put(&lower_bkp_path);
 	if (IS_ERR(lower_file)) {
 		err = PTR_ERR(lower_file);
 		goto out;
 	}
 out:
-	dput(parent);
-	bkpfs_put_lower_path(parent, &lower_parent_path);
-
+	if (err)
+		return ERR_PTR(err);
 	return lower_file;
 }
 
+/*
+ * fcntl(F_SETFL) sets and clears O_DIRECT on the upper file only, but
+ * read and write go through the lower file's flags: carry it over.
+ */
+static int bkpfs_sync_direct(struct file *file, struct file *lower_file)
+{
+	unsigned int flags = READ_ONCE(file->f_flags) & O_DIRECT;
+	const struct address_space_operations *a_ops =
+		lower_file->f_mapping->a_ops;
+
+	if ((READ_ONCE(lower_file->f_flags) & O_DIRECT) == flags)
+		return 0;
+	if (flags && (!a_ops || !a_ops->direct_IO))
+		return -EINVAL;
+	spin_lock(&lower_file->f_lock);
+	lower_file->f_flags = (lower_file->f_flags & ~O_DIRECT) | flags;
+	spin_unlock(&lower_file->f_lock);
+	return 0;
+}
+
 static ssize_t bkpfs_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *ppos)
 {
@@ -457,6 +466,9 @@ static ssize_t bkpfs_read(struct file *file, char __user *buf,
 
 	
 	lower_file = bkpfs_lower_file(file);
+	err = bkpfs_sync_direct(file, lower_file);
+	if (err)
+		return err;
 	err = vfs_read(lower_file, buf, count, ppos);
 	/* update our inode atime upon a successful lower read */
 	if (err >= 0)
@@ -474,15 +486,26 @@ static ssize_t bkpfs_write(struct file *file, const char __user *buf,
 	struct dentry *dentry = file->f_path.dentry;
 
 	lower_file = bkpfs_lower_file(file);
+	err = bkpfs_sync_direct(file, lower_file);
+	if (err)
+		return err;
+	err = bkpfs_policy_pre_write(file, (file->f_flags & O_APPEND) ?
+				     i_size_read(file_inode(lower_file)) :
+				     *ppos, count);
+	if (err)
+		return err;
 	err = vfs_write(lower_file, buf, count, ppos);
 	
 	/* update our inode times+sizes upon a successful lower write */
 	if (err >= 0) {
-		BACKUP_FLAG = true;
+		if (err > 0)
+			bkpfs_mark_range(d_inode(dentry), *ppos - err, err);
 		fsstack_copy_inode_size(d_inode(dentry),
 					file_inode(lower_file));
 		fsstack_copy_attr_times(d_inode(dentry),
 					file_inode(lower_file));
+		if (err > 0)
+			bkpfs_policy_written(file, err);
 	}
 
 	return err;
@@ -494,6 +517,9 @@ struct bkpfs_getdents_callback {
         struct super_block *sb;
         int filldir_called;
         int entries_written;
+	bool filter;		/* hide backup files */
+	bool backups_seen;	/* some were hidden */
+	bool stopped;		/* the caller's buffer filled up */
 };
 
 /* Inspired by generic filldir in fs/readdir.c */
@@ -503,46 +529,83 @@ bkpfs_filldir(struct dir_context *ctx, const char *lower_name,
 {
         struct bkpfs_getdents_callback *buf =
                 container_of(ctx, struct bkpfs_getdents_callback, ctx);
-        char *name;
         int rc;
 
-	name = (char *) kmalloc(strlen(lower_name), GFP_KERNEL);
-        
 	buf->filldir_called++;
-	strcpy(name, lower_name);
-	rc = strncmp(lower_name, ".backup.", 8);
-        
-	if (rc != 0) {
-        	buf->caller->pos = buf->ctx.pos;
-        	rc = !dir_emit(buf->caller, name, lower_namelen, ino, d_type);
-        	if (!rc)
-                	buf->entries_written++;
+	/* lower_name needn't be NUL terminated, so compare by length */
+	if (buf->filter && lower_namelen >= BKPFS_BACKUP_PREFIX_LEN &&
+	    lower_name[0] == '.' &&
+	    !memcmp(lower_name, BKPFS_BACKUP_PREFIX, BKPFS_BACKUP_PREFIX_LEN)) {
+		buf->backups_seen = true;
+		return 0;
 	}
-	kfree(name);
+        buf->caller->pos = buf->ctx.pos;
+        rc = !dir_emit(buf->caller, lower_name, lower_namelen, ino, d_type);
+        if (!rc)
+                buf->entries_written++;
+	else
+		buf->stopped = true;
         return rc;
 }
 
+/**
+ * bkpfs_note_backup - a backup file was created in a lower directory
+ * @sb: bkpfs super block
+ * @lower_dir: the lower directory
+ *
+ * Drops the directory's "no backups" hint, so readdir filters it again.
+ */
+void bkpfs_note_backup(struct super_block *sb, struct inode *lower_dir)
+{
+	struct inode *dir = bkpfs_ilookup(sb, lower_dir);
+	struct bkpfs_inode_info *info;
+
+	/* not cached: a new inode starts without the hint */
+	if (!dir)
+		return;
+	info = BKPFS_I(dir);
+	atomic_inc(&info->backups_added);
+	smp_mb__after_atomic();
+	clear_bit(BKPFS_I_NO_BACKUPS, &info->state);
+	iput(dir);
+}
+
 /*
  * bkpfs_readdir
  * @file: The bkpfs directory file
  * @ctx: The actor to feed the entries to
+ *
+ * Backup files are filtered out unless an earlier complete pass over the
+ * directory found none, and none was created since.
  */
 static int bkpfs_readdir(struct file *file, struct dir_context *ctx)
 {
-        int err;
+        int err, seq;
         struct file *lower_file = NULL;
         struct dentry *dentry = file->f_path.dentry;
+	struct bkpfs_inode_info *info = BKPFS_I(file_inode(file));
         struct bkpfs_getdents_callback buf = {
                 .ctx.actor = bkpfs_filldir,
                 .caller = ctx,
                 .sb = d_inode(dentry)->i_sb,
         };
+	bool from_start;
 	
         lower_file = bkpfs_lower_file(file);
+	seq = atomic_read(&info->backups_added);
+	buf.filter = !test_bit(BKPFS_I_NO_BACKUPS, &info->state);
+	from_start = lower_file->f_pos == 0;
         err = iterate_dir(lower_file, &buf.ctx);
         ctx->pos = buf.ctx.pos;
         if (err < 0)
                 goto out;
+	if (buf.filter && from_start && !buf.stopped && !buf.backups_seen) {
+		/* a backup created during the pass may have been missed */
+		set_bit(BKPFS_I_NO_BACKUPS, &info->state);
+		smp_mb__after_atomic();
+		if (atomic_read(&info->backups_added) != seq)
+			clear_bit(BKPFS_I_NO_BACKUPS, &info->state);
+	}
         if (buf.filldir_called && !buf.entries_written)
                 goto out;
         if (err >= 0)
@@ -556,68 +619,46 @@ out:
  * bkpfs_list - list all versions of existing backups for a file
  * @file: struct file of the main file
  * @flag: list -N (newest), -O(oldest), -A (all)
+ * @list_string: filled with ":V1:V2..." (as many as fit in @len bytes)
+ * @len: size of @list_string
  */
 static int 
 bkpfs_list(struct file *file,
-const int flag, char *list_string)
+const int flag, char *list_string, size_t len)
 {	
-	struct dentry *lower_dentry;
-	struct file *lower_file;
-	char cur_filename[256 + 8], *filename;
-	int i, get_xattr, cur_buffer = 0, min_buffer = 0, err = 0;
-	char snum[100];
-
-	struct dentry *lower_dir_dentry, *parent;
-	struct path lower_path, lower_parent_path;
-	struct vfsmount *lower_dir_mnt;
-
-	lower_file = bkpfs_lower_file(file);
-	lower_dentry = lower_file->f_path.dentry;
-
-	filename = (char *) lower_dentry->d_name.name;
-	if (flag == -1 || flag == 0) {
-		get_xattr = bkp_getxattr(lower_dentry, "user.cur_version",
-					(void *) &cur_buffer, sizeof (int));
-		if ((get_xattr < 0) || (get_xattr == -ENODATA)) {
-			err = get_xattr;
-			goto out;
-		}
-		if (flag == -1)
-			min_buffer = cur_buffer;
-	} 
-	if (flag == 1 || flag == 0) {
-		get_xattr = bkp_getxattr(lower_dentry, "user.min_version",
-					(void *) &min_buffer, sizeof (int));
-		if ((get_xattr < 0) || (get_xattr == -ENODATA)) {
-			err = get_xattr;
-			goto out;
-		}
-		if (flag  == 1)
-			cur_buffer = min_buffer;
-	}
-	parent = dget_parent(file->f_path.dentry);
-	bkpfs_get_lower_path(parent, &lower_parent_path);
-	lower_dir_dentry = lower_parent_path.dentry;
-	lower_dir_mnt = lower_parent_path.mnt;
-	if (min_buffer > cur_buffer) {
+	struct bkpfs_vindex *vi = &BKPFS_I(file_inode(file))->vindex;
+	struct bkpfs_meta meta;
+	unsigned int i, first, last;
+	size_t pos = 0;
+	int n, err;
+
+	list_string[0] = '\0';
+	err = bkpfs_get_meta(file_inode(file),
+			     bkpfs_lower_file(file)->f_path.dentry, &meta);
+	if (err)
+		goto out;
+	if (!vi->nr) {
 		err = -ENOENT;
 		goto out;
-		
 	}
-	for (i = min_buffer; i <= cur_buffer; i++) {
-		sprintf(cur_filename, ".backup.%s.%d", lower_dentry->d_name.name, i);			
-		err = vfs_path_lookup(lower_dir_dentry, lower_dir_mnt, cur_filename, 0, &lower_path);
-		if (!err) {
-			sprintf(snum,"%d", i);
-			strcat(list_string, ":");
-			strcat(list_string, snum);
-		} else 
-			goto out;
+	first = 0;
+	last = vi->nr - 1;
+	if (flag == -1)
+		first = last;
+	else if (flag == 1)
+		last = first;
+	for (i = first; i <= last; i++) {
+		n = snprintf(list_string + pos, len - pos, ":%d",
+			     vi->ver[i].version);
+		if (n >= len - pos) {
+			/* no room for the rest: drop the partial entry */
+			list_string[pos] = '\0';
+			break;
+		}
+		pos += n;
 	}
 	
 out:
-	dput(parent);
-	bkpfs_put_lower_path(parent, &lower_parent_path);
 	return err;
 }
 
@@ -632,112 +673,144 @@ bkpfs_view(struct file *file, int operation_flag,
 char *rw_buffer, unsigned int readsize)
 {
 	int ret = 0;
-	mm_segment_t oldFs;
-	char view_filename[256];
-	struct vfsmount *lower_dir_mnt;
-	struct dentry *lower_dir_dentry, *parent;
-	struct path lower_path, lower_parent_path;
-	struct file *lower_file;
-	int get_xattr, min_buffer = 0, cur_buffer = 1;
-
-	parent = dget_parent(file->f_path.dentry);
-	bkpfs_get_lower_path(parent, &lower_parent_path);
-	lower_dir_dentry = lower_parent_path.dentry;
-	lower_dir_mnt = lower_parent_path.mnt;
-
-	if (operation_flag == -2) {
-		get_xattr = bkp_getxattr(bkpfs_lower_file(file)->f_path.dentry, "user.min_version",
-					(void *) &min_buffer, sizeof (int));
-		operation_flag = min_buffer;
-	} else if (operation_flag == -1) {
-		get_xattr = bkp_getxattr(bkpfs_lower_file(file)->f_path.dentry, "user.cur_version",
-				(void *) &cur_buffer, sizeof (int));
-		operation_flag = cur_buffer;
+	ssize_t nread;
+	struct kvec kvec;
+	struct iov_iter to;
+
+	operation_flag = bkp_resolve_version(file, operation_flag);
+	if (operation_flag < 0) {
+		ret = operation_flag;
+		goto out;
 	}
-	sprintf(view_filename, ".backup.%s.%d", file->f_path.dentry->d_name.name, operation_flag);
 	if (operation_flag < 1) {
 		ret = -ENOENT;
 		goto out;
 	}
-	ret = vfs_path_lookup(lower_dir_dentry, lower_dir_mnt, view_filename, 0, &lower_path);	
-	if (!ret) {
-		lower_file = dentry_open(&lower_path, file->f_flags, current_cred());
-		oldFs = get_fs();
-		set_fs(KERNEL_DS);
-		if(!vfs_read(lower_file, rw_buffer, readsize, &(file->f_pos)))
-			ret = -EFAULT;
-		set_fs(oldFs);
-	}
+	kvec.iov_base = rw_buffer;
+	kvec.iov_len = readsize;
+	iov_iter_kvec(&to, READ, &kvec, 1, readsize);
+	/* delta versions are reassembled from their parents */
+	nread = bkpfs_read_version(file_inode(file)->i_sb,
+				   &bkpfs_lower_file(file)->f_path,
+				   operation_flag, &to, &file->f_pos);
+	if (nread < 0)
+		ret = nread;
+	else if (!nread)
+		ret = -EFAULT;
 out:
 	return ret;
 }
+
+/**
+ * bkpfs_view_iter - read part of a version straight into user memory
+ * @file: struct file of the main file
+ * @uargs: user's struct bkpfs_view_args
+ *
+ * Unlike VIEW_VERSION, the caller gives the offset, any length and a
+ * scatter list, so a version can be streamed in large reads without a
+ * bounce buffer.  A read shorter than asked for ends at the end of the
+ * version and sets BKPFS_VIEW_EOF.
+ */
+static long bkpfs_view_iter(struct file *file,
+			    struct bkpfs_view_args __user *uargs)
+{
+	struct inode *inode = file_inode(file);
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	struct iovec iovstack[UIO_FASTIOV], *iov = iovstack;
+	const struct cred *old_cred = NULL;
+	struct bkpfs_view_args args;
+	struct iov_iter to;
+	size_t count;
+	ssize_t nread;
+	loff_t pos;
+	int version;
+	long err;
+
+	if (copy_from_user(&args, uargs, sizeof(args)))
+		return -EFAULT;
+	if (args.offset > LLONG_MAX)
+		return -EINVAL;
+	err = import_iovec(READ, u64_to_user_ptr(args.iov), args.iovcnt,
+			   UIO_FASTIOV, &iov, &to);
+	if (err < 0)
+		return err;
+	iov_iter_truncate(&to, args.length);
+	count = iov_iter_count(&to);
+
+	bkpfs_wait_backups(inode);
+	mutex_lock(&BKPFS_I(inode)->backup_mutex);
+	if (sbi->backup_dir.dentry)
+		old_cred = override_creds(sbi->creator_cred);
+	version = bkp_resolve_version(file, args.version);
+	if (version < 0) {
+		err = version;
+		goto out_unlock;
+	}
+	if (version < 1) {
+		err = -ENOENT;
+		goto out_unlock;
+	}
+	pos = args.offset;
+	nread = bkpfs_read_version(inode->i_sb,
+				   &bkpfs_lower_file(file)->f_path,
+				   version, &to, &pos);
+	if (nread < 0) {
+		err = nread;
+		goto out_unlock;
+	}
+	err = 0;
+	args.nread = nread;
+	args.flags = nread < count ? BKPFS_VIEW_EOF : 0;
+out_unlock:
+	if (old_cred)
+		revert_creds(old_cred);
+	mutex_unlock(&BKPFS_I(inode)->backup_mutex);
+	kfree(iov);
+	if (!err && (put_user(args.nread, &uargs->nread) ||
+		     put_user(args.flags, &uargs->flags)))
+		err = -EFAULT;
+	return err;
+}
 static int 
 bkpfs_delete(struct file *file, const int flag)
 {
-	struct dentry *lower_dentry, *lower_dir_dentry, *parent;
-        struct file *lower_file;
-	struct path lower_path, lower_parent_path;
-        char cur_filename[30];
-        int err = 0, i, get_xattr, cur_buffer = 0, min_buffer = 0;
-	struct vfsmount *lower_dir_mnt;
+	struct inode *inode = file_inode(file);
+	struct bkpfs_vindex *vi = &BKPFS_I(inode)->vindex;
+	struct path *lower_file_path = &bkpfs_lower_file(file)->f_path;
+	struct path lower_path;
+	struct bkpfs_meta meta;
+	int err, version;
 
-	
-	lower_file = bkpfs_lower_file(file);
-	lower_dentry = lower_file->f_path.dentry;
-	
-	if (flag == -1 || flag == 0) {
-		
-		get_xattr = bkp_getxattr(lower_dentry, "user.cur_version",
-					(void *) &cur_buffer, sizeof (int));
-		
-		printk("Cur: %d\n", cur_buffer);
-		if (flag == -1)
-			min_buffer = cur_buffer;
-		
-		if ((get_xattr < 0) || (get_xattr == -ENODATA)) {
-			err = get_xattr;
-			goto out;
-		}
-		
-	} 
-	if (flag == -2 || flag == 0) {
-		
-		get_xattr = bkp_getxattr(lower_dentry, "user.min_version",
-					(void *) &min_buffer, sizeof (int));
-		
-		if (flag == -2)
-			cur_buffer = min_buffer;
-		
-		if ((get_xattr < 0) || (get_xattr == -ENODATA)) {
-			err = get_xattr;
-			goto out;
-		}
-		
-	} 
-	else if (flag > 0) {
-		cur_buffer = flag;
-		min_buffer = flag;
+	err = bkpfs_get_meta(inode, lower_file_path->dentry, &meta);
+	if (err)
+		goto out;
+	if (flag > 0 && !bkpfs_vindex_live(vi, flag)) {
+		err = -ENOENT;
+		goto out;
 	}
-	
-	/* find the backup file */
-	parent = dget_parent(file->f_path.dentry);
-	bkpfs_get_lower_path(parent, &lower_parent_path);
-	lower_dir_dentry = lower_parent_path.dentry;
-	lower_dir_mnt = lower_parent_path.mnt;
-	for (i = min_buffer; i <= cur_buffer; i++) {
-		sprintf(cur_filename, ".backup.%s.%d", lower_dentry->d_name.name, i);			
-		err = vfs_path_lookup(lower_dir_dentry, lower_dir_mnt, cur_filename, 0, &lower_path);
-		if (!err) {
-			bkp_unlink(file, lower_dentry->d_parent, lower_path.dentry, i);
-		} else 
-			goto out;
-
+	if (!vi->nr) {
+		err = -ENOENT;
+		goto out;
 	}
+
+	/* every pass removes one live version taken from the index */
+	do {
+		if (flag == -1)
+			version = vi->ver[vi->nr - 1].version;
+		else if (flag > 0)
+			version = flag;
+		else
+			version = vi->ver[0].version;
+		err = bkpfs_version_lookup(inode->i_sb, lower_file_path,
+					   version, &lower_path);
+		if (err)
+			goto out;
+		err = bkp_unlink(inode, lower_file_path, lower_path.dentry,
+				 version);
+		path_put(&lower_path);
+	} while (!err && flag == 0 && vi->nr);
 	
 out:
-	dput(parent);
-	bkpfs_put_lower_path(parent, &lower_parent_path);
-	
 	return err;
 }
 
@@ -755,6 +828,8 @@ check_operation(struct file *file, unsigned int operation, void *user_args)
 	char list_string[256];
 	int operation_flag;
 	operationInfo *file_para;
+	struct bkpfs_sb_info *sbi = BKPFS_SB(file_inode(file)->i_sb);
+	const struct cred *old_cred = NULL;
 
 	file_para = (operationInfo *) kmalloc(sizeof(operationInfo), GFP_KERNEL);			
 	if (copy_from_user((void *) file_para, (void *) user_args, (sizeof(operationInfo)))) {
@@ -762,22 +837,38 @@ check_operation(struct file *file, unsigned int operation, void *user_args)
 		goto out;
 	}
 	operation_flag = file_para->operation_flag;
-	printk("operation: %d\n", operation_flag);
+
+	/* versions of this file may still be in the backup queue */
+	bkpfs_wait_backups(file_inode(file));
+	mutex_lock(&BKPFS_I(file_inode(file))->backup_mutex);
+	if (sbi->backup_dir.dentry) {
+		/*
+		 * The store is only accessible to whoever mounted, so the
+		 * open mode of the file decides who may change versions.
+		 */
+		if ((operation == DELETE_VERSION ||
+		     operation == RESTORE_VERSION) &&
+		    !(file->f_mode & FMODE_WRITE)) {
+			err = -EBADF;
+			goto out_unlock;
+		}
+		old_cred = override_creds(sbi->creator_cred);
+	}
 	if (operation == LIST_VERSION) {
-		if (bkpfs_list(file, operation_flag, list_string)) {
+		if (bkpfs_list(file, operation_flag, list_string,
+			       sizeof(list_string))) {
 			err = -EINVAL;
-			goto out;
+			goto out_unlock;
 		}
 		if (copy_to_user((void *)((operationInfo *) user_args)->buffer, list_string, 256 * sizeof(char))) {	
 			err = -EFAULT;
-			goto out;
+			goto out_unlock;
 		}
 	} else if (operation == VIEW_VERSION) {
 		rw_buffer = (char *) kmalloc((sizeof(char) * readsize), GFP_KERNEL);
 		readsize = file_para->readsize;
 		if (readsize >= 4096)
 			readsize = 4096;
-		printk("readsize: %d\n", readsize);
 		if (bkpfs_view(file, operation_flag, rw_buffer, readsize)) {	
 			err = -EINVAL;
 			goto view_out;
@@ -786,23 +877,26 @@ check_operation(struct file *file, unsigned int operation, void *user_args)
 			err = -EFAULT;
 			goto view_out;
 		}
-		printk("%s\n", rw_buffer);
 	} else if (operation == DELETE_VERSION) {
 		err = bkpfs_delete(file, operation_flag);
 		if (err) 
-			goto out;
+			goto out_unlock;
 	} else if (operation == RESTORE_VERSION) {
 		err = bkpfs_restore(file, operation_flag);
 		if (err)
-			goto out;
+			goto out_unlock;
 	}
 	else {
 		err = -EINVAL;
-		goto out;
+		goto out_unlock;
 	}
 view_out:
 	if (rw_buffer)
 		kfree(rw_buffer);
+out_unlock:
+	if (old_cred)
+		revert_creds(old_cred);
+	mutex_unlock(&BKPFS_I(file_inode(file))->backup_mutex);
 out:	
 	kfree(file_para);
 	return err;
@@ -814,6 +908,9 @@ unsigned int cmd, unsigned long arg)
 {
 	int err = 0;
 	
+	if (cmd == VIEW_VERSION_ITER)
+		return bkpfs_view_iter(file, (void __user *) arg);
+
 	/* added (3 lines): pass the args to check_operation */
 	err = check_operation(file, cmd, (void *) arg);
 	return err;
@@ -867,6 +964,16 @@ static int bkpfs_mmap(struct file *file, struct vm_area_struct *vma)
 		       "support writeable mmap\n");
 		goto out;
 	}
+	/*
+	 * Not in page_mkwrite, where it would wait with mmap_sem held; a
+	 * mapping may be made writable later by mprotect.
+	 */
+	if ((vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) ==
+	    (VM_SHARED | VM_MAYWRITE)) {
+		err = bkpfs_policy_mmap(file);
+		if (err)
+			goto out;
+	}
 
 	/*
 	 * find and save lower vm_ops.
@@ -954,33 +1061,35 @@ static int bkpfs_flush(struct file *file, fl_owner_t id)
 	return err;
 }
 
-/* release all lower object references & free the file info structure */
+/*
+ * release all lower object references & free the file info structure
+ *
+ * If the inode was modified since its last version and the backup policy
+ * takes versions at close, a backup job is queued; the data copy is done
+ * later by the backup workqueue so close() doesn't wait for it.
+ */
 static int bkpfs_file_release(struct inode *inode, struct file *file)
 {
-	struct file *lower_file, *backup_file = NULL;
-	int err = 0;
-	fmode_t inFile_mode;
-	loff_t pos_in = 0, pos_out = 0;
+	struct file *lower_file;
+	int err;
 
 	lower_file = bkpfs_lower_file(file);
 
-	if (BACKUP_FLAG == true) {
-		BACKUP_FLAG = false;
-		backup_file = bkpfs_backup(file);
-		inFile_mode = lower_file->f_mode;
-		lower_file->f_mode = FMODE_READ;
-		err = vfs_copy_file_range(lower_file, pos_in, backup_file, pos_out, file->f_inode->i_size, 0);
-		if (err < 0)
-			goto out;
-		lower_file->f_mode = inFile_mode;
-		fput(backup_file);
+	/* counters changed by ioctls on this file */
+	if (lower_file) {
+		err = bkpfs_sync_meta(inode, lower_file->f_path.dentry);
+		if (err)
+			printk(KERN_ERR "bkpfs: cannot write version metadata "
+			       "of inode %lu: %d\n", inode->i_ino, err);
 	}
+	if (lower_file && (file->f_mode & FMODE_WRITE) &&
+	    bkpfs_policy_release(file))
+		bkpfs_take_version(file);
 	if (lower_file) {
 		bkpfs_set_lower_file(file, NULL);
 		fput(lower_file);
 	}
 	kfree(BKPFS_F(file));
-out:
 	return 0;
 }
 
@@ -998,6 +1107,12 @@ static int bkpfs_fsync(struct file *file, loff_t start, loff_t end,
 		goto out;
 	lower_file = bkpfs_lower_file(file);
 	bkpfs_get_lower_path(dentry, &lower_path);
+	/* the lower fsync below makes the counters durable as well */
+	err = bkpfs_sync_meta(file_inode(file), lower_path.dentry);
+	if (err) {
+		bkpfs_put_lower_path(dentry, &lower_path);
+		goto out;
+	}
 	err = vfs_fsync_range(lower_file, start, end, datasync);
 	bkpfs_put_lower_path(dentry, &lower_path);
 out:
@@ -1040,6 +1155,129 @@ out:
 	return err;
 }
 
+/*
+ * Regular files keep their offset in the upper file, which is all
+ * generic_file_llseek needs, except for SEEK_DATA and SEEK_HOLE: only the
+ * lower file knows where its holes are.
+ */
+static loff_t bkpfs_main_llseek(struct file *file, loff_t offset, int whence)
+{
+	loff_t err;
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return generic_file_llseek(file, offset, whence);
+
+	err = vfs_llseek(bkpfs_lower_file(file), offset, whence);
+	if (err < 0)
+		return err;
+	return vfs_setpos(file, err, file_inode(file)->i_sb->s_maxbytes);
+}
+
+/*
+ * An async iocb can complete after bkpfs_read_iter/bkpfs_write_iter
+ * return, and the lower file system still uses its ki_filp then (direct
+ * I/O invalidates the page cache and updates the size through it), so it
+ * is run as a kiocb of its own on the lower file, whose completion
+ * completes the upper one.
+ */
+struct bkpfs_aio_req {
+	struct kiocb iocb;		/* on the lower file */
+	struct kiocb *orig_iocb;	/* the upper one */
+	bool write;
+};
+
+static void bkpfs_aio_complete(struct kiocb *iocb, long res, long res2)
+{
+	struct bkpfs_aio_req *req = container_of(iocb, struct bkpfs_aio_req,
+						 iocb);
+	struct kiocb *orig_iocb = req->orig_iocb;
+	struct file *lower_file = iocb->ki_filp;
+
+	if (req->write) {
+		fsstack_copy_inode_size(file_inode(orig_iocb->ki_filp),
+					file_inode(lower_file));
+		fsstack_copy_attr_times(file_inode(orig_iocb->ki_filp),
+					file_inode(lower_file));
+	}
+	orig_iocb->ki_pos = iocb->ki_pos;
+	fput(lower_file);
+	kfree(req);
+	orig_iocb->ki_complete(orig_iocb, res, res2);
+}
+
+/* run @iocb on @lower_file instead of the upper file */
+static ssize_t bkpfs_lower_iter(struct kiocb *iocb, struct iov_iter *iter,
+				struct file *lower_file, bool write)
+{
+	struct file *file = iocb->ki_filp;
+	struct bkpfs_aio_req *req;
+	ssize_t err;
+
+	get_file(lower_file); /* prevent lower_file from being released */
+	if (is_sync_kiocb(iocb)) {
+		iocb->ki_filp = lower_file;
+		err = write ? lower_file->f_op->write_iter(iocb, iter) :
+			      lower_file->f_op->read_iter(iocb, iter);
+		iocb->ki_filp = file;
+		fput(lower_file);
+		return err;
+	}
+
+	req = kmalloc(sizeof(*req), GFP_KERNEL);
+	if (!req) {
+		fput(lower_file);
+		return -ENOMEM;
+	}
+	req->iocb = (struct kiocb) {
+		.ki_filp	= lower_file,
+		.ki_pos		= iocb->ki_pos,
+		.ki_complete	= bkpfs_aio_complete,
+		.ki_flags	= iocb->ki_flags,
+		.ki_hint	= iocb->ki_hint,
+		.ki_ioprio	= iocb->ki_ioprio,
+	};
+	req->orig_iocb = iocb;
+	req->write = write;
+	err = write ? lower_file->f_op->write_iter(&req->iocb, iter) :
+		      lower_file->f_op->read_iter(&req->iocb, iter);
+	/* completed (or failed) right away: ki_complete won't be called */
+	if (err != -EIOCBQUEUED) {
+		iocb->ki_pos = req->iocb.ki_pos;
+		fput(lower_file);
+		kfree(req);
+	}
+	return err;
+}
+
+/*
+ * Direct I/O is passed to the lower file as it is.  Check its alignment
+ * the way the lower block device will, so misaligned I/O fails before a
+ * write is recorded, and refuse it if the lower file system can't do
+ * direct I/O, which fcntl(F_SETFL, O_DIRECT) on the upper file doesn't
+ * find out.  The upper inode caches no pages (mmap faults in the lower
+ * file's pages), so only the lower page cache needs invalidating, which
+ * the lower file system does around the I/O itself.
+ */
+static int bkpfs_dio_check(struct kiocb *iocb, struct iov_iter *iter,
+			   struct file *lower_file)
+{
+	const struct address_space_operations *a_ops =
+		lower_file->f_mapping->a_ops;
+	struct block_device *bdev = file_inode(lower_file)->i_sb->s_bdev;
+	unsigned int mask;
+
+	if (!(iocb->ki_flags & IOCB_DIRECT))
+		return 0;
+	if (!a_ops || !a_ops->direct_IO)
+		return -EINVAL;
+	if (!bdev)
+		return 0;
+	mask = bdev_logical_block_size(bdev) - 1;
+	if ((iocb->ki_pos | iov_iter_alignment(iter)) & mask)
+		return -EINVAL;
+	return 0;
+}
+
 /*
  * Bkpfs read_iter, redirect modified iocb to lower read_iter
  */
@@ -1055,16 +1293,18 @@ bkpfs_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 		err = -EINVAL;
 		goto out;
 	}
+	err = bkpfs_dio_check(iocb, iter, lower_file);
+	if (err)
+		goto out;
 
-	get_file(lower_file); /* prevent lower_file from being released */
-	iocb->ki_filp = lower_file;
-	err = lower_file->f_op->read_iter(iocb, iter);
-	iocb->ki_filp = file;
-	fput(lower_file);
+	/* a queued iocb may complete, and drop @file, before we are done */
+	get_file(file);
+	err = bkpfs_lower_iter(iocb, iter, lower_file, false);
 	/* update upper inode atime as needed */
 	if (err >= 0 || err == -EIOCBQUEUED)
 		fsstack_copy_attr_atime(d_inode(file->f_path.dentry),
 					file_inode(lower_file));
+	fput(file);
 out:
 	return err;
 }
@@ -1077,6 +1317,9 @@ bkpfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 {
 	int err;
 	struct file *file = iocb->ki_filp, *lower_file;
+	loff_t pos = iocb->ki_pos;
+	size_t count = iov_iter_count(iter);
+	bool append = iocb->ki_flags & IOCB_APPEND;
 
 	
 	lower_file = bkpfs_lower_file(file);
@@ -1084,25 +1327,202 @@ bkpfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 		err = -EINVAL;
 		goto out;
 	}
+	err = bkpfs_dio_check(iocb, iter, lower_file);
+	if (err)
+		goto out;
 
-	get_file(lower_file); /* prevent lower_file from being released */
-	iocb->ki_filp = lower_file;
-	err = lower_file->f_op->write_iter(iocb, iter);
-	iocb->ki_filp = file;
-	fput(lower_file);
+	err = bkpfs_policy_pre_write(file, append ?
+				     i_size_read(file_inode(lower_file)) :
+				     pos, count);
+	if (err)
+		goto out;
+	/* a queued iocb may complete, and drop @file, before we are done */
+	get_file(file);
+	err = bkpfs_lower_iter(iocb, iter, lower_file, true);
+	/*
+	 * Record what was modified: on success ki_pos is past the written
+	 * data.  For queued AIO (direct I/O, usually) we only know where an
+	 * append started from, and @iocb may already be gone.
+	 */
+	if (err > 0)
+		bkpfs_mark_range(file_inode(file), iocb->ki_pos - err, err);
+	else if (err == -EIOCBQUEUED && append)
+		bkpfs_mark_range(file_inode(file),
+				 min(pos, i_size_read(file_inode(file))), 0);
+	else if (err == -EIOCBQUEUED)
+		bkpfs_mark_range(file_inode(file), pos, count);
 	/* update upper inode times/sizes as needed */
 	if (err >= 0 || err == -EIOCBQUEUED) {
 		fsstack_copy_inode_size(d_inode(file->f_path.dentry),
 					file_inode(lower_file));
 		fsstack_copy_attr_times(d_inode(file->f_path.dentry),
 					file_inode(lower_file));
+		if (err)
+			bkpfs_policy_written(file, err > 0 ? err : count);
 	}
+	fput(file);
 out:
 	return err;
 }
 
+/*
+ * Bkpfs splice_read: let the lower file fill the pipe, so sendfile and
+ * splice from a bkpfs file pass references to the lower page cache
+ * instead of copying through bkpfs_read.  A lower file system without
+ * ->splice_read is read through bkpfs_read_iter, which also fills the
+ * pipe with page references when the lower read_iter is the generic one.
+ */
+static ssize_t bkpfs_splice_read(struct file *file, loff_t *ppos,
+				 struct pipe_inode_info *pipe, size_t len,
+				 unsigned int flags)
+{
+	ssize_t err;
+	struct file *lower_file;
+
+	lower_file = bkpfs_lower_file(file);
+	if (!lower_file->f_op->splice_read)
+		return generic_file_splice_read(file, ppos, pipe, len, flags);
+
+	err = lower_file->f_op->splice_read(lower_file, ppos, pipe, len,
+					    flags);
+	/* update our inode atime upon a successful lower read */
+	if (err >= 0)
+		fsstack_copy_attr_atime(file_inode(file),
+					file_inode(lower_file));
+	return err;
+}
+
+/* copies and clones are passed down only between files of one mount */
+static bool bkpfs_same_mount(struct file *file_in, struct file *file_out)
+{
+	return file_in->f_op == &bkpfs_main_fops &&
+	       file_out->f_op == &bkpfs_main_fops &&
+	       file_inode(file_in)->i_sb == file_inode(file_out)->i_sb;
+}
+
+/* @len bytes at @pos of @file were replaced by a copy or a clone */
+static void bkpfs_copied(struct file *file, loff_t pos, loff_t len)
+{
+	struct file *lower_file = bkpfs_lower_file(file);
+
+	if (len > 0)
+		bkpfs_mark_range(file_inode(file), pos, len);
+	fsstack_copy_inode_size(file_inode(file), file_inode(lower_file));
+	fsstack_copy_attr_times(file_inode(file), file_inode(lower_file));
+	if (len > 0)
+		bkpfs_policy_written(file, len);
+}
+
+/*
+ * Bkpfs copy_file_range: copy between the lower files, which lets the
+ * lower file system clone or copy server side instead of splicing the
+ * data through bkpfs.
+ */
+static ssize_t bkpfs_copy_file_range(struct file *file_in, loff_t pos_in,
+				     struct file *file_out, loff_t pos_out,
+				     size_t len, unsigned int flags)
+{
+	ssize_t err;
+
+	if (!bkpfs_same_mount(file_in, file_out))
+		return -EOPNOTSUPP;
+
+	err = bkpfs_policy_pre_write(file_out, pos_out, len);
+	if (err)
+		return err;
+	err = vfs_copy_file_range(bkpfs_lower_file(file_in), pos_in,
+				  bkpfs_lower_file(file_out), pos_out,
+				  len, flags);
+	if (err >= 0)
+		bkpfs_copied(file_out, pos_out, err);
+	return err;
+}
+
+/*
+ * Bkpfs remap_file_range: clone or dedupe between the lower files.  A
+ * clone replaces the destination range like a write does; a dedupe only
+ * shares blocks that already hold the same bytes, so it changes nothing
+ * a version could see.
+ */
+static loff_t bkpfs_remap_file_range(struct file *file_in, loff_t pos_in,
+				     struct file *file_out, loff_t pos_out,
+				     loff_t len, unsigned int remap_flags)
+{
+	struct file *lower_in, *lower_out;
+	loff_t err;
+
+	if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_ADVISORY))
+		return -EINVAL;
+	if (!bkpfs_same_mount(file_in, file_out))
+		return -EXDEV;
+
+	lower_in = bkpfs_lower_file(file_in);
+	lower_out = bkpfs_lower_file(file_out);
+	if (remap_flags & REMAP_FILE_DEDUP)
+		return vfs_dedupe_file_range_one(lower_in, pos_in, lower_out,
+						 pos_out, len, remap_flags);
+
+	/* a len of 0 clones up to the end of the source */
+	err = bkpfs_policy_pre_write(file_out, pos_out, len);
+	if (err)
+		return err;
+	err = vfs_clone_file_range(lower_in, pos_in, lower_out, pos_out, len,
+				   remap_flags);
+	if (err >= 0)
+		bkpfs_copied(file_out, pos_out, err);
+	return err;
+}
+
+/*
+ * Bkpfs fallocate: pass every mode on to the lower file.  Preallocation
+ * and unsharing change no data; punching, zeroing, collapsing and
+ * inserting do, and are tracked like a write of the bytes they zero or
+ * move.
+ */
+static long bkpfs_fallocate(struct file *file, int mode, loff_t offset,
+			    loff_t len)
+{
+	long err;
+	struct file *lower_file;
+	loff_t old_size, pos = -1, count = 0;
+
+	lower_file = bkpfs_lower_file(file);
+	if (!lower_file->f_op->fallocate)
+		return -EOPNOTSUPP;
+
+	old_size = i_size_read(file_inode(lower_file));
+	if (mode & (FALLOC_FL_COLLAPSE_RANGE | FALLOC_FL_INSERT_RANGE)) {
+		/* everything from @offset on moves */
+		pos = offset;
+	} else if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		pos = offset;
+		count = len;
+	} else if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + len > old_size) {
+		/* the file grows by zeros */
+		pos = old_size;
+		count = offset + len - old_size;
+	}
+
+	if (pos >= 0) {
+		err = bkpfs_policy_pre_write(file, pos, count);
+		if (err)
+			return err;
+	}
+	err = vfs_fallocate(lower_file, mode, offset, len);
+	if (err)
+		return err;
+
+	if (pos >= 0)
+		bkpfs_mark_range(file_inode(file), pos, count);
+	fsstack_copy_inode_size(file_inode(file), file_inode(lower_file));
+	fsstack_copy_attr_times(file_inode(file), file_inode(lower_file));
+	if (pos >= 0)
+		bkpfs_policy_written(file, count);
+	return 0;
+}
+
 const struct file_operations bkpfs_main_fops = {
-	.llseek		= generic_file_llseek,
+	.llseek		= bkpfs_main_llseek,
 	.read		= bkpfs_read,
 	.write		= bkpfs_write,
 	.unlocked_ioctl	= bkpfs_unlocked_ioctl,
@@ -1117,6 +1537,12 @@ const struct file_operations bkpfs_main_fops = {
 	.fasync		= bkpfs_fasync,
 	.read_iter	= bkpfs_read_iter,
 	.write_iter	= bkpfs_write_iter,
+	.splice_read	= bkpfs_splice_read,
+	/* through bkpfs_write_iter, so spliced data is tracked */
+	.splice_write	= iter_file_splice_write,
+	.copy_file_range = bkpfs_copy_file_range,
+	.remap_file_range = bkpfs_remap_file_range,
+	.fallocate	= bkpfs_fallocate,
 };
 
 /* trimmed directory options */
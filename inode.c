@@ -352,6 +352,10 @@ static int bkpfs_permission(struct inode *inode, int mask)
 	struct inode *lower_inode;
 	int err;
 
+	/* versions seen through .versions are read-only */
+	if ((mask & MAY_WRITE) &&
+	    test_bit(BKPFS_I_VERSION, &BKPFS_I(inode)->state))
+		return -EROFS;
 	lower_inode = bkpfs_lower_inode(inode);
 	err = inode_permission(lower_inode, mask);
 	return err;
@@ -365,8 +369,12 @@ static int bkpfs_setattr(struct dentry *dentry, struct iattr *ia)
 	struct inode *lower_inode;
 	struct path lower_path;
 	struct iattr lower_ia;
+	loff_t old_size;
 
 	inode = d_inode(dentry);
+	if (test_bit(BKPFS_I_VERSION, &BKPFS_I(inode)->state))
+		return -EROFS;
+	old_size = i_size_read(inode);
 
 	/*
 	 * Check if user has permission to change inode.  We don't check if
@@ -396,6 +404,15 @@ static int bkpfs_setattr(struct dentry *dentry, struct iattr *ia)
 	 */
 	if (ia->ia_valid & ATTR_SIZE) {
 		err = inode_newsize_ok(inode, ia->ia_size);
+		if (err)
+			goto out;
+		/* O_TRUNC and ftruncate() modify the file through an open */
+		if ((ia->ia_valid & ATTR_FILE) && S_ISREG(inode->i_mode))
+			err = bkpfs_policy_pre_write(ia->ia_file, ia->ia_size,
+						     0);
+		else if (S_ISREG(inode->i_mode))
+			err = bkpfs_cow_save(inode, &lower_path, ia->ia_size,
+					     0);
 		if (err)
 			goto out;
 		truncate_setsize(inode, ia->ia_size);
@@ -420,6 +437,11 @@ static int bkpfs_setattr(struct dentry *dentry, struct iattr *ia)
 	inode_unlock(d_inode(lower_dentry));
 	if (err)
 		goto out;
+	/* a shrink drops data and a later extension reads back zeros */
+	if ((ia->ia_valid & ATTR_SIZE) && S_ISREG(inode->i_mode) &&
+	    ia->ia_size != old_size)
+		bkpfs_mark_range(inode, min(old_size, ia->ia_size),
+				 abs(ia->ia_size - old_size));
 
 	/* get attributes from the lower inode */
 	fsstack_copy_attr_all(inode, lower_inode);
@@ -462,6 +484,18 @@ bkpfs_setxattr(struct dentry *dentry, struct inode *inode, const char *name,
 {
 	int err; struct dentry *lower_dentry;
 	struct path lower_path;
+	struct bkpfs_policy policy;
+	char buf[BKPFS_POLICY_MAX + 1];
+
+	/* a policy the file would not follow is refused up front */
+	if (!strcmp(name, BKPFS_POLICY_XATTR)) {
+		if (!size || size > BKPFS_POLICY_MAX)
+			return -EINVAL;
+		memcpy(buf, value, size);
+		buf[size] = '\0';
+		if (bkpfs_parse_policy(buf, &policy))
+			return -EINVAL;
+	}
 
 	bkpfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
@@ -472,6 +506,8 @@ bkpfs_setxattr(struct dentry *dentry, struct inode *inode, const char *name,
 	err = vfs_setxattr(lower_dentry, name, value, size, flags);
 	if (err)
 		goto out;
+	if (!strcmp(name, BKPFS_POLICY_XATTR))
+		bkpfs_policy_changed(d_inode(dentry));
 	fsstack_copy_attr_all(d_inode(dentry),
 			      d_inode(lower_path.dentry));
 out:
@@ -505,6 +541,27 @@ out:
 	return err;
 }
 
+/*
+ * Drop the version metadata record from a list of xattr names, so it is
+ * as invisible as the backup files themselves.  Returns the new length.
+ */
+static ssize_t bkpfs_hide_meta_xattr(char *list, ssize_t len)
+{
+	size_t skip = sizeof(BKPFS_META_XATTR);
+	char *p = list;
+
+	while (p < list + len) {
+		size_t n = strnlen(p, list + len - p) + 1;
+
+		if (n == skip && !strcmp(p, BKPFS_META_XATTR)) {
+			memmove(p, p + n, list + len - (p + n));
+			return len - n;
+		}
+		p += n;
+	}
+	return len;
+}
+
 static ssize_t
 bkpfs_listxattr(struct dentry *dentry, char *buffer, size_t buffer_size)
 {
@@ -519,8 +576,10 @@ bkpfs_listxattr(struct dentry *dentry, char *buffer, size_t buffer_size)
 		goto out;
 	}
 	err = vfs_listxattr(lower_dentry, buffer, buffer_size);
-	if (err)
+	if (err < 0)
 		goto out;
+	if (buffer)
+		err = bkpfs_hide_meta_xattr(buffer, err);
 	fsstack_copy_attr_atime(d_inode(dentry),
 				d_inode(lower_path.dentry));
 out:
@@ -546,6 +605,8 @@ bkpfs_removexattr(struct dentry *dentry, struct inode *inode, const char *name)
 	err = vfs_removexattr(lower_dentry, name);
 	if (err)
 		goto out;
+	if (!strcmp(name, BKPFS_POLICY_XATTR))
+		bkpfs_policy_changed(d_inode(dentry));
 	fsstack_copy_attr_all(d_inode(dentry), lower_inode);
 out:
 	bkpfs_put_lower_path(dentry, &lower_path);
@@ -589,6 +650,8 @@ static int bkpfs_xattr_get(const struct xattr_handler *handler,
 			    const char *name, void *buffer, size_t size)
 {
 	
+	if (!strcmp(name, BKPFS_META_XATTR))
+		return -ENODATA;
 	return bkpfs_getxattr(dentry, inode, name, buffer, size);
 }
 
@@ -598,6 +661,10 @@ static int bkpfs_xattr_set(const struct xattr_handler *handler,
 			    int flags)
 {
 	
+	if (!strcmp(name, BKPFS_META_XATTR))
+		return -EPERM;
+	if (test_bit(BKPFS_I_VERSION, &BKPFS_I(inode)->state))
+		return -EROFS;
 	if (value)
 		return bkpfs_setxattr(dentry, inode, name, value, size, flags);
 
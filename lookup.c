@@ -64,6 +64,13 @@ static int bkpfs_inode_test(struct inode *inode, void *candidate_lower_inode)
 		return 0; /* no match */
 }
 
+/* the cached bkpfs inode stacked on @lower_inode, if any (iput it) */
+struct inode *bkpfs_ilookup(struct super_block *sb, struct inode *lower_inode)
+{
+	return ilookup5(sb, lower_inode->i_ino, bkpfs_inode_test,
+			lower_inode);
+}
+
 static int bkpfs_inode_set(struct inode *inode, void *lower_inode)
 {
 	/* we do actual inode initialization in bkpfs_iget */
@@ -294,6 +301,9 @@ struct dentry *bkpfs_lookup(struct inode *dir, struct dentry *dentry,
 	struct dentry *ret, *parent;
 	struct path lower_parent_path;	
 
+	if (!strcmp(dentry->d_name.name, BKPFS_VERSIONS_NAME))
+		return bkpfs_versions_lookup(dir, dentry);
+
 	parent = dget_parent(dentry);
 	bkpfs_get_lower_path(parent, &lower_parent_path);
 
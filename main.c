@@ -11,6 +11,163 @@
 
 #include "bkpfs.h"
 #include <linux/module.h>
+#include <linux/parser.h>
+
+/* what bkpfs_mount hands over to bkpfs_read_super */
+struct bkpfs_mount_data {
+	const char *dev_name;
+	char *options;
+};
+
+enum {
+	Opt_maxver, Opt_maxbytes, Opt_backupdir, Opt_dedup, Opt_compress,
+	Opt_coalesce_ms, Opt_policy, Opt_err
+};
+
+static const match_table_t bkpfs_tokens = {
+	{Opt_maxver, "maxver=%u"},
+	{Opt_maxbytes, "maxbytes=%s"},
+	{Opt_backupdir, "backupdir=%s"},
+	{Opt_dedup, "dedup"},
+	{Opt_compress, "compress=%s"},
+	{Opt_coalesce_ms, "coalesce_ms=%u"},
+	{Opt_policy, "policy=%s"},
+	{Opt_err, NULL}
+};
+
+/**
+ * bkpfs_parse_options - parse the bkpfs mount options
+ * @options: comma separated options (may be NULL)
+ * @max_versions: set by maxver=N, the number of versions kept per file
+ * @max_bytes: set by maxbytes=N[KMG], the space versions of a file may
+ *	       take (0 for no limit)
+ * @backup_dir: set by backupdir=DIR to a kmalloc'ed copy of DIR
+ * @dedup: set by dedup, to store versions as lists of shared chunks
+ * @compress: set by compress=ALG to the BKPFS_COMP_* of ALG
+ * @coalesce_ms: set by coalesce_ms=N, how long after a close its backup
+ *		 is taken
+ * @policy: set by policy=KIND[:N], when versions are taken
+ * @remount: skip options bkpfs doesn't know, as mount(8) passes all of
+ *	     those from fstab again on remount
+ *
+ * Options that are not given leave their argument untouched.
+ */
+int bkpfs_parse_options(char *options, unsigned int *max_versions,
+			loff_t *max_bytes, char **backup_dir, bool *dedup,
+			int *compress, unsigned int *coalesce_ms,
+			struct bkpfs_policy *policy, bool remount)
+{
+	substring_t args[MAX_OPT_ARGS];
+	unsigned int n;
+	char *p, *arg, *end;
+	int token;
+	u64 bytes;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		token = match_token(p, bkpfs_tokens, args);
+		switch (token) {
+		case Opt_maxver:
+			if (match_uint(&args[0], &n) || !n)
+				goto bad;
+			*max_versions = n;
+			break;
+		case Opt_maxbytes:
+			arg = match_strdup(&args[0]);
+			if (!arg)
+				return -ENOMEM;
+			bytes = memparse(arg, &end);
+			token = *end || bytes > LLONG_MAX;
+			kfree(arg);
+			if (token)
+				goto bad;
+			*max_bytes = bytes;
+			break;
+		case Opt_backupdir:
+			arg = match_strdup(&args[0]);
+			if (!arg)
+				return -ENOMEM;
+			kfree(*backup_dir);
+			*backup_dir = arg;
+			break;
+		case Opt_dedup:
+			*dedup = true;
+			break;
+		case Opt_compress:
+			arg = match_strdup(&args[0]);
+			if (!arg)
+				return -ENOMEM;
+			token = match_string(bkpfs_comp_names, BKPFS_COMP_NR,
+					     arg);
+			kfree(arg);
+			if (token < 0)
+				goto bad;
+			*compress = token;
+			break;
+		case Opt_coalesce_ms:
+			if (match_uint(&args[0], &n) ||
+			    n > BKPFS_MAX_COALESCE_MS)
+				goto bad;
+			*coalesce_ms = n;
+			break;
+		case Opt_policy:
+			arg = match_strdup(&args[0]);
+			if (!arg)
+				return -ENOMEM;
+			token = bkpfs_parse_policy(arg, policy);
+			kfree(arg);
+			if (token)
+				goto bad;
+			break;
+		default:
+			if (remount)
+				break;
+			goto bad;
+		}
+	}
+	return 0;
+bad:
+	printk(KERN_ERR "bkpfs: bad mount option '%s'\n", p);
+	return -EINVAL;
+}
+
+/*
+ * Open the backupdir= version store.  It has to be on the lower file
+ * system (versions are cloned or copied from lower files) but outside of
+ * the lower directory, where users would see it.
+ */
+static int bkpfs_open_store(struct super_block *sb, struct path *lower_path)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	int err;
+
+	err = kern_path(sbi->backup_dir_name, LOOKUP_FOLLOW | LOOKUP_DIRECTORY,
+			&sbi->backup_dir);
+	if (err) {
+		printk(KERN_ERR "bkpfs: error accessing backup "
+		       "directory '%s'\n", sbi->backup_dir_name);
+		return err;
+	}
+	if (sbi->backup_dir.dentry->d_sb != lower_path->dentry->d_sb) {
+		printk(KERN_ERR "bkpfs: backup directory must be on "
+		       "the lower file system\n");
+		err = -EXDEV;
+	} else if (is_subdir(sbi->backup_dir.dentry, lower_path->dentry)) {
+		printk(KERN_ERR "bkpfs: backup directory must not be "
+		       "inside the lower directory\n");
+		err = -EINVAL;
+	}
+	if (err) {
+		path_put(&sbi->backup_dir);
+		sbi->backup_dir.dentry = NULL;
+		sbi->backup_dir.mnt = NULL;
+	}
+	return err;
+}
 
 /*
  * There is no need to lock the bkpfs_super_info's rwsem as there is no
@@ -21,7 +178,8 @@ static int bkpfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	int err = 0;
 	struct super_block *lower_sb;
 	struct path lower_path;
-	char *dev_name = (char *) raw_data;
+	struct bkpfs_mount_data *data = raw_data;
+	const char *dev_name = data->dev_name;
 	struct inode *inode;
 	
 	if (!dev_name) {
@@ -48,11 +206,65 @@ static int bkpfs_read_super(struct super_block *sb, void *raw_data, int silent)
 		goto out_free;
 	}
 
+	BKPFS_SB(sb)->max_versions = BKPFS_DEFAULT_MAX_VERSIONS;
+	BKPFS_SB(sb)->policy.kind = BKPFS_POLICY_CLOSE;
+	err = bkpfs_parse_options(data->options,
+				  &BKPFS_SB(sb)->max_versions,
+				  &BKPFS_SB(sb)->max_bytes,
+				  &BKPFS_SB(sb)->backup_dir_name,
+				  &BKPFS_SB(sb)->dedup,
+				  &BKPFS_SB(sb)->compress,
+				  &BKPFS_SB(sb)->coalesce_ms,
+				  &BKPFS_SB(sb)->policy, false);
+	if (!err)
+		err = bkpfs_check_max_versions(&lower_path,
+					       BKPFS_SB(sb)->max_versions);
+	if (!err && BKPFS_SB(sb)->backup_dir_name)
+		err = bkpfs_open_store(sb, &lower_path);
+	/* chunks are shared by all files, so they live in the store */
+	if (!err && BKPFS_SB(sb)->dedup && !BKPFS_SB(sb)->backup_dir.dentry) {
+		printk(KERN_ERR "bkpfs: dedup needs backupdir\n");
+		err = -EINVAL;
+	}
+	if (!err && BKPFS_SB(sb)->backup_dir.dentry)
+		err = bkpfs_dedup_mount(sb);
+	/* chunks are compared by content, so they aren't compressed */
+	if (!err && BKPFS_SB(sb)->dedup && BKPFS_SB(sb)->compress) {
+		printk(KERN_ERR "bkpfs: dedup and compress don't mix\n");
+		err = -EINVAL;
+	}
+	if (!err)
+		err = bkpfs_compress_mount(sb);
+	/* the version store is accessed with the mounter's credentials */
+	if (!err) {
+		BKPFS_SB(sb)->creator_cred = prepare_creds();
+		if (!BKPFS_SB(sb)->creator_cred)
+			err = -ENOMEM;
+	}
+	if (err) {
+		bkpfs_compress_unmount(sb);
+		bkpfs_dedup_unmount(sb);
+		if (BKPFS_SB(sb)->backup_dir.dentry)
+			path_put(&BKPFS_SB(sb)->backup_dir);
+		kfree(BKPFS_SB(sb)->backup_dir_name);
+		kfree(BKPFS_SB(sb));
+		sb->s_fs_info = NULL;
+		goto out_free;
+	}
+
 	/* set the lower superblock field of upper superblock */
 	lower_sb = lower_path.dentry->d_sb;
 	atomic_inc(&lower_sb->s_active);
 	bkpfs_set_lower_super(sb, lower_sb);
 
+	/* backups are taken asynchronously by a per-sb workqueue */
+	err = bkpfs_init_backup_queue(sb);
+	if (err)
+		goto out_sput;
+
+	/* clone instead of copying backups if the lower fs can do it */
+	bkpfs_probe_reflink(sb, &lower_path);
+
 	/* inherit maxbytes from lower file system */
 	sb->s_maxbytes = lower_sb->s_maxbytes;
 
@@ -110,7 +322,15 @@ out_iput:
 	iput(inode);
 out_sput:
 	/* drop refs we took earlier */
+	bkpfs_destroy_backup_queue(sb);
 	atomic_dec(&lower_sb->s_active);
+	bkpfs_compress_unmount(sb);
+	bkpfs_dedup_unmount(sb);
+	if (BKPFS_SB(sb)->backup_dir.dentry)
+		path_put(&BKPFS_SB(sb)->backup_dir);
+	kfree(BKPFS_SB(sb)->backup_dir_name);
+	if (BKPFS_SB(sb)->creator_cred)
+		put_cred(BKPFS_SB(sb)->creator_cred);
 	kfree(BKPFS_SB(sb));
 	sb->s_fs_info = NULL;
 out_free:
@@ -123,10 +343,12 @@ out:
 struct dentry *bkpfs_mount(struct file_system_type *fs_type, int flags,
 			    const char *dev_name, void *raw_data)
 {
-	void *lower_path_name = (void *) dev_name;
+	struct bkpfs_mount_data data = {
+		.dev_name = dev_name,
+		.options = raw_data,
+	};
 
-	return mount_nodev(fs_type, flags, lower_path_name,
-			   bkpfs_read_super);
+	return mount_nodev(fs_type, flags, &data, bkpfs_read_super);
 }
 
 static struct file_system_type bkpfs_fs_type = {
@@ -144,6 +366,7 @@ static int __init init_bkpfs_fs(void)
 
 	pr_info("Registering bkpfs " BKPFS_VERSION "\n");
 
+	bkpfs_init_dedup();
 	err = bkpfs_init_inode_cache();
 	if (err)
 		goto out;
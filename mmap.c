@@ -54,8 +54,11 @@ static int bkpfs_page_mkwrite(struct vm_fault *vmf)
 	file = lower_vma.vm_file;
 	lower_vm_ops = BKPFS_F(file)->lower_vm_ops;
 	BUG_ON(!lower_vm_ops);
+	err = bkpfs_policy_pre_fault(file, page_offset(vmf->page), PAGE_SIZE);
+	if (err)
+		return vmf_error(err);
 	if (!lower_vm_ops->page_mkwrite)
-		goto out;
+		goto out_dirty;
 
 	lower_file = bkpfs_lower_file(file);
 	/*
@@ -73,6 +76,12 @@ static int bkpfs_page_mkwrite(struct vm_fault *vmf)
 	vmf->vma = &lower_vma; /* override vma temporarily */
 	err = lower_vm_ops->page_mkwrite(vmf);
 	vmf->vma = vma; /* restore vma */
+	if (err & VM_FAULT_ERROR)
+		goto out;
+out_dirty:
+	/* the page is about to be written through a shared mapping */
+	bkpfs_mark_range(file_inode(file), page_offset(vmf->page), PAGE_SIZE);
+	bkpfs_policy_written(file, PAGE_SIZE);
 out:
 	return err;
 }
@@ -82,7 +91,9 @@ static ssize_t bkpfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
 	/*
 	 * This function should never be called directly.  We need it
 	 * to exist, to get past a check in open_check_o_direct(),
-	 * which is called from do_last().
+	 * which is called from do_last().  Direct I/O itself is done by
+	 * the lower file: bkpfs_read_iter and bkpfs_write_iter pass
+	 * IOCB_DIRECT iocbs down to it (see bkpfs_dio_check).
 	 */
 	return -EINVAL;
 }
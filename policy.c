@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+
+/*
+ * A backup policy decides when a modified file gets a new version:
+ *	close		at the close after any write (the default)
+ *	writes:N	after every N write calls
+ *	bytes:B		after every B bytes written
+ *	interval:S	at a close, but at most once every S seconds
+ *	open		before the first write or writable shared mmap
+ *			after each open, so the version holds the file as
+ *			it was opened
+ *	cow		like open, but the version starts empty and is
+ *			given the old contents of each range as it is
+ *			overwritten, see cow.c
+ * A mount has the policy given by policy=, and a file can have its own
+ * in its BKPFS_POLICY_XATTR.  The counters behind writes: and bytes:
+ * live in the bkpfs inode, so they start over when it is evicted.
+ */
+
+static const char *const bkpfs_policy_names[BKPFS_POLICY_NR] = {
+	[BKPFS_POLICY_CLOSE]	= "close",
+	[BKPFS_POLICY_WRITES]	= "writes",
+	[BKPFS_POLICY_BYTES]	= "bytes",
+	[BKPFS_POLICY_INTERVAL]	= "interval",
+	[BKPFS_POLICY_OPEN]	= "open",
+	[BKPFS_POLICY_COW]	= "cow",
+};
+
+/**
+ * bkpfs_parse_policy - parse "KIND" or "KIND:N"
+ * @str: the policy, NUL-terminated
+ * @p: filled with the policy
+ *
+ * N takes K, M and G suffixes.  Returns -EINVAL if @str isn't a policy.
+ */
+int bkpfs_parse_policy(const char *str, struct bkpfs_policy *p)
+{
+	const char *arg = strchr(str, ':');
+	size_t len = arg ? arg - str : strlen(str);
+	unsigned long long n = 0;
+	char *end;
+	int kind;
+
+	for (kind = BKPFS_POLICY_CLOSE; kind < BKPFS_POLICY_NR; kind++)
+		if (strlen(bkpfs_policy_names[kind]) == len &&
+		    !strncmp(str, bkpfs_policy_names[kind], len))
+			break;
+	if (kind == BKPFS_POLICY_NR)
+		return -EINVAL;
+	/* close, open and cow take no argument, the others need one */
+	if (!arg != (kind == BKPFS_POLICY_CLOSE || kind == BKPFS_POLICY_OPEN ||
+		     kind == BKPFS_POLICY_COW))
+		return -EINVAL;
+	if (arg) {
+		n = memparse(arg + 1, &end);
+		if (end == arg + 1 || *end || !n || n > LLONG_MAX)
+			return -EINVAL;
+		if ((kind == BKPFS_POLICY_WRITES && n > INT_MAX) ||
+		    (kind == BKPFS_POLICY_INTERVAL &&
+		     n > MAX_JIFFY_OFFSET / HZ))
+			return -EINVAL;
+	}
+	p->kind = kind;
+	p->arg = n;
+	return 0;
+}
+
+/* write @p the way bkpfs_parse_policy takes it */
+int bkpfs_format_policy(const struct bkpfs_policy *p, char *buf, size_t size)
+{
+	if (p->kind == BKPFS_POLICY_CLOSE || p->kind == BKPFS_POLICY_OPEN ||
+	    p->kind == BKPFS_POLICY_COW)
+		return snprintf(buf, size, "%s", bkpfs_policy_names[p->kind]);
+	return snprintf(buf, size, "%s:%llu", bkpfs_policy_names[p->kind],
+			p->arg);
+}
+
+/* the policy a file's own xattr gives it, if any */
+static void bkpfs_load_policy(struct inode *inode,
+			      struct dentry *lower_dentry)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_policy p = { .kind = BKPFS_POLICY_MOUNT };
+	char buf[BKPFS_POLICY_MAX + 1];
+	ssize_t ret;
+
+	/* internal to bkpfs: a writer may not be allowed to read it */
+	ret = __vfs_getxattr(lower_dentry, d_inode(lower_dentry),
+			     BKPFS_POLICY_XATTR, buf, BKPFS_POLICY_MAX);
+	if (ret > 0) {
+		buf[ret] = '\0';
+		if (bkpfs_parse_policy(buf, &p))
+			p.kind = BKPFS_POLICY_MOUNT;
+	}
+
+	spin_lock(&info->extent_lock);
+	info->policy = p;
+	set_bit(BKPFS_I_POLICY_VALID, &info->state);
+	spin_unlock(&info->extent_lock);
+}
+
+/* the policy of @file: its own, or else the mount's */
+static void bkpfs_get_policy(struct file *file, struct bkpfs_policy *p)
+{
+	struct inode *inode = file_inode(file);
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+
+	if (!test_bit(BKPFS_I_POLICY_VALID, &info->state))
+		bkpfs_load_policy(inode, bkpfs_lower_file(file)->f_path.dentry);
+
+	spin_lock(&info->extent_lock);
+	*p = info->policy;
+	spin_unlock(&info->extent_lock);
+	if (p->kind == BKPFS_POLICY_MOUNT) {
+		p->kind = READ_ONCE(sbi->policy.kind);
+		p->arg = READ_ONCE(sbi->policy.arg);
+	}
+}
+
+/* the policy xattr of @inode was set or removed */
+void bkpfs_policy_changed(struct inode *inode)
+{
+	clear_bit(BKPFS_I_POLICY_VALID, &BKPFS_I(inode)->state);
+}
+
+/**
+ * bkpfs_take_version - queue a version of a file if it was modified
+ * @file: an upper file open for writing
+ *
+ * Starts the policy counters over.  A file that was deleted or replaced
+ * needs no more versions.
+ */
+int bkpfs_take_version(struct file *file)
+{
+	struct inode *inode = file_inode(file);
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	int err;
+
+	if (d_unlinked(bkpfs_lower_file(file)->f_path.dentry) ||
+	    !bkpfs_test_clear_dirty(inode))
+		return 0;
+
+	atomic_set(&info->policy_writes, 0);
+	atomic64_set(&info->policy_bytes, 0);
+	WRITE_ONCE(info->last_version, jiffies);
+
+	err = bkpfs_queue_backup(file);
+	if (err) {
+		printk(KERN_ERR "bkpfs: cannot queue backup of inode %lu: %d\n",
+		       inode->i_ino, err);
+		bkpfs_mark_dirty(inode);
+	}
+	return err;
+}
+
+/*
+ * The first modification after an open: under the open policy, take a
+ * version of the file as it is and wait for it to be written; under the
+ * cow policy, start a copy-on-write version.
+ */
+static int bkpfs_policy_first_write(struct file *file)
+{
+	struct bkpfs_file_info *fi = BKPFS_F(file);
+	struct bkpfs_policy p;
+	int err = 0;
+
+	if (test_and_set_bit(BKPFS_F_WRITTEN, &fi->state))
+		return 0;
+	bkpfs_get_policy(file, &p);
+	if (p.kind == BKPFS_POLICY_OPEN) {
+		/*
+		 * Clean since a version this inode took, the file is that
+		 * version.  Otherwise, as after a mount or an eviction,
+		 * nothing tells what changed since the newest version: take
+		 * one anyway, and let the worker drop it if the file equals
+		 * that version.
+		 */
+		if (!READ_ONCE(BKPFS_I(file_inode(file))->last_version)) {
+			bkpfs_mark_all(file_inode(file));
+			bkpfs_mark_dirty(file_inode(file));
+		}
+		if (!bkpfs_take_version(file))
+			bkpfs_wait_backups(file_inode(file));
+	}
+	if (p.kind == BKPFS_POLICY_COW) {
+		err = bkpfs_cow_start(file);
+		/* try again at the next write */
+		if (err)
+			clear_bit(BKPFS_F_WRITTEN, &fi->state);
+	}
+	return err;
+}
+
+/**
+ * bkpfs_policy_pre_write - @file is about to be modified
+ * @file: the upper file
+ * @pos: start of the range about to change
+ * @len: its length, 0 for up to the end of the file
+ *
+ * Under the open policy, the first modification after an open takes a
+ * version of the file as it is, and waits for it to be written.  Under
+ * the cow policy it starts a copy-on-write version instead, and the old
+ * contents of the range are saved into that.  Returns 0, or the error
+ * the modification has to fail with.
+ */
+int bkpfs_policy_pre_write(struct file *file, loff_t pos, loff_t len)
+{
+	int err;
+
+	err = bkpfs_policy_first_write(file);
+	if (err)
+		return err;
+	/* a version started under cow is fed even if the policy changed */
+	return bkpfs_cow_save(file_inode(file),
+			      &bkpfs_lower_file(file)->f_path, pos, len);
+}
+
+/**
+ * bkpfs_policy_mmap - @file is being mapped shared and writable
+ * @file: the upper file
+ *
+ * Stores through the mapping are only seen in page_mkwrite, which must
+ * not wait for a whole file to be copied.  So the version the first of
+ * them would take or start under the open and cow policies is taken or
+ * started here instead, once per open.  Faults then only save the old
+ * contents of their page (bkpfs_policy_pre_fault).
+ */
+int bkpfs_policy_mmap(struct file *file)
+{
+	return bkpfs_policy_first_write(file);
+}
+
+/**
+ * bkpfs_policy_pre_fault - a page of @file is about to be written
+ * @file: the upper file
+ * @pos: offset of the page
+ * @len: its size
+ *
+ * Like bkpfs_policy_pre_write, but never takes or starts a version: that
+ * was done when the mapping was made.  If the file's policy only became
+ * open or cow after that, stores through the mapping aren't versioned
+ * by it until the next open.  Saving the old contents costs a page,
+ * except for the one fault that finds a copy-on-write version holding
+ * too many ranges and completes it.
+ */
+int bkpfs_policy_pre_fault(struct file *file, loff_t pos, loff_t len)
+{
+	return bkpfs_cow_save(file_inode(file),
+			      &bkpfs_lower_file(file)->f_path, pos, len);
+}
+
+/**
+ * bkpfs_policy_written - count a write to @file
+ * @file: the upper file
+ * @bytes: bytes written
+ *
+ * Takes a version once the writes: or bytes: limit is reached.
+ */
+void bkpfs_policy_written(struct file *file, size_t bytes)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(file_inode(file));
+	struct bkpfs_policy p;
+
+	bkpfs_get_policy(file, &p);
+	if ((p.kind == BKPFS_POLICY_WRITES &&
+	     atomic_inc_return(&info->policy_writes) >= p.arg) ||
+	    (p.kind == BKPFS_POLICY_BYTES &&
+	     atomic64_add_return(bytes, &info->policy_bytes) >= p.arg))
+		bkpfs_take_version(file);
+}
+
+/**
+ * bkpfs_policy_release - does closing @file take a version?
+ * @file: the upper file, open for writing
+ */
+bool bkpfs_policy_release(struct file *file)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(file_inode(file));
+	unsigned long last = READ_ONCE(info->last_version);
+	struct bkpfs_policy p;
+
+	bkpfs_get_policy(file, &p);
+	switch (p.kind) {
+	case BKPFS_POLICY_CLOSE:
+		return true;
+	case BKPFS_POLICY_INTERVAL:
+		/* the change is picked up by a later close */
+		return !last || time_after_eq(jiffies,
+					      last + p.arg * HZ);
+	default:
+		return false;
+	}
+}
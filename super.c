@@ -27,11 +27,22 @@ static void bkpfs_put_super(struct super_block *sb)
 	if (!spd)
 		return;
 
+	/* let pending backups finish before the lower sb goes away */
+	bkpfs_destroy_backup_queue(sb);
+
 	/* decrement lower super references */
 	s = bkpfs_lower_super(sb);
 	bkpfs_set_lower_super(sb, NULL);
 	atomic_dec(&s->s_active);
 
+	bkpfs_compress_unmount(sb);
+	bkpfs_dedup_unmount(sb);
+	if (spd->backup_dir.dentry)
+		path_put(&spd->backup_dir);
+	kfree(spd->backup_dir_name);
+	if (spd->creator_cred)
+		put_cred(spd->creator_cred);
+
 	kfree(spd);
 	sb->s_fs_info = NULL;
 }
@@ -51,12 +62,37 @@ static int bkpfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	return err;
 }
 
+/*
+ * Backups queued by ->release are part of the data we promised to
+ * persist, so sync(2), syncfs(2) and umount wait for them.
+ */
+static int bkpfs_sync_fs(struct super_block *sb, int wait)
+{
+	if (wait)
+		bkpfs_flush_backups(sb);
+	return 0;
+}
+
 /*
  * @flags: numeric mount options
  * @options: mount options string
+ *
+ * maxver=, maxbytes=, compress=, coalesce_ms= and policy= can be changed
+ * here; they apply from the next version taken of each file.  The version
+ * store can't be moved and dedup can't be turned on or off, but giving
+ * them again as they are is fine, as are options bkpfs doesn't know.
  */
 static int bkpfs_remount_fs(struct super_block *sb, int *flags, char *options)
 {
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	unsigned int max_versions = sbi->max_versions;
+	loff_t max_bytes = sbi->max_bytes;
+	char *backup_dir = NULL;
+	bool dedup = sbi->dedup;
+	int compress = sbi->compress;
+	unsigned int coalesce_ms = sbi->coalesce_ms;
+	struct bkpfs_policy policy = sbi->policy;
+	struct path lower_root;
 	int err = 0;
 
 	/*
@@ -68,11 +104,105 @@ static int bkpfs_remount_fs(struct super_block *sb, int *flags, char *options)
 		printk(KERN_ERR
 		       "bkpfs: remount flags 0x%x unsupported\n", *flags);
 		err = -EINVAL;
+		goto out;
 	}
 
+	err = bkpfs_parse_options(options, &max_versions, &max_bytes,
+				  &backup_dir, &dedup, &compress,
+				  &coalesce_ms, &policy, true);
+	if (err)
+		goto out;
+	if (dedup != sbi->dedup) {
+		printk(KERN_ERR "bkpfs: dedup can't be changed on remount\n");
+		err = -EINVAL;
+		goto out;
+	}
+	if (backup_dir && (!sbi->backup_dir_name ||
+			   strcmp(backup_dir, sbi->backup_dir_name))) {
+		printk(KERN_ERR "bkpfs: backupdir can't be changed "
+		       "on remount\n");
+		err = -EINVAL;
+		goto out;
+	}
+	if (dedup && compress) {
+		printk(KERN_ERR "bkpfs: dedup and compress don't mix\n");
+		err = -EINVAL;
+		goto out;
+	}
+	err = bkpfs_compress_check(sb, compress);
+	if (err)
+		goto out;
+	if (max_versions > sbi->max_versions) {
+		bkpfs_get_lower_path(sb->s_root, &lower_root);
+		err = bkpfs_check_max_versions(&lower_root, max_versions);
+		bkpfs_put_lower_path(sb->s_root, &lower_root);
+		if (err)
+			goto out;
+	}
+	WRITE_ONCE(sbi->max_versions, max_versions);
+	WRITE_ONCE(sbi->max_bytes, max_bytes);
+	WRITE_ONCE(sbi->compress, compress);
+	WRITE_ONCE(sbi->coalesce_ms, coalesce_ms);
+	/* a write racing with this may see a mix of old and new policy */
+	WRITE_ONCE(sbi->policy.kind, policy.kind);
+	WRITE_ONCE(sbi->policy.arg, policy.arg);
+out:
+	kfree(backup_dir);
 	return err;
 }
 
+static int bkpfs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct bkpfs_sb_info *sbi = BKPFS_SB(root->d_sb);
+	struct bkpfs_policy policy;
+	char buf[BKPFS_POLICY_MAX + 1];
+
+	seq_printf(m, ",maxver=%u", READ_ONCE(sbi->max_versions));
+	if (READ_ONCE(sbi->max_bytes))
+		seq_printf(m, ",maxbytes=%lld", READ_ONCE(sbi->max_bytes));
+	if (sbi->backup_dir_name)
+		seq_show_option(m, "backupdir", sbi->backup_dir_name);
+	policy.kind = READ_ONCE(sbi->policy.kind);
+	policy.arg = READ_ONCE(sbi->policy.arg);
+	if (policy.kind != BKPFS_POLICY_CLOSE) {
+		bkpfs_format_policy(&policy, buf, sizeof(buf));
+		seq_printf(m, ",policy=%s", buf);
+	}
+	if (READ_ONCE(sbi->coalesce_ms))
+		seq_printf(m, ",coalesce_ms=%u", READ_ONCE(sbi->coalesce_ms));
+	if (sbi->dedup)
+		seq_puts(m, ",dedup");
+	if (READ_ONCE(sbi->compress))
+		seq_printf(m, ",compress=%s",
+			   bkpfs_comp_names[READ_ONCE(sbi->compress)]);
+	return 0;
+}
+
+/*
+ * Write back version counters that weren't written at release or by the
+ * backup worker.  By now the upper dentries are gone, so use any dentry
+ * still attached to the lower inode.
+ */
+static void bkpfs_evict_meta(struct inode *inode)
+{
+	struct dentry *lower_dentry;
+	int err;
+
+	if (!test_bit(BKPFS_I_META_DIRTY, &BKPFS_I(inode)->state))
+		return;
+	lower_dentry = d_find_alias(bkpfs_lower_inode(inode));
+	if (!lower_dentry) {
+		printk(KERN_ERR "bkpfs: lost version metadata of inode %lu\n",
+		       inode->i_ino);
+		return;
+	}
+	err = bkpfs_sync_meta(inode, lower_dentry);
+	if (err)
+		printk(KERN_ERR "bkpfs: cannot write version metadata "
+		       "of inode %lu: %d\n", inode->i_ino, err);
+	dput(lower_dentry);
+}
+
 /*
  * Called by iput() when the inode reference count reached zero
  * and the inode is not hashed anywhere.  Used to clear anything
@@ -83,8 +213,12 @@ static void bkpfs_evict_inode(struct inode *inode)
 {
 	struct inode *lower_inode;
 
+	bkpfs_evict_meta(inode);
 	truncate_inode_pages(&inode->i_data, 0);
 	clear_inode(inode);
+	bkpfs_extent_map_clear(&BKPFS_I(inode)->extents);
+	bkpfs_extent_map_clear(&BKPFS_I(inode)->cow_saved);
+	bkpfs_vindex_free(&BKPFS_I(inode)->vindex);
 	/*
 	 * Decrement a reference to a lower_inode, which was incremented
 	 * by our read_inode when it was created initially.
@@ -104,6 +238,10 @@ static struct inode *bkpfs_alloc_inode(struct super_block *sb)
 
 	/* memset everything up to the inode to 0 */
 	memset(i, 0, offsetof(struct bkpfs_inode_info, vfs_inode));
+	mutex_init(&i->backup_mutex);
+	spin_lock_init(&i->extent_lock);
+	bkpfs_extent_map_init(&i->extents);
+	bkpfs_extent_map_init(&i->cow_saved);
 
         atomic64_set(&i->vfs_inode.i_version, 1);
 	return &i->vfs_inode;
@@ -158,7 +296,9 @@ static void bkpfs_umount_begin(struct super_block *sb)
 const struct super_operations bkpfs_sops = {
 	.put_super	= bkpfs_put_super,
 	.statfs		= bkpfs_statfs,
+	.sync_fs	= bkpfs_sync_fs,
 	.remount_fs	= bkpfs_remount_fs,
+	.show_options	= bkpfs_show_options,
 	.evict_inode	= bkpfs_evict_inode,
 	.umount_begin	= bkpfs_umount_begin,
 	.alloc_inode	= bkpfs_alloc_inode,
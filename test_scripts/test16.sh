@@ -0,0 +1,39 @@
+#!/bin/bash
+# Shell script to test if a version taken after deleting the newest is complete
+# ********************************************************************
+
+echo "**************************************************************"
+echo "Shell script to test if a version after delete newest is whole"
+echo "=============================================================="
+
+# *************************************************************************************************
+
+echo "Testing: write, delete the newest version (a delta), write again!"
+echo "------------------------------------------------------------------"
+dd if=/dev/urandom of=sample.txt bs=4096 count=16 2> /dev/null
+sleep 1
+echo "first change" | dd of=sample.txt bs=1 seek=0 conv=notrunc 2> /dev/null
+sleep 1
+./bkpctl -d N -f sample.txt
+echo "second change" | dd of=sample.txt bs=1 seek=8192 conv=notrunc 2> /dev/null
+cp sample.txt /tmp/bkpfs_v2
+sleep 1
+
+# backups are taken in the background: the sleeps let them finish
+if ./bkpctl -v N -f sample.txt | grep --quiet "Backup View: Success"; then
+	echo "Test 01: ------------------------------------------------------------> Passed"
+else
+	echo "Test 01: ------------------------------------------------------------> Failed"
+fi
+
+echo "sample" > sample.txt
+sleep 1
+
+if ./bkpctl -r 2 -f sample.txt | grep --quiet "Restore Backup: Success" && cmp --quiet sample.txt /tmp/bkpfs_v2; then
+	echo "Test 02: ------------------------------------------------------------> Passed"
+else
+	echo "Test 02: ------------------------------------------------------------> Failed"
+fi
+
+./bkpctl -d A -f sample.txt
+rm -rf sample.txt /tmp/bkpfs_v2
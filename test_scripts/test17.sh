@@ -0,0 +1,68 @@
+#!/bin/bash
+# Shell script to test if maxver= and maxbytes= of BKPFS work properly
+# ********************************************************************
+
+echo "**************************************************************"
+echo "Shell script to test if maxver= and maxbytes= work properly!!"
+echo "=============================================================="
+
+# *************************************************************************************************
+
+echo "Testing: only maxver versions are kept!"
+echo "---------------------------------------"
+mount -o remount,maxver=2 /mnt/ko2
+echo "sample 1" > sample.txt
+echo "sample 2" > sample.txt
+echo "sample 3" > sample.txt
+echo "sample 4" > sample.txt
+sleep 1
+
+if ./bkpctl -v 2 -f sample.txt | grep --quiet "Backup View: Failure" && ./bkpctl -v 3 -f sample.txt | grep --quiet "Backup View: Success"; then
+	echo "Test 01: ------------------------------------------------------------> Passed"
+else
+	echo "Test 01: ------------------------------------------------------------> Failed"
+fi
+
+./bkpctl -d A -f sample.txt
+rm -rf sample.txt
+
+# **************************************************************************************************
+
+echo "Testing: the newest version is kept even if larger than maxbytes!"
+echo "-----------------------------------------------------------------"
+mount -o remount,maxver=16,maxbytes=8K /mnt/ko2
+dd if=/dev/urandom of=sample.txt bs=4096 count=4 2> /dev/null
+sleep 1
+dd if=/dev/urandom of=sample.txt bs=4096 count=4 2> /dev/null
+sleep 1
+
+if ./bkpctl -v 1 -f sample.txt | grep --quiet "Backup View: Failure" && ./bkpctl -v 2 -f sample.txt | grep --quiet "Backup View: Success"; then
+	echo "Test 02: ------------------------------------------------------------> Passed"
+else
+	echo "Test 02: ------------------------------------------------------------> Failed"
+fi
+
+./bkpctl -d A -f sample.txt
+rm -rf sample.txt
+
+# **************************************************************************************************
+
+echo "Testing: remount refuses a maxver that can't be indexed!"
+echo "--------------------------------------------------------"
+
+if mount -o remount,maxver=100000 /mnt/ko2 2> /dev/null; then
+	echo "Test 03: ------------------------------------------------------------> Failed"
+else
+	echo "Test 03: ------------------------------------------------------------> Passed"
+fi
+
+# **************************************************************************************************
+
+echo "Testing: remount ignores options bkpfs doesn't know!"
+echo "----------------------------------------------------"
+
+if mount -o remount,maxver=4,maxbytes=1G,nosuchoption=1 /mnt/ko2; then
+	echo "Test 04: ------------------------------------------------------------> Passed"
+else
+	echo "Test 04: ------------------------------------------------------------> Failed"
+fi
@@ -0,0 +1,61 @@
+#!/bin/bash
+# Shell script to test if the .versions directory of BKPFS works properly
+# ********************************************************************
+
+echo "**************************************************************"
+echo "Shell script to test if .versions of BKPFS works properly!!!!"
+echo "=============================================================="
+
+# *************************************************************************************************
+
+echo "Testing: .versions is not listed!"
+echo "---------------------------------"
+
+if ls -a | grep --quiet "^.versions$"; then
+	echo "Test 01: ------------------------------------------------------------> Failed"
+else
+	echo "Test 01: ------------------------------------------------------------> Passed"
+fi
+
+# **************************************************************************************************
+
+echo "Testing: .versions/FILE lists and reads the versions!"
+echo "-----------------------------------------------------"
+echo "sample 1" > sample.txt
+echo "sample 2" > sample.txt
+sleep 1
+
+if [ "$(ls .versions/sample.txt)" = "$(printf '1\n2')" ] && grep --quiet "sample 1" .versions/sample.txt/1; then
+	echo "Test 02: ------------------------------------------------------------> Passed"
+else
+	echo "Test 02: ------------------------------------------------------------> Failed"
+fi
+
+# **************************************************************************************************
+
+echo "Testing: a version can't be written!"
+echo "------------------------------------"
+
+if (echo "sample 3" > .versions/sample.txt/1) 2> /dev/null; then
+	echo "Test 03: ------------------------------------------------------------> Failed"
+else
+	echo "Test 03: ------------------------------------------------------------> Passed"
+fi
+
+# **************************************************************************************************
+
+echo "Testing: a deleted version is gone, and its number shows the new one!"
+echo "---------------------------------------------------------------------"
+cat .versions/sample.txt/2 > /dev/null
+./bkpctl -d N -f sample.txt
+echo "sample 4" > sample.txt
+sleep 1
+
+if grep --quiet "sample 4" .versions/sample.txt/2; then
+	echo "Test 04: ------------------------------------------------------------> Passed"
+else
+	echo "Test 04: ------------------------------------------------------------> Failed"
+fi
+
+./bkpctl -d A -f sample.txt
+rm -rf sample.txt
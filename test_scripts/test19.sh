@@ -0,0 +1,63 @@
+#!/bin/bash
+# Shell script to test if the VIEW_VERSION_ITER ioctl of BKPFS works properly
+# ********************************************************************
+
+echo "**************************************************************"
+echo "Shell script to test if VIEW_VERSION_ITER works properly!!!!!"
+echo "=============================================================="
+
+# view_iter is built from view_iter.c, next to bkpfs_ioctl.h
+if [ ! -x ./view_iter ]; then
+	gcc -Wall -o view_iter view_iter.c || exit 1
+fi
+
+# *************************************************************************************************
+
+echo "Testing: view when the main file has no backups!"
+echo "------------------------------------------------"
+echo "sample" > sample.txt
+sleep 1
+./bkpctl -d A -f sample.txt
+
+if ./view_iter N sample.txt 2>&1 | grep --quiet "VIEW_VERSION_ITER"; then
+	echo "Test 01: ------------------------------------------------------------> Passed"
+else
+	echo "Test 01: ------------------------------------------------------------> Failed"
+fi
+
+./bkpctl -d A -f sample.txt
+rm -rf sample.txt
+
+# **************************************************************************************************
+
+echo "Testing: view newest, oldest and nth version in several calls!"
+echo "--------------------------------------------------------------"
+dd if=/dev/urandom of=sample.txt bs=1000 count=7 2> /dev/null
+cp sample.txt /tmp/bkpfs_v1
+sleep 1
+dd if=/dev/urandom of=sample.txt bs=1000 count=9 2> /dev/null
+cp sample.txt /tmp/bkpfs_v2
+sleep 1
+echo "sample" > sample.txt
+sleep 1
+
+if ./view_iter O sample.txt | cmp --quiet - /tmp/bkpfs_v1; then
+	echo "Test 02: ------------------------------------------------------------> Passed"
+else
+	echo "Test 02: ------------------------------------------------------------> Failed"
+fi
+
+if ./view_iter 2 sample.txt | cmp --quiet - /tmp/bkpfs_v2; then
+	echo "Test 03: ------------------------------------------------------------> Passed"
+else
+	echo "Test 03: ------------------------------------------------------------> Failed"
+fi
+
+if ./view_iter N sample.txt | cmp --quiet - sample.txt; then
+	echo "Test 04: ------------------------------------------------------------> Passed"
+else
+	echo "Test 04: ------------------------------------------------------------> Failed"
+fi
+
+./bkpctl -d A -f sample.txt
+rm -rf sample.txt /tmp/bkpfs_v1 /tmp/bkpfs_v2
@@ -0,0 +1,68 @@
+#!/bin/bash
+# Shell script to test if restores of BKPFS keep the file and its versions
+# ********************************************************************
+
+echo "**************************************************************"
+echo "Shell script to test if restores keep the file and versions!!"
+echo "=============================================================="
+
+# *************************************************************************************************
+
+echo "Testing: restore oldest, then nth, and keep all versions!"
+echo "------------------------------------------------------------"
+echo "sample 1" > sample.txt
+echo "sample 2, longer than the first" > sample.txt
+echo "sample 3" > sample.txt
+sleep 1
+
+if ./bkpctl -r O -f sample.txt | grep --quiet "Restore Backup: Success" && [ "$(cat sample.txt)" = "sample 1" ]; then
+	echo "Test 01: ------------------------------------------------------------> Passed"
+else
+	echo "Test 01: ------------------------------------------------------------> Failed"
+fi
+
+if ./bkpctl -r 2 -f sample.txt | grep --quiet "Restore Backup: Success" && [ "$(cat sample.txt)" = "sample 2, longer than the first" ]; then
+	echo "Test 02: ------------------------------------------------------------> Passed"
+else
+	echo "Test 02: ------------------------------------------------------------> Failed"
+fi
+
+if [ "$(ls .versions/sample.txt | wc -l)" -eq 3 ] && grep --quiet "sample 3" .versions/sample.txt/3; then
+	echo "Test 03: ------------------------------------------------------------> Passed"
+else
+	echo "Test 03: ------------------------------------------------------------> Failed"
+fi
+
+./bkpctl -d A -f sample.txt
+rm -rf sample.txt
+
+# **************************************************************************************************
+
+echo "Testing: restore a large file that differs in a few pages!"
+echo "----------------------------------------------------------"
+dd if=/dev/urandom of=sample.txt bs=4096 count=64 2> /dev/null
+cp sample.txt /tmp/bkpfs_v1
+sleep 1
+dd if=/dev/urandom of=sample.txt bs=4096 count=2 seek=10 conv=notrunc 2> /dev/null
+echo "tail" >> sample.txt
+sleep 1
+
+if ./bkpctl -r 1 -f sample.txt | grep --quiet "Restore Backup: Success" && cmp --quiet sample.txt /tmp/bkpfs_v1; then
+	echo "Test 04: ------------------------------------------------------------> Passed"
+else
+	echo "Test 04: ------------------------------------------------------------> Failed"
+fi
+
+# a restore is not a version: writing after it must still be saved whole
+echo "after" | dd of=sample.txt bs=1 seek=100 conv=notrunc 2> /dev/null
+sleep 1
+newest=$(ls .versions/sample.txt | sort -n | tail -1)
+
+if cmp --quiet sample.txt .versions/sample.txt/$newest; then
+	echo "Test 05: ------------------------------------------------------------> Passed"
+else
+	echo "Test 05: ------------------------------------------------------------> Failed"
+fi
+
+./bkpctl -d A -f sample.txt
+rm -rf sample.txt /tmp/bkpfs_v1
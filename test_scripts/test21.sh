@@ -0,0 +1,88 @@
+#!/bin/bash
+# Shell script to test if the backup policies of BKPFS work properly
+# ********************************************************************
+
+echo "**************************************************************"
+echo "Shell script to test if backup policies of BKPFS work properly"
+echo "=============================================================="
+
+# *************************************************************************************************
+
+echo "Testing: a policy that can't be parsed is refused!"
+echo "--------------------------------------------------"
+echo "sample" > sample.txt
+
+if setfattr -n user.bkpfs.policy -v "writes:x" sample.txt 2> /dev/null; then
+	echo "Test 01: ------------------------------------------------------------> Failed"
+else
+	echo "Test 01: ------------------------------------------------------------> Passed"
+fi
+
+sleep 1
+./bkpctl -d A -f sample.txt
+rm -rf sample.txt
+
+# **************************************************************************************************
+
+echo "Testing: writes:2 takes a version every second write, not at close!"
+echo "-------------------------------------------------------------------"
+touch sample.txt
+setfattr -n user.bkpfs.policy -v "writes:2" sample.txt
+exec 3> sample.txt
+echo "sample 1" >&3
+echo "sample 2" >&3
+echo "sample 3" >&3
+echo "sample 4" >&3
+echo "sample 5" >&3
+exec 3>&-
+sleep 1
+
+if ./bkpctl -v 2 -f sample.txt | grep --quiet "Backup View: Success" && ./bkpctl -v 3 -f sample.txt | grep --quiet "Backup View: Failure"; then
+	echo "Test 02: ------------------------------------------------------------> Passed"
+else
+	echo "Test 02: ------------------------------------------------------------> Failed"
+fi
+
+./bkpctl -d A -f sample.txt
+rm -rf sample.txt
+
+# **************************************************************************************************
+
+echo "Testing: open saves the file as it was opened!"
+echo "----------------------------------------------"
+echo "sample 1" > sample.txt
+sleep 1
+./bkpctl -d A -f sample.txt
+setfattr -n user.bkpfs.policy -v "open" sample.txt
+echo "sample 2" >> sample.txt
+sleep 1
+
+if ./bkpctl -v 2 -f sample.txt | grep --quiet "Backup View: Failure" && ./bkpctl -r 1 -f sample.txt | grep --quiet "Restore Backup: Success" && [ "$(cat sample.txt)" = "sample 1" ]; then
+	echo "Test 03: ------------------------------------------------------------> Passed"
+else
+	echo "Test 03: ------------------------------------------------------------> Failed"
+fi
+
+./bkpctl -d A -f sample.txt
+rm -rf sample.txt
+
+# **************************************************************************************************
+
+echo "Testing: cow saves the file as it was opened!"
+echo "---------------------------------------------"
+dd if=/dev/urandom of=sample.txt bs=4096 count=16 2> /dev/null
+cp sample.txt /tmp/bkpfs_v1
+sleep 1
+./bkpctl -d A -f sample.txt
+setfattr -n user.bkpfs.policy -v "cow" sample.txt
+dd if=/dev/urandom of=sample.txt bs=4096 count=2 seek=4 conv=notrunc 2> /dev/null
+sleep 1
+
+if ./bkpctl -r 1 -f sample.txt | grep --quiet "Restore Backup: Success" && cmp --quiet sample.txt /tmp/bkpfs_v1; then
+	echo "Test 04: ------------------------------------------------------------> Passed"
+else
+	echo "Test 04: ------------------------------------------------------------> Failed"
+fi
+
+./bkpctl -d A -f sample.txt
+rm -rf sample.txt /tmp/bkpfs_v1
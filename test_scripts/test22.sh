@@ -0,0 +1,71 @@
+#!/bin/bash
+# Shell script to test if dedup and compressed versions of BKPFS read back
+# ********************************************************************
+
+echo "**************************************************************"
+echo "Shell script to test if dedup and compress= versions read back"
+echo "=============================================================="
+
+# *************************************************************************************************
+
+echo "Testing: dedup versions of two files sharing all chunks read back!"
+echo "-------------------------------------------------------------------"
+cd /
+umount /mnt/ko2
+mkdir -p /test/bkpfs_store
+mount -t bkpfs -o backupdir=/test/bkpfs_store,dedup /test/ko2/ /mnt/ko2
+cd /mnt/ko2
+
+dd if=/dev/urandom of=/tmp/bkpfs_v1 bs=4096 count=64 2> /dev/null
+cp /tmp/bkpfs_v1 sample.txt
+cp /tmp/bkpfs_v1 sample2.txt
+sleep 1
+echo "sample" > sample.txt
+echo "sample" > sample2.txt
+sleep 1
+
+if cmp --quiet /tmp/bkpfs_v1 .versions/sample.txt/1; then
+	echo "Test 01: ------------------------------------------------------------> Passed"
+else
+	echo "Test 01: ------------------------------------------------------------> Failed"
+fi
+
+if cmp --quiet /tmp/bkpfs_v1 .versions/sample2.txt/1 && cmp --quiet .versions/sample.txt/2 sample.txt; then
+	echo "Test 02: ------------------------------------------------------------> Passed"
+else
+	echo "Test 02: ------------------------------------------------------------> Failed"
+fi
+
+# versions in a store outlive their file: drop the whole store
+rm -rf sample.txt sample2.txt /tmp/bkpfs_v1
+cd /
+umount /mnt/ko2
+rm -rf /test/bkpfs_store
+mount -t bkpfs /test/ko2/ /mnt/ko2
+cd /mnt/ko2
+
+# **************************************************************************************************
+
+echo "Testing: lz4 and zstd versions read and restore as written!"
+echo "-----------------------------------------------------------"
+for alg in lz4 zstd; do
+	mount -o remount,compress=$alg /mnt/ko2
+	# compressible text, a hole and random data, over several 64K blocks
+	seq 1 20000 > /tmp/bkpfs_v1
+	dd if=/dev/urandom of=/tmp/bkpfs_v1 bs=4096 count=8 seek=64 2> /dev/null
+	cp /tmp/bkpfs_v1 sample.txt
+	sleep 1
+	echo "sample" > sample.txt
+	sleep 1
+
+	if cmp --quiet /tmp/bkpfs_v1 .versions/sample.txt/1 && ./bkpctl -r 1 -f sample.txt | grep --quiet "Restore Backup: Success" && cmp --quiet /tmp/bkpfs_v1 sample.txt; then
+		echo "Test 03 ($alg): ------------------------------------------------------> Passed"
+	else
+		echo "Test 03 ($alg): ------------------------------------------------------> Failed"
+	fi
+
+	./bkpctl -d A -f sample.txt
+	rm -rf sample.txt /tmp/bkpfs_v1
+done
+mount -o remount,compress=none /mnt/ko2
+
@@ -0,0 +1,59 @@
+#!/bin/bash
+# Shell script to test if BKPFS skips versions whose content did not change
+# ********************************************************************
+
+echo "**************************************************************"
+echo "Shell script to test if unchanged versions are skipped!!!!!!!"
+echo "=============================================================="
+
+# *************************************************************************************************
+
+echo "Testing: rewriting the same bytes takes no version!"
+echo "---------------------------------------------------"
+echo "sample" > sample.txt
+echo "sample" > sample.txt
+sleep 1
+
+if [ "$(ls .versions/sample.txt | wc -l)" -eq 1 ]; then
+	echo "Test 01: ------------------------------------------------------------> Passed"
+else
+	echo "Test 01: ------------------------------------------------------------> Failed"
+fi
+
+./bkpctl -d A -f sample.txt
+rm -rf sample.txt
+
+# **************************************************************************************************
+
+echo "Testing: rewriting the same page of a large file takes no version!"
+echo "------------------------------------------------------------------"
+dd if=/dev/urandom of=/tmp/bkpfs_v1 bs=4096 count=16 2> /dev/null
+cp /tmp/bkpfs_v1 sample.txt
+sleep 1
+dd if=/tmp/bkpfs_v1 of=sample.txt bs=4096 count=1 skip=3 seek=3 conv=notrunc 2> /dev/null
+sleep 1
+
+if [ "$(ls .versions/sample.txt | wc -l)" -eq 1 ]; then
+	echo "Test 02: ------------------------------------------------------------> Passed"
+else
+	echo "Test 02: ------------------------------------------------------------> Failed"
+fi
+
+# **************************************************************************************************
+
+echo "Testing: after deleting the newest version, the older one is compared!"
+echo "----------------------------------------------------------------------"
+echo "change" | dd of=sample.txt bs=1 seek=0 conv=notrunc 2> /dev/null
+sleep 1
+./bkpctl -d N -f sample.txt
+dd if=/tmp/bkpfs_v1 of=sample.txt bs=4096 count=1 skip=5 seek=5 conv=notrunc 2> /dev/null
+sleep 1
+
+if [ "$(ls .versions/sample.txt | wc -l)" -eq 2 ] && cmp --quiet sample.txt .versions/sample.txt/2; then
+	echo "Test 03: ------------------------------------------------------------> Passed"
+else
+	echo "Test 03: ------------------------------------------------------------> Failed"
+fi
+
+./bkpctl -d A -f sample.txt
+rm -rf sample.txt /tmp/bkpfs_v1
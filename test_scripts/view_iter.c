@@ -0,0 +1,63 @@
+/*
+ * view_iter: print a version of a bkpfs file with the VIEW_VERSION_ITER
+ * ioctl, reading it in small steps spread over three iovecs.
+ *
+ *	./view_iter VERSION FILE
+ *
+ * VERSION is a version number, N (newest) or O (oldest).
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include "bkpfs_ioctl.h"
+
+int main(int argc, char *argv[])
+{
+	char buf[3][1000];
+	struct iovec iov[3];
+	struct bkpfs_view_args args;
+	int fd, i;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s VERSION FILE\n", argv[0]);
+		return 2;
+	}
+	fd = open(argv[2], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	for (i = 0; i < 3; i++) {
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = sizeof(buf[i]);
+	}
+	memset(&args, 0, sizeof(args));
+	if (!strcmp(argv[1], "N"))
+		args.version = -1;
+	else if (!strcmp(argv[1], "O"))
+		args.version = -2;
+	else
+		args.version = atoi(argv[1]);
+	args.iov = (unsigned long) iov;
+	args.iovcnt = 3;
+	args.length = 2500;	/* ends in the middle of an iovec */
+
+	do {
+		if (ioctl(fd, VIEW_VERSION_ITER, &args) < 0) {
+			perror("VIEW_VERSION_ITER");
+			return 1;
+		}
+		for (i = 0; i < 3 && i * 1000 < args.nread; i++)
+			fwrite(buf[i], 1, args.nread - i * 1000 < 1000 ?
+			       args.nread - i * 1000 : 1000, stdout);
+		args.offset += args.nread;
+	} while (!(args.flags & BKPFS_VIEW_EOF) && args.nread);
+
+	close(fd);
+	return 0;
+}
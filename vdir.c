@@ -0,0 +1,410 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+
+/*
+ * Every directory has a hidden, virtual ".versions" directory (it is
+ * only found by lookup, not listed).  ".versions/NAME" is a directory
+ * listing the live versions of the file NAME, and ".versions/NAME/N" is
+ * version N itself.  A full version is a read-only bkpfs file stacked
+ * directly on the lower backup file, so read, mmap, sendfile and
+ * copy_file_range on it go through the page cache like on any other
+ * bkpfs file.  Any other version is a virtual file stacked on its backup
+ * file but read through bkpfs_read_version, which leaves the version
+ * store as it is.
+ *
+ * The virtual directories and files are bkpfs inodes that aren't hashed
+ * by lower inode; the lower inode and path of a directory are those of
+ * the real directory (".versions") or of the main file (".versions/NAME").
+ * They are immutable, which keeps the VFS from renaming, unlinking or
+ * changing them.
+ */
+
+static const struct inode_operations bkpfs_vroot_iops;
+static const struct inode_operations bkpfs_vfile_iops;
+static const struct file_operations bkpfs_vroot_fops;
+static const struct file_operations bkpfs_vfile_fops;
+static const struct inode_operations bkpfs_vver_iops;
+static const struct file_operations bkpfs_vver_fops;
+
+/*
+ * Versions come and go, so never trust a negative dentry, nor one whose
+ * backup file was deleted (its number may be reused by a newer version).
+ */
+static int bkpfs_vdir_d_revalidate(struct dentry *dentry, unsigned int flags)
+{
+	struct path lower_path;
+	int valid;
+
+	if (flags & LOOKUP_RCU)
+		return -ECHILD;
+	if (d_really_is_negative(dentry) || !BKPFS_D(dentry))
+		return 0;
+
+	bkpfs_get_lower_path(dentry, &lower_path);
+	valid = !d_unlinked(lower_path.dentry);
+	bkpfs_put_lower_path(dentry, &lower_path);
+	return valid;
+}
+
+static void bkpfs_vdir_d_release(struct dentry *dentry)
+{
+	if (!BKPFS_D(dentry))
+		return;
+	bkpfs_put_reset_lower_path(dentry);
+	free_dentry_private_data(dentry);
+}
+
+static const struct dentry_operations bkpfs_vdir_dops = {
+	.d_revalidate	= bkpfs_vdir_d_revalidate,
+	.d_release	= bkpfs_vdir_d_release,
+};
+
+static struct inode *bkpfs_vdir_inode(struct super_block *sb,
+				      struct inode *lower_inode, umode_t mode,
+				      const struct inode_operations *iops,
+				      const struct file_operations *fops)
+{
+	struct inode *inode;
+
+	if (!igrab(lower_inode))
+		return ERR_PTR(-ESTALE);
+	inode = new_inode(sb);
+	if (!inode) {
+		iput(lower_inode);
+		return ERR_PTR(-ENOMEM);
+	}
+	bkpfs_set_lower_inode(inode, lower_inode);
+	inode->i_ino = get_next_ino();
+	inode->i_mode = mode;
+	inode->i_uid = lower_inode->i_uid;
+	inode->i_gid = lower_inode->i_gid;
+	inode->i_flags |= S_IMMUTABLE;
+	inode->i_op = iops;
+	inode->i_fop = fops;
+	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+	set_nlink(inode, S_ISDIR(mode) ? 2 : 1);
+	return inode;
+}
+
+/* connect @dentry to a new virtual directory on top of @lower_path */
+static struct dentry *bkpfs_vdir_instantiate(struct dentry *dentry,
+					     struct path *lower_path,
+					     umode_t mode,
+					     const struct inode_operations *iops,
+					     const struct file_operations *fops)
+{
+	struct inode *inode;
+	int err;
+
+	err = new_dentry_private_data(dentry);
+	if (err) {
+		path_put(lower_path);
+		return ERR_PTR(err);
+	}
+	bkpfs_set_lower_path(dentry, lower_path);
+
+	inode = bkpfs_vdir_inode(dentry->d_sb, d_inode(lower_path->dentry),
+				 mode, iops, fops);
+	if (IS_ERR(inode))
+		return ERR_CAST(inode);
+	return d_splice_alias(inode, dentry);
+}
+
+/**
+ * bkpfs_versions_lookup - look up ".versions" in a bkpfs directory
+ * @dir: the directory
+ * @dentry: dentry of ".versions"
+ */
+struct dentry *bkpfs_versions_lookup(struct inode *dir, struct dentry *dentry)
+{
+	struct dentry *parent;
+	struct path lower_dir_path;
+
+	d_set_d_op(dentry, &bkpfs_vdir_dops);
+	parent = dget_parent(dentry);
+	bkpfs_get_lower_path(parent, &lower_dir_path);
+	dput(parent);
+
+	return bkpfs_vdir_instantiate(dentry, &lower_dir_path, S_IFDIR | 0555,
+				      &bkpfs_vroot_iops, &bkpfs_vroot_fops);
+}
+
+/* ".versions/NAME": the versions of the regular file NAME */
+static struct dentry *bkpfs_vroot_lookup(struct inode *dir,
+					 struct dentry *dentry,
+					 unsigned int flags)
+{
+	const char *name = dentry->d_name.name;
+	struct path lower_dir_path, lower_path;
+	umode_t mode;
+	int err;
+
+	d_set_d_op(dentry, &bkpfs_vdir_dops);
+	if (!strncmp(name, BKPFS_BACKUP_PREFIX, BKPFS_BACKUP_PREFIX_LEN))
+		goto negative;
+
+	bkpfs_get_lower_path(dentry->d_parent, &lower_dir_path);
+	err = vfs_path_lookup(lower_dir_path.dentry, lower_dir_path.mnt,
+			      name, 0, &lower_path);
+	bkpfs_put_lower_path(dentry->d_parent, &lower_dir_path);
+	if (err == -ENOENT)
+		goto negative;
+	if (err)
+		return ERR_PTR(err);
+	if (!d_is_reg(lower_path.dentry)) {
+		path_put(&lower_path);
+		goto negative;
+	}
+
+	/* whoever may read the file may list and read its versions */
+	mode = d_inode(lower_path.dentry)->i_mode & 0444;
+	return bkpfs_vdir_instantiate(dentry, &lower_path,
+				      S_IFDIR | mode | (mode >> 2),
+				      &bkpfs_vfile_iops, &bkpfs_vfile_fops);
+negative:
+	d_add(dentry, NULL);
+	return NULL;
+}
+
+/*
+ * A version that has to be reassembled.  Its dentry is stacked on the
+ * backup file all the same, so that it goes stale when the version is
+ * deleted and its number can be reused.
+ */
+static struct dentry *bkpfs_vver_instantiate(struct dentry *dentry,
+					     struct path *bkp_path,
+					     int version, loff_t size)
+{
+	umode_t mode = d_inode(dentry->d_parent)->i_mode & 0444;
+	struct inode *inode;
+	int err;
+
+	err = new_dentry_private_data(dentry);
+	if (err) {
+		path_put(bkp_path);
+		return ERR_PTR(err);
+	}
+	bkpfs_set_lower_path(dentry, bkp_path);
+
+	inode = bkpfs_vdir_inode(dentry->d_sb, d_inode(bkp_path->dentry),
+				 S_IFREG | mode, &bkpfs_vver_iops,
+				 &bkpfs_vver_fops);
+	if (IS_ERR(inode))
+		return ERR_CAST(inode);
+	inode->i_private = (void *)(long)version;
+	i_size_write(inode, size);
+	return d_splice_alias(inode, dentry);
+}
+
+/*
+ * ".versions/NAME/N": version N of NAME.  Looking it up doesn't change
+ * the version, whatever the way it is stored.
+ */
+static struct dentry *bkpfs_vfile_lookup(struct inode *dir,
+					 struct dentry *dentry,
+					 unsigned int flags)
+{
+	struct super_block *sb = dir->i_sb;
+	struct bkpfs_sb_info *sbi = BKPFS_SB(sb);
+	struct path main_lower_path, bkp_path;
+	struct inode *main_inode, *inode;
+	const struct cred *old_cred;
+	struct bkpfs_meta meta;
+	char canon[12];
+	int version, direct = 0, err;
+	loff_t size = 0;
+
+	d_set_d_op(dentry, &bkpfs_vdir_dops);
+	if (kstrtoint(dentry->d_name.name, 10, &version) || version < 1)
+		goto negative;
+	/* only the canonical spelling, so each version has one dentry */
+	snprintf(canon, sizeof(canon), "%d", version);
+	if (strcmp(canon, dentry->d_name.name))
+		goto negative;
+
+	main_inode = bkpfs_iget(sb, bkpfs_lower_inode(dir));
+	if (IS_ERR(main_inode))
+		return ERR_CAST(main_inode);
+	bkpfs_get_lower_path(dentry->d_parent, &main_lower_path);
+
+	/* versions still in the backup queue show up once they're done */
+	mutex_lock(&BKPFS_I(main_inode)->backup_mutex);
+	err = bkpfs_get_meta(main_inode, main_lower_path.dentry, &meta);
+	if (!err && !bkpfs_vindex_live(&BKPFS_I(main_inode)->vindex, version))
+		err = -ENOENT;
+	if (!err) {
+		old_cred = override_creds(sbi->creator_cred);
+		err = bkpfs_version_lookup(sb, &main_lower_path, version,
+					   &bkp_path);
+		if (!err) {
+			direct = bkpfs_version_direct(bkp_path.dentry, &size);
+			if (direct < 0) {
+				path_put(&bkp_path);
+				err = direct;
+			}
+		}
+		revert_creds(old_cred);
+	}
+	mutex_unlock(&BKPFS_I(main_inode)->backup_mutex);
+	iput(main_inode);
+	bkpfs_put_lower_path(dentry->d_parent, &main_lower_path);
+	if (!err && !direct)
+		return bkpfs_vver_instantiate(dentry, &bkp_path, version,
+					      size);
+	if (err == -ENOENT || err == -ENODATA)
+		goto negative;
+	if (err)
+		return ERR_PTR(err);
+
+	err = new_dentry_private_data(dentry);
+	if (err) {
+		path_put(&bkp_path);
+		return ERR_PTR(err);
+	}
+	bkpfs_set_lower_path(dentry, &bkp_path);
+	inode = bkpfs_iget(sb, d_inode(bkp_path.dentry));
+	if (IS_ERR(inode))
+		return ERR_CAST(inode);
+	set_bit(BKPFS_I_VERSION, &BKPFS_I(inode)->state);
+	return d_splice_alias(inode, dentry);
+negative:
+	d_add(dentry, NULL);
+	return NULL;
+}
+
+/* reassemble the version from what it is stored as, like the view ioctl */
+static ssize_t bkpfs_vver_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	struct bkpfs_sb_info *sbi = BKPFS_SB(inode->i_sb);
+	int version = (long)inode->i_private;
+	/* ".versions/NAME", which can't be renamed */
+	struct dentry *dir = file->f_path.dentry->d_parent;
+	struct path main_lower_path, bkp_path;
+	const struct cred *old_cred;
+	struct inode *main_inode;
+	ssize_t ret;
+
+	main_inode = bkpfs_iget(inode->i_sb, bkpfs_lower_inode(d_inode(dir)));
+	if (IS_ERR(main_inode))
+		return PTR_ERR(main_inode);
+	bkpfs_get_lower_path(dir, &main_lower_path);
+	bkpfs_get_lower_path(file->f_path.dentry, &bkp_path);
+
+	/* keeps the version and its parents from being folded or deleted */
+	mutex_lock(&BKPFS_I(main_inode)->backup_mutex);
+	/* the number may be another version's by now */
+	if (d_unlinked(bkp_path.dentry)) {
+		ret = -ESTALE;
+	} else {
+		old_cred = override_creds(sbi->creator_cred);
+		ret = bkpfs_read_version(inode->i_sb, &main_lower_path,
+					 version, to, &iocb->ki_pos);
+		revert_creds(old_cred);
+	}
+	mutex_unlock(&BKPFS_I(main_inode)->backup_mutex);
+	bkpfs_put_lower_path(file->f_path.dentry, &bkp_path);
+	bkpfs_put_lower_path(dir, &main_lower_path);
+	iput(main_inode);
+	if (ret >= 0)
+		file_accessed(file);
+	return ret;
+}
+
+/* ".versions" can't be listed: that would mean reading every file's meta */
+static int bkpfs_vroot_iterate(struct file *file, struct dir_context *ctx)
+{
+	dir_emit_dots(file, ctx);
+	return 0;
+}
+
+/* list the live versions of a file, oldest first */
+static int bkpfs_vfile_iterate(struct file *file, struct dir_context *ctx)
+{
+	struct inode *dir = file_inode(file);
+	struct inode *main_inode;
+	struct bkpfs_vindex *vi;
+	struct bkpfs_meta meta;
+	struct path main_lower_path;
+	unsigned int i, nr = 0;
+	char name[12];
+	int *ver = NULL;
+	int len, err;
+
+	if (!dir_emit_dots(file, ctx))
+		return 0;
+
+	main_inode = bkpfs_iget(dir->i_sb, bkpfs_lower_inode(dir));
+	if (IS_ERR(main_inode))
+		return PTR_ERR(main_inode);
+	vi = &BKPFS_I(main_inode)->vindex;
+	bkpfs_get_lower_path(file->f_path.dentry, &main_lower_path);
+
+	/* take a copy, so no lock is held while copying out to the user */
+	mutex_lock(&BKPFS_I(main_inode)->backup_mutex);
+	err = bkpfs_get_meta(main_inode, main_lower_path.dentry, &meta);
+	if (!err && ctx->pos - 2 < vi->nr) {
+		nr = vi->nr - (ctx->pos - 2);
+		ver = kmalloc_array(nr, sizeof(int), GFP_KERNEL);
+		if (!ver)
+			err = -ENOMEM;
+		for (i = 0; ver && i < nr; i++)
+			ver[i] = vi->ver[ctx->pos - 2 + i].version;
+	}
+	mutex_unlock(&BKPFS_I(main_inode)->backup_mutex);
+	bkpfs_put_lower_path(file->f_path.dentry, &main_lower_path);
+	iput(main_inode);
+	if (err == -ENODATA)
+		err = 0;
+
+	/* d_ino is not the version's inode number: that takes a lookup */
+	for (i = 0; !err && i < nr; i++) {
+		len = snprintf(name, sizeof(name), "%d", ver[i]);
+		if (!dir_emit(ctx, name, len, dir->i_ino, DT_REG))
+			break;
+		ctx->pos++;
+	}
+	kfree(ver);
+	return err;
+}
+
+static const struct inode_operations bkpfs_vroot_iops = {
+	.lookup		= bkpfs_vroot_lookup,
+};
+
+static const struct inode_operations bkpfs_vfile_iops = {
+	.lookup		= bkpfs_vfile_lookup,
+};
+
+static const struct inode_operations bkpfs_vver_iops = {
+	.getattr	= simple_getattr,
+};
+
+static const struct file_operations bkpfs_vroot_fops = {
+	.llseek		= generic_file_llseek,
+	.read		= generic_read_dir,
+	.iterate_shared	= bkpfs_vroot_iterate,
+};
+
+static const struct file_operations bkpfs_vfile_fops = {
+	.llseek		= generic_file_llseek,
+	.read		= generic_read_dir,
+	.iterate_shared	= bkpfs_vfile_iterate,
+};
+
+static const struct file_operations bkpfs_vver_fops = {
+	.llseek		= generic_file_llseek,
+	.read_iter	= bkpfs_vver_read_iter,
+	.splice_read	= generic_file_splice_read,
+};
@@ -0,0 +1,595 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "bkpfs.h"
+
+/*
+ * On-disk version metadata of a main file.  All counters live in one
+ * fixed-layout record stored in a single trusted xattr of the lower
+ * file, so they are read and updated atomically with one call each.
+ * The record ends with one slot per live version, in ascending order;
+ * nr_slots says how many follow.
+ */
+#define BKPFS_META_MAGIC	0x6670626b	/* "bkpf" */
+#define BKPFS_META_FORMAT	1
+
+struct bkpfs_ver_disk {
+	__le32 version;
+	__le32 flags;
+	__le64 size;		/* bytes allocated to the backup file */
+	__le32 csum;		/* crc32c of the data, if BKPFS_VER_CSUM */
+	__le32 reserved;
+};
+
+struct bkpfs_meta_disk {
+	__le32 magic;
+	__le16 format;
+	__le16 nr_slots;
+	__le32 min_version;
+	__le32 max_version;
+	__le32 cur_version;
+	__le32 num_version;
+	struct bkpfs_ver_disk ver[];
+};
+
+/* the four xattrs that held the counters before the packed record */
+static const char *const bkpfs_legacy_xattrs[] = {
+	"user.min_version",
+	"user.max_version",
+	"user.cur_version",
+	"user.num_version",
+};
+
+/* counters of a file that has no versions yet */
+void bkpfs_init_meta(struct bkpfs_meta *meta)
+{
+	meta->min_version = 1;
+	meta->max_version = BKPFS_DEFAULT_MAX_VERSIONS;
+	meta->cur_version = 0;
+	meta->num_version = 0;
+}
+
+/* recompute the counters that follow from the live versions */
+void bkpfs_meta_from_vindex(struct bkpfs_meta *meta,
+			    const struct bkpfs_vindex *vi)
+{
+	meta->num_version = vi->nr;
+	if (vi->nr) {
+		meta->min_version = vi->ver[0].version;
+		meta->cur_version = vi->ver[vi->nr - 1].version;
+	} else {
+		/* no versions left: restart the numbering */
+		meta->min_version = 1;
+		meta->cur_version = 0;
+	}
+}
+
+/* position of the first live version >= @version (binary search) */
+unsigned int bkpfs_vindex_find(const struct bkpfs_vindex *vi, int version)
+{
+	unsigned int lo = 0, hi = vi->nr, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (vi->ver[mid].version < version)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* oldest live version newer than @version, or 0 */
+int bkpfs_vindex_next(const struct bkpfs_vindex *vi, int version)
+{
+	unsigned int pos = bkpfs_vindex_find(vi, version + 1);
+
+	return pos < vi->nr ? vi->ver[pos].version : 0;
+}
+
+/* newest live version older than @version, or 0 */
+int bkpfs_vindex_prev(const struct bkpfs_vindex *vi, int version)
+{
+	unsigned int pos = bkpfs_vindex_find(vi, version);
+
+	return pos ? vi->ver[pos - 1].version : 0;
+}
+
+/* is @version a live version? */
+bool bkpfs_vindex_live(const struct bkpfs_vindex *vi, int version)
+{
+	unsigned int pos = bkpfs_vindex_find(vi, version);
+
+	return pos < vi->nr && vi->ver[pos].version == version;
+}
+
+int bkpfs_vindex_add(struct bkpfs_vindex *vi, int version)
+{
+	struct bkpfs_vslot *ver;
+	unsigned int pos;
+
+	if (vi->nr == vi->size) {
+		ver = krealloc(vi->ver, max(2 * vi->size, 8U) * sizeof(*ver),
+			       GFP_NOFS);
+		if (!ver)
+			return -ENOMEM;
+		vi->ver = ver;
+		vi->size = max(2 * vi->size, 8U);
+	}
+	/* new versions are the newest, so this is normally an append */
+	pos = bkpfs_vindex_find(vi, version);
+	if (pos < vi->nr && vi->ver[pos].version == version)
+		return -EEXIST;
+	memmove(&vi->ver[pos + 1], &vi->ver[pos],
+		(vi->nr - pos) * sizeof(*ver));
+	vi->ver[pos].version = version;
+	vi->ver[pos].flags = 0;
+	vi->ver[pos].bytes = 0;
+	vi->ver[pos].csum = 0;
+	vi->nr++;
+	return 0;
+}
+
+void bkpfs_vindex_del(struct bkpfs_vindex *vi, int version)
+{
+	unsigned int pos = bkpfs_vindex_find(vi, version);
+
+	if (pos == vi->nr || vi->ver[pos].version != version)
+		return;
+	vi->bytes -= vi->ver[pos].bytes;
+	vi->nr--;
+	memmove(&vi->ver[pos], &vi->ver[pos + 1],
+		(vi->nr - pos) * sizeof(vi->ver[0]));
+}
+
+/* record the space taken by the backup file of @version */
+void bkpfs_vindex_set_bytes(struct bkpfs_vindex *vi, int version,
+			    loff_t bytes)
+{
+	unsigned int pos = bkpfs_vindex_find(vi, version);
+
+	if (pos == vi->nr || vi->ver[pos].version != version)
+		return;
+	vi->bytes += bytes - vi->ver[pos].bytes;
+	vi->ver[pos].bytes = bytes;
+}
+
+void bkpfs_vindex_free(struct bkpfs_vindex *vi)
+{
+	kfree(vi->ver);
+	vi->ver = NULL;
+	vi->nr = 0;
+	vi->size = 0;
+	vi->bytes = 0;
+}
+
+/*
+ * Build the index of a record that doesn't have one (written by an older
+ * bkpfs) by looking for every version between min and cur once.  Older
+ * versions of bkpfs only kept backups next to the main file.
+ */
+static int bkpfs_scan_vindex(struct dentry *lower_dentry,
+			     struct bkpfs_meta *meta, struct bkpfs_vindex *vi)
+{
+	char name[NAME_MAX + 1];
+	struct dentry *lower_dir, *bkp_dentry;
+	int i, len, err = 0;
+
+	lower_dir = dget_parent(lower_dentry);
+	for (i = meta->min_version; i <= meta->cur_version; i++) {
+		len = snprintf(name, sizeof(name), BKPFS_BACKUP_PREFIX "%s.%d",
+			       lower_dentry->d_name.name, i);
+		if (len >= sizeof(name)) {
+			err = -ENAMETOOLONG;
+			break;
+		}
+		bkp_dentry = lookup_one_len_unlocked(name, lower_dir, len);
+		if (IS_ERR(bkp_dentry)) {
+			err = PTR_ERR(bkp_dentry);
+			break;
+		}
+		if (d_really_is_positive(bkp_dentry))
+			err = bkpfs_vindex_add(vi, i);
+		dput(bkp_dentry);
+		if (err)
+			break;
+	}
+	dput(lower_dir);
+	if (err)
+		return err;
+	bkpfs_meta_from_vindex(meta, vi);
+	return bkpfs_write_meta(lower_dentry, meta, vi);
+}
+
+/*
+ * Convert the counters of a file written by an older bkpfs into the
+ * packed record.  Returns -ENODATA if the file never had versions.
+ */
+static int bkpfs_migrate_meta(struct dentry *lower_dentry,
+			      struct bkpfs_meta *meta,
+			      struct bkpfs_vindex *vi)
+{
+	int val[ARRAY_SIZE(bkpfs_legacy_xattrs)];
+	ssize_t ret;
+	int i, err;
+
+	for (i = 0; i < ARRAY_SIZE(bkpfs_legacy_xattrs); i++) {
+		ret = vfs_getxattr(lower_dentry, bkpfs_legacy_xattrs[i],
+				   &val[i], sizeof(int));
+		if (ret == -EOPNOTSUPP)
+			return -ENODATA;
+		if (ret < 0)
+			return ret;
+		if (ret != sizeof(int))
+			return -EUCLEAN;
+	}
+	meta->min_version = val[0];
+	meta->max_version = val[1];
+	meta->cur_version = val[2];
+	meta->num_version = val[3];
+
+	err = bkpfs_scan_vindex(lower_dentry, meta, vi);
+	if (err)
+		return err;
+	for (i = 0; i < ARRAY_SIZE(bkpfs_legacy_xattrs); i++)
+		vfs_removexattr(lower_dentry, bkpfs_legacy_xattrs[i]);
+	return 0;
+}
+
+/**
+ * bkpfs_read_meta - read the version counters and index of a file
+ * @lower_dentry: lower dentry of the main file
+ * @meta: filled with the counters
+ * @vi: empty index, filled with the live versions
+ *
+ * Returns -ENODATA if the file has never had versions.
+ */
+int bkpfs_read_meta(struct dentry *lower_dentry, struct bkpfs_meta *meta,
+		    struct bkpfs_vindex *vi)
+{
+	struct inode *lower_inode = d_inode(lower_dentry);
+	struct bkpfs_meta_disk *disk;
+	ssize_t ret;
+	int i, nr, err;
+
+	if (!(lower_inode->i_opflags & IOP_XATTR))
+		return -EOPNOTSUPP;
+
+	ret = __vfs_getxattr(lower_dentry, lower_inode, BKPFS_META_XATTR,
+			     NULL, 0);
+	if (ret == -ENODATA)
+		return bkpfs_migrate_meta(lower_dentry, meta, vi);
+	if (ret < 0)
+		return ret;
+	if (ret < sizeof(*disk))
+		return -EUCLEAN;
+	disk = kmalloc(ret, GFP_NOFS);
+	if (!disk)
+		return -ENOMEM;
+	ret = __vfs_getxattr(lower_dentry, lower_inode, BKPFS_META_XATTR,
+			     disk, ret);
+	if (ret < 0) {
+		err = ret;
+		goto out;
+	}
+	nr = le16_to_cpu(disk->nr_slots);
+	if (ret < sizeof(*disk) + nr * sizeof(disk->ver[0]) ||
+	    le32_to_cpu(disk->magic) != BKPFS_META_MAGIC) {
+		err = -EUCLEAN;
+		goto out;
+	}
+	if (le16_to_cpu(disk->format) != BKPFS_META_FORMAT) {
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+
+	meta->min_version = le32_to_cpu(disk->min_version);
+	meta->max_version = le32_to_cpu(disk->max_version);
+	meta->cur_version = le32_to_cpu(disk->cur_version);
+	meta->num_version = le32_to_cpu(disk->num_version);
+
+	/* records written before the index was kept have no slots */
+	if (!nr && meta->num_version) {
+		err = bkpfs_scan_vindex(lower_dentry, meta, vi);
+		goto out;
+	}
+	for (err = 0, i = 0; !err && i < nr; i++) {
+		err = bkpfs_vindex_add(vi, le32_to_cpu(disk->ver[i].version));
+		if (err)
+			break;
+		bkpfs_vindex_set_bytes(vi, le32_to_cpu(disk->ver[i].version),
+				       le64_to_cpu(disk->ver[i].size));
+		/* slots are in order, so that was an append */
+		vi->ver[vi->nr - 1].flags = le32_to_cpu(disk->ver[i].flags);
+		vi->ver[vi->nr - 1].csum = le32_to_cpu(disk->ver[i].csum);
+	}
+	if (!err)
+		bkpfs_meta_from_vindex(meta, vi);
+out:
+	if (err)
+		bkpfs_vindex_free(vi);
+	kfree(disk);
+	return err;
+}
+
+/**
+ * bkpfs_write_meta - store the version counters and index of a file
+ * @lower_dentry: lower dentry of the main file
+ * @meta: the counters
+ * @vi: the live versions
+ *
+ * The record is internal to bkpfs, so it is written without the
+ * permission checks that would apply to the user's own xattrs.
+ */
+int bkpfs_write_meta(struct dentry *lower_dentry,
+		     const struct bkpfs_meta *meta,
+		     const struct bkpfs_vindex *vi)
+{
+	struct inode *lower_inode = d_inode(lower_dentry);
+	struct bkpfs_meta_disk *disk;
+	size_t size;
+	int i, err;
+
+	if (!(lower_inode->i_opflags & IOP_XATTR))
+		return -EOPNOTSUPP;
+
+	size = sizeof(*disk) + vi->nr * sizeof(disk->ver[0]);
+	if (size > XATTR_SIZE_MAX || vi->nr > U16_MAX)
+		return -E2BIG;
+	disk = kzalloc(size, GFP_NOFS);
+	if (!disk)
+		return -ENOMEM;
+	disk->magic = cpu_to_le32(BKPFS_META_MAGIC);
+	disk->format = cpu_to_le16(BKPFS_META_FORMAT);
+	disk->nr_slots = cpu_to_le16(vi->nr);
+	disk->min_version = cpu_to_le32(meta->min_version);
+	disk->max_version = cpu_to_le32(meta->max_version);
+	disk->cur_version = cpu_to_le32(meta->cur_version);
+	disk->num_version = cpu_to_le32(meta->num_version);
+	for (i = 0; i < vi->nr; i++) {
+		disk->ver[i].version = cpu_to_le32(vi->ver[i].version);
+		disk->ver[i].flags = cpu_to_le32(vi->ver[i].flags);
+		disk->ver[i].size = cpu_to_le64(vi->ver[i].bytes);
+		disk->ver[i].csum = cpu_to_le32(vi->ver[i].csum);
+	}
+
+	inode_lock(lower_inode);
+	err = __vfs_setxattr_noperm(lower_dentry, BKPFS_META_XATTR,
+				    disk, size, 0);
+	inode_unlock(lower_inode);
+	kfree(disk);
+	return err;
+}
+
+/**
+ * bkpfs_check_max_versions - does the index of maxver= versions fit?
+ * @lower_root: lower directory we are mounted on
+ * @max_versions: the maxver= value
+ *
+ * The index of a file is one xattr of the lower file, and lower file
+ * systems limit its size (ext4 to what fits in a block).  A record for
+ * @max_versions versions is written to an unnamed temporary file in the
+ * lower directory to see whether it fits; if the lower fs can't make
+ * one, the record has to fit in a block.  Returns -EINVAL if it doesn't.
+ */
+int bkpfs_check_max_versions(struct path *lower_root,
+			     unsigned int max_versions)
+{
+	struct dentry *root = lower_root->dentry;
+	struct bkpfs_meta_disk *disk;
+	struct dentry *tmp;
+	size_t size;
+	int err;
+
+	size = sizeof(*disk) + (size_t)max_versions * sizeof(disk->ver[0]);
+	if (size > XATTR_SIZE_MAX || max_versions > U16_MAX)
+		goto too_many;
+	/* there is no index at all then */
+	if (!(d_inode(root)->i_opflags & IOP_XATTR))
+		return 0;
+
+	tmp = vfs_tmpfile(root, S_IFREG | 0600, O_RDWR);
+	if (IS_ERR(tmp)) {
+		if (size > root->d_sb->s_blocksize)
+			goto too_many;
+		return 0;
+	}
+	disk = kzalloc(size, GFP_KERNEL);
+	if (!disk) {
+		dput(tmp);
+		return -ENOMEM;
+	}
+	inode_lock(d_inode(tmp));
+	err = __vfs_setxattr_noperm(tmp, BKPFS_META_XATTR, disk, size, 0);
+	inode_unlock(d_inode(tmp));
+	kfree(disk);
+	dput(tmp);
+	if (!err || err == -EOPNOTSUPP)
+		return 0;
+	if (err == -ENOMEM)
+		return err;
+too_many:
+	printk(KERN_ERR "bkpfs: maxver=%u: the version index doesn't fit "
+	       "in an xattr of the lower file system\n", max_versions);
+	return -EINVAL;
+}
+
+/*
+ * The counters are cached in the bkpfs inode the first time they are
+ * needed.  Backup, delete and restore update the cached copy only; it is
+ * written back to the lower file when a backup job finishes, on release,
+ * on fsync and when the inode is evicted.  All of this is serialized by
+ * the inode's backup_mutex.
+ */
+
+/**
+ * bkpfs_get_meta - get the (cached) version counters of a file
+ * @inode: bkpfs inode of the main file
+ * @lower_dentry: lower dentry of the main file, to load the cache from
+ * @meta: filled with the counters
+ *
+ * The live versions are then in BKPFS_I(@inode)->vindex.  Returns
+ * -ENODATA if the file has never had versions.  Must be called with the
+ * inode's backup_mutex held.
+ */
+int bkpfs_get_meta(struct inode *inode, struct dentry *lower_dentry,
+		   struct bkpfs_meta *meta)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	int err;
+
+	lockdep_assert_held(&info->backup_mutex);
+
+	if (!test_bit(BKPFS_I_META_VALID, &info->state)) {
+		err = bkpfs_read_meta(lower_dentry, &info->meta,
+				      &info->vindex);
+		if (err == -ENODATA) {
+			bkpfs_init_meta(&info->meta);
+			set_bit(BKPFS_I_META_NONE, &info->state);
+		} else if (err) {
+			bkpfs_vindex_free(&info->vindex);
+			return err;
+		}
+		set_bit(BKPFS_I_META_VALID, &info->state);
+	}
+	if (test_bit(BKPFS_I_META_NONE, &info->state))
+		return -ENODATA;
+	*meta = info->meta;
+	return 0;
+}
+
+/**
+ * bkpfs_set_meta - update the cached version counters of a file
+ * @inode: bkpfs inode of the main file
+ * @meta: the new counters
+ *
+ * Must be called with the inode's backup_mutex held.
+ */
+void bkpfs_set_meta(struct inode *inode, const struct bkpfs_meta *meta)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+
+	lockdep_assert_held(&info->backup_mutex);
+
+	info->meta = *meta;
+	set_bit(BKPFS_I_META_VALID, &info->state);
+	clear_bit(BKPFS_I_META_NONE, &info->state);
+	set_bit(BKPFS_I_META_DIRTY, &info->state);
+}
+
+/* like bkpfs_sync_meta, with the backup_mutex already held */
+int __bkpfs_sync_meta(struct inode *inode, struct dentry *lower_dentry)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	int err;
+
+	lockdep_assert_held(&info->backup_mutex);
+
+	if (!test_and_clear_bit(BKPFS_I_META_DIRTY, &info->state))
+		return 0;
+	/* nobody will ever read them back */
+	if (!d_inode(lower_dentry)->i_nlink)
+		return 0;
+	err = bkpfs_write_meta(lower_dentry, &info->meta, &info->vindex);
+	if (err)
+		set_bit(BKPFS_I_META_DIRTY, &info->state);
+	return err;
+}
+
+/**
+ * bkpfs_sync_meta - write the cached version counters back
+ * @inode: bkpfs inode of the main file
+ * @lower_dentry: lower dentry of the main file
+ *
+ * Does nothing unless the counters changed since they were last written.
+ */
+int bkpfs_sync_meta(struct inode *inode, struct dentry *lower_dentry)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	int err;
+
+	if (!test_bit(BKPFS_I_META_DIRTY, &info->state))
+		return 0;
+	mutex_lock(&info->backup_mutex);
+	err = __bkpfs_sync_meta(inode, lower_dentry);
+	mutex_unlock(&info->backup_mutex);
+	return err;
+}
+
+/**
+ * bkpfs_set_version_bytes - record the size of a finished version
+ * @inode: bkpfs inode of the main file
+ * @version: the version
+ * @bytes: space allocated to its backup file
+ *
+ * Must be called with the inode's backup_mutex held.
+ */
+void bkpfs_set_version_bytes(struct inode *inode, int version, loff_t bytes)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+
+	lockdep_assert_held(&info->backup_mutex);
+
+	bkpfs_vindex_set_bytes(&info->vindex, version, bytes);
+	set_bit(BKPFS_I_META_DIRTY, &info->state);
+}
+
+/**
+ * bkpfs_set_version_csum - record the checksum of a finished version
+ * @inode: bkpfs inode of the main file
+ * @version: the version
+ * @csum: crc32c of its data
+ *
+ * Must be called with the inode's backup_mutex held.
+ */
+void bkpfs_set_version_csum(struct inode *inode, int version, u32 csum)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_vindex *vi = &info->vindex;
+	unsigned int pos;
+
+	lockdep_assert_held(&info->backup_mutex);
+
+	pos = bkpfs_vindex_find(vi, version);
+	if (pos == vi->nr || vi->ver[pos].version != version)
+		return;
+	vi->ver[pos].csum = csum;
+	vi->ver[pos].flags |= BKPFS_VER_CSUM;
+	set_bit(BKPFS_I_META_DIRTY, &info->state);
+}
+
+/**
+ * bkpfs_mark_no_base - a restore replaced the contents of a file
+ * @inode: bkpfs inode of the main file
+ * @lower_dentry: lower dentry of the main file
+ *
+ * Outside the ranges written since, the file no longer matches its newest
+ * version, so the next version must not be a delta against it.  Unlike
+ * bkpfs_mark_all, this is kept in the metadata and so survives eviction
+ * of the inode (or its replacement by a staged restore).  Must be called
+ * with the inode's backup_mutex held.
+ */
+int bkpfs_mark_no_base(struct inode *inode, struct dentry *lower_dentry)
+{
+	struct bkpfs_inode_info *info = BKPFS_I(inode);
+	struct bkpfs_meta meta;
+	int err;
+
+	err = bkpfs_get_meta(inode, lower_dentry, &meta);
+	if (err)
+		return err == -ENODATA ? 0 : err;
+	if (info->vindex.nr) {
+		info->vindex.ver[info->vindex.nr - 1].flags |=
+			BKPFS_VER_NO_BASE;
+		set_bit(BKPFS_I_META_DIRTY, &info->state);
+	}
+	return 0;
+}